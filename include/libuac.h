@@ -116,9 +116,91 @@ namespace uac {
         UAC_FORMAT_DATA_ANY = 0xFFFF
     };
 
+    /**
+     * @brief The sample format delivered by a capture stream
+     */
+    enum uac_sample_format {
+        UAC_SAMPLE_FORMAT_RAW = 0, // as sent by the device
+        UAC_SAMPLE_FORMAT_S16,
+        UAC_SAMPLE_FORMAT_S32,
+        UAC_SAMPLE_FORMAT_FLOAT32, // normalized to [-1, 1)
+    };
+
+    /**
+     * @brief The filter length of the stream sample-rate converter
+     */
+    enum uac_resampler_quality {
+        UAC_RESAMPLER_QUALITY_LOW = 0,  // 8 taps per phase
+        UAC_RESAMPLER_QUALITY_MEDIUM,   // 16 taps per phase
+        UAC_RESAMPLER_QUALITY_HIGH,     // 32 taps per phase
+    };
+
     class uac_device;
     class uac_device_handle;
 
+    /**
+     * @brief How the devices of a sharded context are spread across its event threads
+     */
+    enum uac_shard_policy {
+        UAC_SHARD_BY_LOAD = 0, // the shard with the fewest devices
+        UAC_SHARD_BY_BUS,      // the USB bus number modulo the number of shards
+    };
+
+    /**
+     * @brief Options of a context which creates its own LibUSB context.
+     */
+    struct uac_context_options {
+        /**
+         * @brief Handles USB events on a thread of the context.
+         *
+         * Leave it false to drive the events from an application loop, see uac_context::get_pollfds().
+         */
+        bool eventThread = true;
+
+        /**
+         * @brief The SCHED_FIFO priority of the event thread from 1 to 99, 0 keeps the default scheduling.
+         */
+        int eventThreadPriority = 0;
+
+        /**
+         * @brief The CPU the event thread is pinned to, -1 for any.
+         *
+         * The event thread of shard n is pinned to this CPU + n.
+         */
+        int eventThreadCpu = -1;
+
+        /**
+         * @brief The number of LibUSB contexts, each with its own event thread, the devices are spread across.
+         *
+         * The completions of the devices of one shard are handled by its thread only, so hosts with many
+         * streaming devices scale with cores. A device stays on its shard for the lifetime of the context.
+         */
+        uint32_t shards = 1;
+        uac_shard_policy shardPolicy = UAC_SHARD_BY_LOAD;
+    };
+
+    /**
+     * @brief Called when a file descriptor is added to the ones polled for USB events.
+     *
+     * The events are the poll() events to wait for.
+     */
+    using pollfd_added_func = std::function<void(int fd, short events)>;
+
+    /**
+     * @brief Called when a file descriptor is no longer polled for USB events.
+     */
+    using pollfd_removed_func = std::function<void(int fd)>;
+
+    /**
+     * @brief Called with an audio device which was plugged in, or was present when the callback was set.
+     */
+    using device_arrived_func = std::function<void(const std::shared_ptr<uac_device>&)>;
+
+    /**
+     * @brief Called with an audio device which was unplugged.
+     */
+    using device_left_func = std::function<void(const std::shared_ptr<uac_device>&)>;
+
     /**
      * @brief The libuac context
      *
@@ -128,7 +210,7 @@ namespace uac {
     class uac_context {
     public:
         /**
-         * @brief Creates a new context using the default LibUSB context.
+         * @brief Creates a new context with its own LibUSB context.
          * 
          * It will create a new thread that will handle USB events.
          * 
@@ -145,11 +227,25 @@ namespace uac {
          * @return std::shared_ptr<uac_context> 
          */
         static std::shared_ptr<uac_context> create(libusb_context *usb_ctx);
+
+        /**
+         * @brief Creates a new context with its own LibUSB context.
+         *
+         * Without an event thread, the application polls get_pollfds(), with get_next_timeout(), and calls
+         * handle_events() whenever one of them is ready or the timeout expired.
+         *
+         * @param options
+         * @return std::shared_ptr<uac_context>
+         */
+        static std::shared_ptr<uac_context> create(const uac_context_options& options);
         virtual ~uac_context() = default;
 
         /**
          * @brief Queries all devices which support USB Audio Class.
          * 
+         * Devices still referenced by the application are returned as the same objects. Where LibUSB reports
+         * hotplug events, the context tracks the present devices and this does not rescan the bus.
+         * 
          * @return std::vector<std::shared_ptr<uac_device>> 
          */
         virtual std::vector<std::shared_ptr<uac_device>> query_all_devices() = 0;
@@ -163,6 +259,50 @@ namespace uac {
          * @return std::shared_ptr<uac_device_handle> 
          */
         virtual std::shared_ptr<uac_device_handle> wrap(int fd) = 0;
+
+        /**
+         * @brief The file descriptors to poll for USB events.
+         *
+         * Covers all shards, and includes the wake-up descriptors of the context, see wake().
+         *
+         * @return std::vector<libusb_pollfd> descriptors with the poll() events to wait for
+         */
+        virtual std::vector<libusb_pollfd> get_pollfds() const = 0;
+
+        /**
+         * @brief Tracks changes of the descriptors returned by get_pollfds().
+         *
+         * The notifiers may be called from any thread, also from within handle_events(). Pass empty functions to remove them.
+         */
+        virtual void set_pollfd_notifiers(pollfd_added_func added, pollfd_removed_func removed) = 0;
+
+        /**
+         * @brief The time until handle_events() must be called even though no descriptor became ready.
+         *
+         * @return int milliseconds, or -1 if there is no pending timeout
+         */
+        virtual int get_next_timeout() const = 0;
+
+        /**
+         * @brief Handles pending USB events of all shards without blocking.
+         */
+        virtual void handle_events() = 0;
+
+        /**
+         * @brief Makes the wake-up descriptor ready, so a loop blocked in poll() returns at once.
+         */
+        virtual void wake() = 0;
+
+        /**
+         * @brief Tracks audio devices as they are plugged in and out.
+         *
+         * arrived is called at once for every audio device present, then on the event thread for every new one.
+         * left is called on the event thread for unplugged devices which are still referenced somewhere.
+         * Pass empty functions to remove them.
+         *
+         * @return false if LibUSB does not report hotplug events on this platform
+         */
+        virtual bool set_hotplug_callbacks(device_arrived_func arrived, device_left_func left) = 0;
     };
 
     class uac_audio_route;
@@ -238,6 +378,41 @@ namespace uac {
     struct uac_audio_config_compressed {
     };
 
+    /**
+     * @brief A criterion for ranking the configurations of a stream interface, see uac_config_request.
+     */
+    enum uac_config_preference {
+        UAC_PREFER_CLOSEST_RATE = 0,  // the requested rate, or else the nearest supported one
+        UAC_PREFER_LOWEST_BANDWIDTH,  // the fewest audio bytes per second, then the smallest wMaxPacketSize
+        UAC_PREFER_HIGHEST_BIT_DEPTH, // the highest bBitResolution
+        UAC_PREFER_FEWEST_CHANNELS,   // the fewest channels allowed by minChannels
+    };
+
+    /**
+     * @brief What a caller needs from a stream, for uac_stream_if::negotiate_config().
+     */
+    struct uac_config_request {
+        uac_audio_data_format_type format = UAC_FORMAT_DATA_ANY;
+
+        /**
+         * @brief The wanted sampling rate, 0 takes the highest rate of each altsetting.
+         */
+        uint32_t sampleRate = 0;
+
+        /**
+         * @brief Rejects altsettings which don't support sampleRate, instead of falling back to the closest rate.
+         */
+        bool exactRate = false;
+
+        uint8_t minChannels = 1;
+        uint8_t maxChannels = 255;
+
+        /**
+         * @brief The criteria in order of importance, a tie on one falls through to the next, then to the altsetting order.
+         */
+        std::vector<uac_config_preference> preferences = {UAC_PREFER_CLOSEST_RATE, UAC_PREFER_HIGHEST_BIT_DEPTH, UAC_PREFER_LOWEST_BANDWIDTH};
+    };
+
     class uac_stream_if {
     public:
         virtual ~uac_stream_if() = default;
@@ -249,21 +424,266 @@ namespace uac {
         virtual std::unique_ptr<const uac_audio_config_uncompressed> query_config_uncompressed(uac_audio_data_format_type audioDataFormatType,
                                                                          uint8_t numChannels,
                                                                          uint32_t sampleRate) const = 0;
+
+        /**
+         * @brief Ranks every uncompressed configuration which satisfies the request by its preferences.
+         *
+         * @return the configurations, the best first
+         */
+        virtual std::vector<uac_audio_config_uncompressed> rank_configs(const uac_config_request& request) const = 0;
+
+        /**
+         * @brief The best uncompressed configuration for the request, or nullptr if none satisfies it.
+         */
+        virtual std::unique_ptr<const uac_audio_config_uncompressed> negotiate_config(const uac_config_request& request) const = 0;
     };
 
     class uac_stream_handle;
+    class uac_stream_handle_impl;
     using stream_cb_func = std::function<void(uint8_t*, uint)>;
 
+    /**
+     * @brief A single ISO packet within a completed transfer
+     */
+    struct uac_packet_desc {
+        uint32_t offset; // from the beginning of the transfer buffer
+        uint32_t actual_length;
+        int status; // libusb_transfer_status
+        bool discontinuity; // the packet was lost and replaced with silence
+    };
+
+    /**
+     * @brief The host time of a frame of a stream
+     */
+    struct uac_timestamp {
+        uint64_t frame;      // device frames since the stream started
+        int64_t time;        // CLOCK_MONOTONIC in nanoseconds
+        double frame_period; // estimated nanoseconds per device frame
+    };
+
+    /**
+     * @brief A completed USB transfer delivered without copying.
+     *
+     * The buffer and packet descriptors are valid only during the callback.
+     */
+    struct uac_transfer_data {
+        uint8_t *buffer;
+        const uac_packet_desc *packets;
+        uint num_packets;
+        uac_timestamp timestamp; // of the first frame of the first packet
+    };
+    using stream_transfer_cb_func = std::function<void(const uac_transfer_data&)>;
+
+    /**
+     * @brief Fills the buffer with frames to be played and returns the number of frames written.
+     *
+     * Missing frames are replaced with silence.
+     */
+    using playback_cb_func = std::function<uint(uint8_t*, uint)>;
+
+    class uac_duplex_stream_handle;
+
+    /**
+     * @brief Receives captured frames and fills the same number of frames to be played.
+     *
+     * The capture buffer holds frames * capture stride bytes and the playback buffer frames * playback stride bytes.
+     */
+    using duplex_cb_func = std::function<void(const uint8_t*, uint8_t*, uint)>;
+
+    /**
+     * @brief A histogram with power-of-two buckets
+     */
+    struct uac_histogram {
+        static constexpr size_t BUCKETS = 16;
+
+        /**
+         * Bucket 0 counts the value 0, bucket i > 0 the values from 2^(i-1) to 2^i - 1,
+         * and the last bucket all values from 2^(BUCKETS-2).
+         */
+        uint64_t counts[BUCKETS];
+    };
+
+    /**
+     * @brief Counters of a stream since it started
+     */
+    struct uac_stream_metrics {
+        uint64_t packets;           // ISO packets which carried data
+        uint64_t bytes;             // audio bytes received or sent
+        uint64_t short_packets;     // fewer frames than the nominal rate implies
+        uint64_t zero_packets;      // completed without data
+        uint64_t failed_packets;    // completed with an error status
+        uint64_t timeouts;          // timed out transfers
+        uint64_t resubmit_failures; // transfers which could not be resubmitted
+        uint64_t deferred_frames;   // playback frames beyond wMaxPacketSize, sent in a later packet
+        int in_flight_transfers;    // data transfers queued at the endpoint, without feedback transfers
+
+        uac_histogram callback_duration;   // microseconds spent in the transfer completion handler
+        uac_histogram completion_interval; // microseconds between completed transfers
+    };
+
+    /**
+     * @brief Options for starting an audio stream
+     */
+    struct uac_stream_options {
+        /**
+         * @brief Called on the USB event thread, or the delivery thread, for every received ISO packet.
+         *
+         * Leave it and transfer_cb_func empty to capture into the stream ring buffer instead, see uac_stream_handle::read().
+         */
+        stream_cb_func cb_func;
+
+        /**
+         * @brief Called on the USB event thread, or the delivery thread, once for every completed transfer.
+         *
+         * Takes precedence over cb_func. Packets which carry no data are reported with their status.
+         */
+        stream_transfer_cb_func transfer_cb_func;
+
+        /**
+         * @brief Called on the USB event thread to fill every ISO packet of a playback stream.
+         *
+         * With a delivery thread, it is called there for one nominal packet of frames at a time instead.
+         * Leave it empty to play from the stream ring buffer instead, see uac_stream_handle::write().
+         */
+        playback_cb_func playback_func;
+
+        /**
+         * @brief The number of ISO packets per USB transfer.
+         */
+        int burst = 1;
+
+        /**
+         * @brief The target latency of the transfer queue in milliseconds.
+         *
+         * If non-zero, the number of in-flight transfers and ISO packets per transfer are tuned at runtime,
+         * starting from this latency, and burst is ignored.
+         */
+        uint32_t targetLatency = 0;
+
+        /**
+         * @brief The capacity of the capture ring buffer in audio frames.
+         *
+         * Used only when no callback is set, for both capture and playback, or for a playback delivery thread.
+         * If 0, the buffer holds 100ms of audio.
+         */
+        uint32_t bufferFrames = 0;
+
+        /**
+         * @brief The sample format of captured audio, for PCM streams with 2, 3 or 4 byte subframes.
+         *
+         * Callbacks and read() get frames of bNrChannels samples in this format, the packet descriptors
+         * of a transfer callback refer to the converted data.
+         */
+        uac_sample_format sampleFormat = UAC_SAMPLE_FORMAT_RAW;
+
+        /**
+         * @brief Delivers captured audio channel-major, one plane of samples per channel.
+         *
+         * Every ISO packet given to a callback, or described in a transfer callback, holds bNrChannels planes
+         * of its frame count. read() fills one plane per channel, each as long as the requested frame count.
+         */
+        bool planar = false;
+
+        /**
+         * @brief Delivers captured audio at this sample rate regardless of the device rate.
+         *
+         * If non-zero and different from the device rate, a polyphase converter resamples the stream and
+         * delivers float32 samples, so sampleFormat must be UAC_SAMPLE_FORMAT_RAW or UAC_SAMPLE_FORMAT_FLOAT32.
+         * bufferFrames then counts frames at this rate.
+         */
+        uint32_t outputSampleRate = 0;
+        uac_resampler_quality resamplerQuality = UAC_RESAMPLER_QUALITY_MEDIUM;
+
+        /**
+         * @brief Runs the callbacks on a dedicated thread of the stream instead of the USB event thread.
+         *
+         * Completed capture transfers are copied into a lock-free queue and converted and delivered on that thread,
+         * so a slow callback never delays the resubmission of transfers. Playback callbacks fill a ring buffer
+         * of bufferFrames, two transfers by default, ahead of the device. Requires a callback.
+         */
+        bool deliveryThread = false;
+
+        /**
+         * @brief The SCHED_FIFO priority of the delivery thread from 1 to 99, 0 keeps the default scheduling.
+         *
+         * Raising the priority needs the privilege to do so, otherwise the thread runs with a warning.
+         */
+        int deliveryPriority = 0;
+
+        /**
+         * @brief The CPU the delivery thread is pinned to, -1 for any.
+         */
+        int deliveryCpu = -1;
+
+        /**
+         * @brief The completed capture transfers the delivery thread may lag behind.
+         *
+         * Transfers completing while the queue is full are dropped and counted in uac_stream_handle::get_dropped_frames().
+         */
+        uint32_t deliveryQueueTransfers = 32;
+    };
+
     /**
      * The device can be operated through this handle.
      */
     class uac_device_handle {
     public:
         virtual ~uac_device_handle() = default;
+
+        /**
+         * @brief Closes the USB device handle.
+         *
+         * Throws std::logic_error while streams of the device are running, stop them first.
+         * Destroying the handle closes it without the check; streams keep the handle alive until they end.
+         */
         virtual void close() = 0;
         virtual std::shared_ptr<uac_device> get_device() const = 0;
         virtual std::shared_ptr<uac_stream_handle> start_streaming(const uac_stream_if& streamIf, const uac_audio_config_uncompressed& config, stream_cb_func cb_func) = 0;
         virtual std::shared_ptr<uac_stream_handle> start_streaming(const uac_stream_if& streamIf, const uac_audio_config_uncompressed& config, stream_cb_func cb_func, int burst) = 0;
+
+        /**
+         * @brief Starts an audio stream.
+         *
+         * The direction follows the stream interface endpoint: a USB_STREAMING output terminal is captured,
+         * and a USB_STREAMING input terminal is played back.
+         *
+         * @param streamIf
+         * @param config
+         * @param options
+         * @return std::shared_ptr<uac_stream_handle>
+         */
+        virtual std::shared_ptr<uac_stream_handle> start_streaming(const uac_stream_if& streamIf, const uac_audio_config_uncompressed& config, const uac_stream_options& options) = 0;
+
+        /**
+         * @brief Starts a capture and a playback stream together on the device clock.
+         *
+         * The callback is called on the USB event thread for every received ISO packet, and the frames it fills are
+         * played exactly uac_duplex_stream_handle::get_round_trip_frames() after the captured ones.
+         * Both configurations must use the same sample rate.
+         *
+         * @param captureIf
+         * @param captureConfig
+         * @param playbackIf
+         * @param playbackConfig
+         * @param cb_func
+         * @param burst the number of ISO packets per USB transfer in both directions
+         * @return std::shared_ptr<uac_duplex_stream_handle>
+         */
+        virtual std::shared_ptr<uac_duplex_stream_handle> start_duplex_streaming(const uac_stream_if& captureIf, const uac_audio_config_uncompressed& captureConfig,
+                                                                                 const uac_stream_if& playbackIf, const uac_audio_config_uncompressed& playbackConfig,
+                                                                                 duplex_cb_func cb_func, int burst) = 0;
+
+        /**
+         * @brief Does nothing, kept for compatibility.
+         *
+         * Every stream claims its AudioStreaming interface and shares the AudioControl interface with the other
+         * streams of the device, the claims are dropped with the last stream using them, so no interface is left
+         * to release. Streams on different AudioStreaming interfaces run concurrently, a second stream on the same
+         * interface is rejected.
+         *
+         * @deprecated interfaces are released when the last stream using them stops
+         */
+        [[deprecated("interfaces are released when the last stream using them stops")]]
         virtual void detach() = 0;
 
         virtual std::string get_name() const = 0;
@@ -284,6 +704,159 @@ namespace uac {
         virtual void set_sampling_rate(uint32_t samplingRate) = 0;
 
         virtual error_code check_streaming_error() const = 0;
+
+        /**
+         * @brief Reads captured audio frames from the stream ring buffer.
+         *
+         * Available only for streams started without a callback.
+         * Blocks until all requested frames are read, the stream stops, or the timeout expires.
+         *
+         * @param buffer the destination, at least frames * bSubframeSize * bChannelCount bytes
+         * @param frames the number of audio frames to read
+         * @param timeout the timeout in milliseconds, 0 means no waiting and negative waits forever
+         * @return uint the number of frames actually read
+         */
+        virtual uint read(uint8_t *buffer, uint frames, int timeout) = 0;
+
+        /**
+         * @brief Writes audio frames to the ring buffer of a playback stream.
+         *
+         * Available only for playback streams started without a callback.
+         * Blocks until all frames are written, the stream stops, or the timeout expires.
+         *
+         * @param buffer the source, frames * bSubframeSize * bChannelCount bytes
+         * @param frames the number of audio frames to write
+         * @param timeout the timeout in milliseconds, 0 means no waiting and negative waits forever
+         * @return uint the number of frames actually written
+         */
+        virtual uint write(const uint8_t *buffer, uint frames, int timeout) = 0;
+
+        /**
+         * @brief The number of audio frames which can be read, or written for playback, without blocking.
+         *
+         * @return uint
+         */
+        virtual uint available() const = 0;
+
+        /**
+         * @brief The estimated host time of the first frame of the transfer delivered last.
+         *
+         * In a callback, this is the first frame of the delivered data. Later frames follow every frame_period
+         * nanoseconds, which tracks the device clock. For playback streams, the first frame of the transfer sent last.
+         *
+         * @return uac_timestamp zeroed until the first transfer completes
+         */
+        virtual uac_timestamp get_timestamp() const = 0;
+
+        /**
+         * @brief The number of frames replaced with silence.
+         *
+         * Captured packets lost after the first data arrived are filled with the frames the device rate
+         * implies, so the stream timeline stays continuous. Frames of transfers dropped by a full delivery queue
+         * are counted too. Playback counts the frames missing in underruns.
+         *
+         * @return uint64_t frames since the stream started
+         */
+        virtual uint64_t get_dropped_frames() const = 0;
+
+        /**
+         * @brief A snapshot of the stream counters.
+         *
+         * The counters are updated with relaxed atomics on the USB event thread, so they are cheap to keep
+         * and may be read at any time. Counters in one snapshot are not necessarily consistent with each other.
+         *
+         * @return uac_stream_metrics
+         */
+        virtual uac_stream_metrics get_metrics() const = 0;
+
+    protected:
+        friend class uac_aggregate_stream_handle;
+
+        /**
+         * @brief The library implementation behind the handle, nullptr for handles implemented elsewhere.
+         *
+         * Lets the library accept its own handles back without RTTI.
+         */
+        virtual uac_stream_handle_impl* get_impl() { return nullptr; }
+    };
+
+    /**
+     * A handle to paired capture and playback streams.
+     */
+    class uac_duplex_stream_handle {
+    public:
+        virtual ~uac_duplex_stream_handle() = default;
+        virtual void stop() = 0;
+
+        virtual error_code check_streaming_error() const = 0;
+
+        /**
+         * @brief The fixed offset between a frame entering the device and the frame played for it.
+         *
+         * Covers the playback transfer queue and the prefill which bridges one capture transfer.
+         *
+         * @return uint the offset in audio frames
+         */
+        virtual uint get_round_trip_frames() const = 0;
+    };
+
+    /**
+     * @brief Receives interleaved float32 frames with the channels of all aggregated streams, in their order.
+     */
+    using aggregate_cb_func = std::function<void(const float*, uint)>;
+
+    /**
+     * @brief Options for aggregating capture streams
+     */
+    struct uac_aggregate_options {
+        /**
+         * @brief The audio frames per callback. If 0, 10ms of audio.
+         */
+        uint32_t periodFrames = 0;
+
+        /**
+         * @brief The filter length of the drift correction.
+         */
+        uac_resampler_quality quality = UAC_RESAMPLER_QUALITY_MEDIUM;
+    };
+
+    /**
+     * A handle to capture streams of several devices, aligned to the clock of the first one.
+     */
+    class uac_aggregate_stream_handle {
+    public:
+        /**
+         * @brief Starts delivering the streams as one.
+         *
+         * The streams must be handles returned by uac_device_handle::start_streaming(), other implementations are
+         * rejected. They must capture into their ring buffers, interleaved, with UAC_SAMPLE_FORMAT_FLOAT32 and the same
+         * delivered sample rate, see uac_stream_options. The other streams are resampled to follow the first one,
+         * at the ratio of their estimated clocks, finely corrected so their frames line up in host time.
+         * The callback runs on a thread of the aggregate, which owns the reading side of the streams.
+         * If the callback or the drift correction throws, the aggregate stops and check_streaming_error() reports it.
+         *
+         * @param streams
+         * @param cb_func
+         * @param options
+         * @return std::shared_ptr<uac_aggregate_stream_handle>
+         */
+        static std::shared_ptr<uac_aggregate_stream_handle> start(const std::vector<std::shared_ptr<uac_stream_handle>>& streams,
+                                                                  aggregate_cb_func cb_func, const uac_aggregate_options& options);
+
+        virtual ~uac_aggregate_stream_handle() = default;
+        virtual void stop() = 0;
+
+        virtual error_code check_streaming_error() const = 0;
+
+        virtual uint get_channel_count() const = 0;
+
+        /**
+         * @brief The frames consumed from a stream per frame of the first stream.
+         *
+         * @param stream the index of the stream
+         * @return double
+         */
+        virtual double get_drift_ratio(size_t stream) const = 0;
     };
 
     /**
@@ -0,0 +1,259 @@
+// Copyright 2023 Jakub Księżniak
+// 
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// 
+//     http://www.apache.org/licenses/LICENSE-2.0
+// 
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "uac_aggregate.h"
+
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+#include "logging.h"
+
+namespace uac {
+
+    // the PI controller closes the alignment error within about a second
+    static constexpr double TIME_CONSTANT = 1.0;
+    static constexpr double INTEGRAL_TIME = 4.0;
+    static constexpr double MAX_CORRECTION = 1e-3;
+    // errors beyond this realign the stream at once
+    static constexpr double REALIGN_SECONDS = 0.02;
+    static constexpr int READ_TIMEOUT_MS = 100;
+
+    namespace {
+        class stream_source : public uac_aggregate_source {
+        public:
+            explicit stream_source(std::shared_ptr<uac_stream_handle_impl> stream) : stream(std::move(stream)) {}
+
+            uint get_channels() const override { return stream->get_channels(); }
+            uint32_t get_device_rate() const override { return stream->get_sampling_rate(); }
+            uint32_t get_delivered_rate() const override { return stream->get_delivered_rate(); }
+
+            uint read(float *buffer, uint frames, int timeout) override {
+                return stream->read(reinterpret_cast<uint8_t*>(buffer), frames, timeout);
+            }
+            uint available() const override { return stream->available(); }
+            uac_timestamp get_timestamp() const override { return stream->get_timestamp(); }
+            bool is_active() const override { return stream->is_active(); }
+            error_code check_streaming_error() const override { return stream->check_streaming_error(); }
+
+        private:
+            std::shared_ptr<uac_stream_handle_impl> stream;
+        };
+    }
+
+    std::shared_ptr<uac_aggregate_stream_handle> uac_aggregate_stream_handle::start(const std::vector<std::shared_ptr<uac_stream_handle>>& streams,
+                                                                                    aggregate_cb_func cb_func, const uac_aggregate_options& options) {
+        std::vector<std::shared_ptr<uac_aggregate_source>> sources;
+        for (const auto& stream : streams) {
+            uac_stream_handle_impl *impl = stream ? stream->get_impl() : nullptr;
+            if (!impl) {
+                throw std::invalid_argument("aggregated streams must be started by uac_device_handle::start_streaming()");
+            }
+            if (impl->is_playback() || !impl->has_ringbuffer() || impl->is_planar() || impl->get_delivered_format() != UAC_SAMPLE_FORMAT_FLOAT32) {
+                throw std::invalid_argument("aggregated streams must capture interleaved float32 into their ring buffers");
+            }
+            // shares ownership with the handle
+            sources.push_back(std::make_shared<stream_source>(std::shared_ptr<uac_stream_handle_impl>(stream, impl)));
+        }
+        auto aggregate = std::make_shared<uac_aggregate_stream_handle_impl>(sources, std::move(cb_func), options);
+        aggregate->start();
+        return aggregate;
+    }
+
+    uac_aggregate_stream_handle_impl::uac_aggregate_stream_handle_impl(const std::vector<std::shared_ptr<uac_aggregate_source>>& sources, aggregate_cb_func cb_func, const uac_aggregate_options& options) :
+        cb_func(std::move(cb_func)), options(options) {
+        if (sources.empty() || !this->cb_func) {
+            throw std::invalid_argument("aggregate needs streams and a callback");
+        }
+        uint32_t rate = 0;
+        for (const auto& source : sources) {
+            if (rate != 0 && source->get_delivered_rate() != rate) {
+                throw std::invalid_argument("aggregated streams must deliver the same sample rate");
+            }
+            rate = source->get_delivered_rate();
+
+            auto m = std::make_unique<member>();
+            m->stream = source;
+            m->channels = source->get_channels();
+            m->deviceFramesPerFrame = static_cast<double>(source->get_device_rate()) / rate;
+            channelCount += m->channels;
+            members.push_back(std::move(m));
+        }
+        periodFrames = options.periodFrames > 0 ? options.periodFrames : rate / 100;
+        // the drift correction consumes a little more or less than a period
+        const size_t maxInputFrames = periodFrames * 2 + 64;
+        for (auto& m : members) {
+            m->input.resize(maxInputFrames * m->channels);
+            m->output.resize(static_cast<size_t>(periodFrames) * m->channels);
+        }
+        interleaved.resize(static_cast<size_t>(periodFrames) * channelCount);
+    }
+
+    uac_aggregate_stream_handle_impl::~uac_aggregate_stream_handle_impl() {
+        stop();
+    }
+
+    void uac_aggregate_stream_handle_impl::start() {
+        LOG_DEBUG("aggregate %zu streams, %u channels, %u frames per period", members.size(), channelCount, periodFrames);
+        running = true;
+        worker = std::thread(&uac_aggregate_stream_handle_impl::run, this);
+    }
+
+    void uac_aggregate_stream_handle_impl::stop() {
+        running = false;
+        if (worker.joinable()) {
+            worker.join();
+        }
+    }
+
+    void uac_aggregate_stream_handle_impl::run() {
+        try {
+            run_periods();
+        } catch (const std::exception& e) {
+            LOG_WARN("aggregate stopped: %s", e.what());
+            streamingError = UAC_ERROR_UNKNOWN;
+        } catch (...) {
+            LOG_WARN("aggregate stopped by an unknown exception");
+            streamingError = UAC_ERROR_UNKNOWN;
+        }
+    }
+
+    void uac_aggregate_stream_handle_impl::run_periods() {
+        auto& master = *members[0];
+        while (running) {
+            if (!read_master()) break;
+            const uac_timestamp masterTime = master.stream->get_timestamp();
+            for (size_t i = 1; i < members.size(); ++i) {
+                process_member(*members[i], masterTime);
+            }
+            master.readFrames += periodFrames;
+
+            uint offset = 0;
+            for (size_t i = 0; i < members.size(); ++i) {
+                const auto& m = *members[i];
+                const float *src = i == 0 ? m.input.data() : m.output.data();
+                for (uint32_t f = 0; f < periodFrames; ++f) {
+                    std::copy(src + f * m.channels, src + (f + 1) * m.channels, interleaved.data() + f * channelCount + offset);
+                }
+                offset += m.channels;
+            }
+            cb_func(interleaved.data(), periodFrames);
+        }
+    }
+
+    bool uac_aggregate_stream_handle_impl::read_master() {
+        auto& master = *members[0];
+        uint32_t done = 0;
+        while (done < periodFrames && running) {
+            done += master.stream->read(master.input.data() + done * master.channels, periodFrames - done, READ_TIMEOUT_MS);
+            if (!master.stream->is_active()) {
+                LOG_WARN("aggregated stream 0 stopped");
+                streamingError = UAC_ERROR_TRANSFERS_WITHERED;
+                return false;
+            }
+        }
+        return done == periodFrames;
+    }
+
+    size_t uac_aggregate_stream_handle_impl::read_member(member& m, size_t frames, int timeout) {
+        size_t done = m.stream->read(m.input.data(), static_cast<uint>(frames), timeout);
+        m.readFrames += done;
+        return done;
+    }
+
+    void uac_aggregate_stream_handle_impl::process_member(member& m, const uac_timestamp& masterTime) {
+        auto& master = *members[0];
+        const uac_timestamp memberTime = m.stream->get_timestamp();
+        const size_t maxInputFrames = m.input.size() / m.channels;
+        std::fill(m.output.begin(), m.output.end(), 0.0f);
+        if (masterTime.frame_period <= 0 || memberTime.frame_period <= 0) {
+            // no clock estimate yet, keep the ring buffer from overrunning
+            while (m.stream->available() > 0 && read_member(m, std::min<size_t>(m.stream->available(), maxInputFrames), 0) > 0) {}
+            m.aligned = false;
+            return;
+        }
+
+        const double rate = m.stream->get_delivered_rate();
+        const double masterPeriod = masterTime.frame_period * master.deviceFramesPerFrame;
+        const double memberPeriod = memberTime.frame_period * m.deviceFramesPerFrame;
+        const double masterHostTime = masterTime.time + (master.readFrames * master.deviceFramesPerFrame - masterTime.frame) * masterTime.frame_period;
+        auto host_time = [&](double frame) {
+            return memberTime.time + (frame * m.deviceFramesPerFrame - memberTime.frame) * memberTime.frame_period;
+        };
+
+        // the frames by which the next member frame is later than the next frame of the first stream
+        double error = m.varispeed ? (host_time(m.readFrames - m.varispeed->lag()) - masterHostTime) / memberPeriod : 0;
+        if (!m.aligned || std::abs(error) > REALIGN_SECONDS * rate) {
+            m.varispeed = std::make_unique<uac_varispeed>(m.channels, options.quality, maxInputFrames);
+            error = (host_time(static_cast<double>(m.readFrames)) - masterHostTime) / memberPeriod;
+            LOG_DEBUG("align aggregated stream by %.1f frames", error);
+            if (error < 0) {
+                for (size_t skip = std::llround(-error); skip > 0; ) {
+                    size_t n = read_member(m, std::min(skip, maxInputFrames), READ_TIMEOUT_MS);
+                    if (n == 0) break;
+                    skip -= n;
+                }
+                m.padFrames = 0;
+            } else {
+                m.padFrames = std::llround(error);
+            }
+            m.aligned = true;
+            m.integral = 0;
+            error = 0;
+        }
+
+        uint32_t offset = 0;
+        if (m.padFrames > 0) {
+            offset = static_cast<uint32_t>(std::min<size_t>(m.padFrames, periodFrames));
+            m.padFrames -= offset;
+        } else {
+            m.integral += error * periodFrames / rate;
+            double correction = -(error + m.integral / INTEGRAL_TIME) / (rate * TIME_CONSTANT);
+            correction = std::clamp(correction, -MAX_CORRECTION, MAX_CORRECTION);
+            m.ratio = masterPeriod / memberPeriod * (1 + correction);
+            m.varispeed->set_ratio(m.ratio);
+        }
+
+        const size_t remaining = periodFrames - offset;
+        if (remaining == 0) return;
+        const size_t needed = std::min(m.varispeed->input_needed(remaining), maxInputFrames);
+        const size_t got = read_member(m, needed, READ_TIMEOUT_MS);
+        if (got < needed) {
+            LOG_VERBOSE("aggregated stream short of %zu frames", needed - got);
+            std::fill(m.input.begin() + got * m.channels, m.input.begin() + needed * m.channels, 0.0f);
+        }
+        m.varispeed->process(m.input.data(), needed, m.output.data() + offset * m.channels, remaining);
+    }
+
+    error_code uac_aggregate_stream_handle_impl::check_streaming_error() const {
+        if (streamingError != UAC_NO_ERROR) {
+            return streamingError;
+        }
+        for (const auto& m : members) {
+            error_code error = m->stream->check_streaming_error();
+            if (error != UAC_NO_ERROR) return error;
+        }
+        return UAC_NO_ERROR;
+    }
+
+    uint uac_aggregate_stream_handle_impl::get_channel_count() const {
+        return channelCount;
+    }
+
+    double uac_aggregate_stream_handle_impl::get_drift_ratio(size_t stream) const {
+        if (stream >= members.size()) {
+            throw std::out_of_range("invalid stream index");
+        }
+        return members[stream]->ratio;
+    }
+}
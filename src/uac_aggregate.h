@@ -0,0 +1,98 @@
+// Copyright 2023 Jakub Księżniak
+// 
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// 
+//     http://www.apache.org/licenses/LICENSE-2.0
+// 
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include "libuac.h"
+#include "uac_streaming.h"
+#include "uac_resampler.h"
+#include <atomic>
+#include <thread>
+
+namespace uac {
+
+    /**
+     * @brief The reading side of an aggregated capture stream, interleaved float32 frames.
+     *
+     * Wraps a uac_stream_handle_impl; the tests feed the aggregate from synthetic sources.
+     */
+    class uac_aggregate_source {
+    public:
+        virtual ~uac_aggregate_source() = default;
+
+        virtual uint get_channels() const = 0;
+        virtual uint32_t get_device_rate() const = 0;
+        virtual uint32_t get_delivered_rate() const = 0;
+
+        virtual uint read(float *buffer, uint frames, int timeout) = 0;
+        virtual uint available() const = 0;
+        // of the device frames, see uac_stream_handle::get_timestamp()
+        virtual uac_timestamp get_timestamp() const = 0;
+        virtual bool is_active() const = 0;
+        virtual error_code check_streaming_error() const = 0;
+    };
+
+    /**
+     * @brief Reads period frames from the first stream and as many, resampled, from each other stream.
+     *
+     * The other streams are consumed at the ratio of the clock estimates, corrected by a PI controller on
+     * the host time between the next frame taken from the stream and the next frame of the first stream.
+     */
+    class uac_aggregate_stream_handle_impl : public uac_aggregate_stream_handle {
+    public:
+        uac_aggregate_stream_handle_impl(const std::vector<std::shared_ptr<uac_aggregate_source>>& sources, aggregate_cb_func cb_func, const uac_aggregate_options& options);
+        ~uac_aggregate_stream_handle_impl();
+
+        void start();
+        void stop() override;
+
+        error_code check_streaming_error() const override;
+        uint get_channel_count() const override;
+        double get_drift_ratio(size_t stream) const override;
+
+    private:
+        struct member {
+            std::shared_ptr<uac_aggregate_source> stream;
+            uint channels;
+            double deviceFramesPerFrame; // when the stream is resampled
+            uint64_t readFrames = 0;     // taken from the ring buffer, with inserted silence
+
+            std::unique_ptr<uac_varispeed> varispeed;
+            bool aligned = false;
+            size_t padFrames = 0; // silence before the stream catches up
+            double integral = 0;
+            std::atomic<double> ratio{1.0};
+
+            std::vector<float> input;
+            std::vector<float> output;
+        };
+
+        void run();
+        void run_periods();
+        bool read_master();
+        void process_member(member& m, const uac_timestamp& masterTime);
+        size_t read_member(member& m, size_t frames, int timeout);
+
+        std::vector<std::unique_ptr<member>> members;
+        aggregate_cb_func cb_func;
+        uac_aggregate_options options;
+        uint channelCount = 0;
+        uint32_t periodFrames;
+
+        std::vector<float> interleaved;
+        std::atomic<bool> running = false;
+        std::atomic<error_code> streamingError = UAC_NO_ERROR;
+        std::thread worker;
+    };
+}
@@ -0,0 +1,68 @@
+// Copyright 2023 Jakub Księżniak
+// 
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// 
+//     http://www.apache.org/licenses/LICENSE-2.0
+// 
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#include "uac_arena.h"
+
+#include <algorithm>
+
+namespace uac {
+
+    static constexpr size_t header_size = (sizeof(size_t) * 3 + alignof(std::max_align_t) - 1) & ~(alignof(std::max_align_t) - 1);
+
+    uac_arena::uac_arena(size_t capacity) {
+        add_block(capacity);
+    }
+
+    uac_arena::~uac_arena() {
+        while (cleanups != nullptr) {
+            cleanups->destroy(cleanups->ptr, cleanups->count);
+            cleanups = cleanups->next;
+        }
+        while (head != nullptr) {
+            block *next = head->next;
+            ::operator delete(head);
+            head = next;
+        }
+    }
+
+    uac_arena::block* uac_arena::add_block(size_t size) {
+        static_assert(sizeof(block) <= header_size, "the block header overlaps the data");
+        block *b = static_cast<block*>(::operator new(header_size + size));
+        b->next = head;
+        b->size = size;
+        b->offset = 0;
+        head = b;
+        ++numBlocks;
+        return b;
+    }
+
+    void* uac_arena::allocate(size_t size, size_t align) {
+        size_t offset = (head->offset + align - 1) & ~(align - 1);
+        if (offset + size > head->size) {
+            // the estimate fell short, the next block at least doubles the capacity
+            add_block(std::max(size + align, head->size * 2));
+            offset = 0;
+        }
+        head->offset = offset + size;
+        usedBytes += size;
+        return reinterpret_cast<uint8_t*>(head) + header_size + offset;
+    }
+
+    void uac_arena::add_cleanup(void *ptr, size_t count, void (*destroy)(void*, size_t)) {
+        auto *c = static_cast<cleanup*>(allocate(sizeof(cleanup), alignof(cleanup)));
+        *c = cleanup{cleanups, destroy, ptr, count};
+        cleanups = c;
+    }
+}
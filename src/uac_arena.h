@@ -0,0 +1,128 @@
+// Copyright 2023 Jakub Księżniak
+// 
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// 
+//     http://www.apache.org/licenses/LICENSE-2.0
+// 
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#include <type_traits>
+
+namespace uac {
+
+    /**
+     * @brief A view of a contiguous array, usually one allocated from a uac_arena.
+     */
+    template<typename T>
+    class uac_span {
+    public:
+        uac_span() = default;
+        uac_span(T *items, size_t count) : items(count > 0 ? items : nullptr), count(count) {}
+
+        T* begin() const { return items; }
+        T* end() const { return items + count; }
+        T* data() const { return items; }
+        size_t size() const { return count; }
+        bool empty() const { return count == 0; }
+
+        T& operator[](size_t i) const { return items[i]; }
+        T& front() const { return items[0]; }
+        T& back() const { return items[count - 1]; }
+
+        operator uac_span<const T>() const {
+            return {items, count};
+        }
+
+    private:
+        T *items = nullptr;
+        size_t count = 0;
+    };
+
+    /**
+     * @brief A bump allocator for objects which live as long as the arena, e.g. the parsed model of a device.
+     *
+     * Memory comes from one block sized by the caller, more blocks are chained only if that estimate falls short,
+     * so releasing the arena is usually a single free. Objects are never freed one by one, destructors of
+     * non-trivial objects run in reverse order of allocation when the arena goes away.
+     */
+    class uac_arena {
+    public:
+        explicit uac_arena(size_t capacity);
+        ~uac_arena();
+
+        uac_arena(const uac_arena&) = delete;
+        uac_arena& operator=(const uac_arena&) = delete;
+
+        void* allocate(size_t size, size_t align);
+
+        /**
+         * @brief Allocates count value-initialized objects.
+         */
+        template<typename T>
+        uac_span<T> make_array(size_t count) {
+            if (count == 0) return {};
+            T *items = static_cast<T*>(allocate(sizeof(T) * count, alignof(T)));
+            for (size_t i = 0; i < count; ++i) {
+                new (items + i) T();
+            }
+            if constexpr (!std::is_trivially_destructible_v<T>) {
+                add_cleanup(items, count, [](void *ptr, size_t n) {
+                    for (size_t i = n; i > 0; --i) {
+                        static_cast<T*>(ptr)[i - 1].~T();
+                    }
+                });
+            }
+            return {items, count};
+        }
+
+        template<typename T>
+        uac_span<T> copy_array(const T *source, size_t count) {
+            static_assert(std::is_trivially_copyable_v<T>, "only plain descriptor data is copied");
+            uac_span<T> items = make_array<T>(count);
+            for (size_t i = 0; i < count; ++i) {
+                items[i] = source[i];
+            }
+            return items;
+        }
+
+        size_t used() const {
+            return usedBytes;
+        }
+        size_t blocks() const {
+            return numBlocks;
+        }
+
+    private:
+        struct block {
+            block *next;
+            size_t size;
+            size_t offset;
+        };
+        struct cleanup {
+            cleanup *next;
+            void (*destroy)(void *ptr, size_t count);
+            void *ptr;
+            size_t count;
+        };
+
+        void add_cleanup(void *ptr, size_t count, void (*destroy)(void*, size_t));
+        block* add_block(size_t size);
+
+        block *head = nullptr;
+        cleanup *cleanups = nullptr;
+        size_t usedBytes = 0;
+        size_t numBlocks = 0;
+    };
+}
@@ -0,0 +1,88 @@
+// Copyright 2023 Jakub Księżniak
+// 
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// 
+//     http://www.apache.org/licenses/LICENSE-2.0
+// 
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "uac_clock.h"
+
+#include <cmath>
+#include <ctime>
+
+namespace uac {
+
+    // a jump beyond this restarts the loop, e.g. after the event thread stalled
+    static constexpr double MAX_ERROR_NS = 20e6;
+
+    int64_t monotonic_now() {
+        timespec ts{};
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return static_cast<int64_t>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+    }
+
+    uac_clock_estimator::uac_clock_estimator(uint32_t nominalRate, double bandwidth) :
+        nominalPeriod(1e9 / nominalRate), bandwidth(bandwidth), period(nominalPeriod) {
+    }
+
+    void uac_clock_estimator::reset() {
+        locked = false;
+        period = nominalPeriod;
+    }
+
+    void uac_clock_estimator::update(int64_t now, uint32_t frames) {
+        if (frames == 0) return;
+        bufferFrame = endFrame;
+        endFrame += frames;
+        if (!locked) {
+            locked = true;
+            endTime = static_cast<double>(now);
+            bufferTime = static_cast<int64_t>(endTime - frames * period);
+            return;
+        }
+        // second order loop, as in "Using a DLL to filter time" by F. Adriaensen
+        const double predicted = endTime + frames * period;
+        const double error = static_cast<double>(now) - predicted;
+        if (std::abs(error) > MAX_ERROR_NS) {
+            period = nominalPeriod;
+            endTime = static_cast<double>(now);
+        } else {
+            const double omega = 2 * M_PI * bandwidth * frames * period * 1e-9;
+            endTime = predicted + std::sqrt(2.0) * omega * error;
+            period += omega * omega * error / frames;
+        }
+        bufferTime = static_cast<int64_t>(endTime - frames * period);
+    }
+
+    void uac_timestamp_publisher::publish(const uac_timestamp& timestamp) {
+        // odd while writing, readers retry
+        uint32_t seq = sequence.load(std::memory_order_relaxed);
+        sequence.store(seq + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        frame.store(timestamp.frame, std::memory_order_relaxed);
+        time.store(timestamp.time, std::memory_order_relaxed);
+        period.store(timestamp.frame_period, std::memory_order_relaxed);
+        sequence.store(seq + 2, std::memory_order_release);
+    }
+
+    uac_timestamp uac_timestamp_publisher::load() const {
+        uac_timestamp result;
+        uint32_t before, after;
+        do {
+            before = sequence.load(std::memory_order_acquire);
+            result.frame = frame.load(std::memory_order_relaxed);
+            result.time = time.load(std::memory_order_relaxed);
+            result.frame_period = period.load(std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_acquire);
+            after = sequence.load(std::memory_order_relaxed);
+        } while ((before & 1) || before != after);
+        return result;
+    }
+}
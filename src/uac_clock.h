@@ -0,0 +1,104 @@
+// Copyright 2023 Jakub Księżniak
+// 
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// 
+//     http://www.apache.org/licenses/LICENSE-2.0
+// 
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include "libuac.h"
+#include <atomic>
+#include <cstdint>
+
+namespace uac {
+
+    /**
+     * @brief CLOCK_MONOTONIC in nanoseconds.
+     */
+    int64_t monotonic_now();
+
+    /**
+     * @brief Maps the frame count of a stream to host time with a delay-locked loop.
+     *
+     * Every completed transfer reports its frame count and host completion time. The loop smooths the
+     * completion jitter of the USB event thread and tracks the device rate, so frame times stay continuous.
+     */
+    class uac_clock_estimator {
+    public:
+        /**
+         * @param nominalRate the device sample rate
+         * @param bandwidth the loop bandwidth in Hz, lower values smooth more and converge slower
+         */
+        explicit uac_clock_estimator(uint32_t nominalRate, double bandwidth = 1.0);
+
+        /**
+         * @brief Reports that the next frames of the stream ended at the given time.
+         */
+        void update(int64_t now, uint32_t frames);
+
+        /**
+         * @brief Restarts the loop, keeping the frame count.
+         */
+        void reset();
+
+        /**
+         * @brief The frame count and the estimated time of its first frame, before the last update.
+         */
+        uac_timestamp last_buffer() const {
+            return {bufferFrame, bufferTime, period};
+        }
+
+        uint64_t frames() const {
+            return endFrame;
+        }
+
+        /**
+         * @brief The estimated nanoseconds per frame.
+         */
+        double frame_period() const {
+            return period;
+        }
+
+        /**
+         * @brief The estimated device rate relative to the nominal one.
+         */
+        double ratio() const {
+            return nominalPeriod / period;
+        }
+
+    private:
+        const double nominalPeriod;
+        const double bandwidth;
+
+        bool locked = false;
+        uint64_t endFrame = 0; // frames reported so far
+        double endTime = 0;    // estimated time at which they ended
+        double period;
+
+        uint64_t bufferFrame = 0;
+        int64_t bufferTime = 0;
+    };
+
+    /**
+     * @brief Publishes timestamps from the USB event thread to any reader, without locks.
+     */
+    class uac_timestamp_publisher {
+    public:
+        void publish(const uac_timestamp& timestamp);
+        uac_timestamp load() const;
+
+    private:
+        std::atomic<uint32_t> sequence{0};
+        std::atomic<uint64_t> frame{0};
+        std::atomic<int64_t> time{0};
+        std::atomic<double> period{0};
+    };
+}
@@ -15,8 +15,16 @@
 
 #include "uac_context.h"
 #include "uac_device.h"
+#include "uac_parser.h"
 #include "logging.h"
 #include "uac_exceptions.h"
+#include "uac_thread.h"
+#include <poll.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <cerrno>
+#include <algorithm>
+#include <set>
 
 namespace uac {
 
@@ -28,64 +36,477 @@ namespace uac {
         return std::make_shared<uac_context_impl>(usb_ctx);
     }
 
-    uac_context_impl::uac_context_impl(libusb_context *libusb_ctx) : libusb_ctx(libusb_ctx), alive(true) {
+    std::shared_ptr<uac_context> uac_context::create(const uac_context_options& options) {
+        return std::make_shared<uac_context_impl>(nullptr, options);
+    }
+
+    uac_context_impl::uac_context_impl(libusb_context *libusb_ctx, const uac_context_options& options) :
+            ownsContext(libusb_ctx == nullptr), shardPolicy(options.shardPolicy), alive(true) {
         LOG_DEBUG("create context with usb context: %p", libusb_ctx);
-        if (libusb_ctx == nullptr) {
-            libusb_init(nullptr);
-            //libusb_set_option(libusb_ctx, LIBUSB_OPTION_LOG_LEVEL, LIBUSB_LOG_LEVEL_DEBUG);
-            
-            thread = std::make_unique<std::thread>([this] {
-                LOG_DEBUG("THREAD START %p", this->libusb_ctx);
-                timeval tv {1, 0};
-                while (this->alive) {
-                    libusb_handle_events_timeout(this->libusb_ctx, &tv);
+        const uint32_t numShards = ownsContext ? std::max<uint32_t>(options.shards, 1) : 1;
+        for (uint32_t i = 0; i < numShards; ++i) {
+            auto shard = std::make_unique<uac_event_shard>();
+            shard->owner = this;
+            shard->index = i;
+            shard->libusb_ctx = libusb_ctx;
+            if (ownsContext) {
+                int errval = libusb_init(&shard->libusb_ctx);
+                if (errval != LIBUSB_SUCCESS) {
+                    for (auto& created : shards) {
+                        libusb_set_pollfd_notifiers(created->libusb_ctx, nullptr, nullptr, nullptr);
+                        libusb_exit(created->libusb_ctx);
+                        if (created->wakeFd >= 0) close(created->wakeFd);
+                    }
+                    throw usb_exception_impl("libusb_init()", static_cast<libusb_error>(errval));
                 }
-                LOG_DEBUG("THREAD STOP");
-            });
+                //libusb_set_option(libusb_ctx, LIBUSB_OPTION_LOG_LEVEL, LIBUSB_LOG_LEVEL_DEBUG);
+            }
+            shard->wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+            if (shard->wakeFd < 0) {
+                LOG_WARN("eventfd() failed: %s", strerror(errno));
+            }
+            if (ownsContext) {
+                // a given LibUSB context keeps its notifiers until the application calls set_pollfd_notifiers()
+                libusb_set_pollfd_notifiers(shard->libusb_ctx, pollfd_added, pollfd_removed, shard.get());
+                shard->notifiersInstalled = true;
+            }
+            shards.push_back(std::move(shard));
+        }
+
+        // the registry fills with the present devices while registering, a device is taken by one shard only
+        hotplug = libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG) != 0;
+        for (size_t i = 0; hotplug && i < shards.size(); ++i) {
+            auto& shard = *shards[i];
+            int errval = libusb_hotplug_register_callback(shard.libusb_ctx, LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED | LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT,
+                                                          LIBUSB_HOTPLUG_ENUMERATE, LIBUSB_HOTPLUG_MATCH_ANY, LIBUSB_HOTPLUG_MATCH_ANY,
+                                                          LIBUSB_HOTPLUG_MATCH_ANY, hotplug_cb, &shard, &shard.hotplugHandle);
+            if (errval == LIBUSB_SUCCESS) {
+                shard.hotplugRegistered = true;
+            } else {
+                LOG_WARN("libusb_hotplug_register_callback() failed: %s, rescan the device lists instead", libusb_error_name(errval));
+                hotplug = false;
+            }
+        }
+        if (!hotplug) {
+            for (auto& shard : shards) {
+                if (shard->hotplugRegistered) {
+                    libusb_hotplug_deregister_callback(shard->libusb_ctx, shard->hotplugHandle);
+                    shard->hotplugRegistered = false;
+                }
+            }
+        }
+
+        if (ownsContext && options.eventThread) {
+            for (size_t i = 0; i < shards.size(); ++i) {
+                const int cpu = options.eventThreadCpu >= 0 ? options.eventThreadCpu + static_cast<int>(i) : -1;
+                uac_event_shard& shard = *shards[i];
+                shard.thread = std::make_unique<std::thread>([this, &shard, priority = options.eventThreadPriority, cpu] {
+                    run_events(shard, priority, cpu);
+                });
+            }
         }
     }
 
     uac_context_impl::~uac_context_impl() {
-        LOG_DEBUG("destroy context with usb context: %p", libusb_ctx);
-        if (libusb_ctx == nullptr) {
-            // stop thread
-            alive = false;
-            LOG_DEBUG("JOIN THREAD");
-            thread->join();
+        LOG_DEBUG("destroy context with %zu shards", shards.size());
+        for (auto& shard : shards) {
+            if (shard->hotplugRegistered) {
+                libusb_hotplug_deregister_callback(shard->libusb_ctx, shard->hotplugHandle);
+            }
+        }
+        // stop threads
+        alive = false;
+        for (auto& shard : shards) {
+            if (shard->thread) {
+                wake_shard(*shard);
+                LOG_DEBUG("JOIN THREAD");
+                shard->thread->join();
+            }
+        }
+        for (auto& entry : registry) {
+            libusb_unref_device(entry.second.usb_device);
+        }
+        registry.clear();
+        for (auto& shard : shards) {
+            if (shard->notifiersInstalled) {
+                libusb_set_pollfd_notifiers(shard->libusb_ctx, nullptr, nullptr, nullptr);
+            }
+            if (ownsContext) {
+                libusb_exit(shard->libusb_ctx);
+            }
+            if (shard->wakeFd >= 0) {
+                close(shard->wakeFd);
+            }
+        }
+    }
+
+    static void append_pollfds(const uac_event_shard& shard, std::vector<libusb_pollfd>& result) {
+        const libusb_pollfd **usbfds = libusb_get_pollfds(shard.libusb_ctx);
+        if (usbfds != nullptr) {
+            for (const libusb_pollfd **usbfd = usbfds; *usbfd != nullptr; ++usbfd) {
+                result.push_back(**usbfd);
+            }
+            libusb_free_pollfds(usbfds);
+        }
+        if (shard.wakeFd >= 0) {
+            result.push_back(libusb_pollfd{shard.wakeFd, POLLIN});
+        }
+    }
 
-            libusb_exit(nullptr);
+    static int next_timeout(const uac_event_shard& shard) {
+        timeval tv {0, 0};
+        if (libusb_get_next_timeout(shard.libusb_ctx, &tv) != 1) {
+            return -1;
         }
+        return static_cast<int>(tv.tv_sec * 1000 + (tv.tv_usec + 999) / 1000);
+    }
+
+    void uac_context_impl::run_events(uac_event_shard& shard, int priority, int cpu) {
+        configure_current_thread("uac-events", priority, cpu);
+        LOG_DEBUG("THREAD START %p", shard.libusb_ctx);
+        std::vector<libusb_pollfd> usbfds;
+        std::vector<pollfd> fds;
+        while (alive) {
+            if (shard.pollfdsChanged.exchange(false)) {
+                usbfds.clear();
+                append_pollfds(shard, usbfds);
+                fds.clear();
+                for (const auto& usbfd : usbfds) {
+                    fds.push_back(pollfd{usbfd.fd, usbfd.events, 0});
+                }
+            }
+            // no timeout to wait for unless libusb has one pending, wake() interrupts the poll
+            int timeout = next_timeout(shard);
+            if (shard.wakeFd < 0 && (timeout < 0 || timeout > 1000)) {
+                timeout = 1000;
+            }
+            int ready = poll(fds.data(), fds.size(), timeout);
+            if (ready < 0 && errno != EINTR) {
+                LOG_WARN("poll() failed: %s", strerror(errno));
+            }
+            handle_shard_events(shard);
+        }
+        LOG_DEBUG("THREAD STOP");
+    }
+
+    void uac_context_impl::pollfd_added(int fd, short events, void *user_data) {
+        auto *shard = static_cast<uac_event_shard*>(user_data);
+        shard->pollfdsChanged = true;
+        wake_shard(*shard);
+        std::lock_guard lock(shard->owner->notifiersMutex);
+        if (shard->owner->addedFunc) {
+            shard->owner->addedFunc(fd, events);
+        }
+    }
+
+    void uac_context_impl::pollfd_removed(int fd, void *user_data) {
+        auto *shard = static_cast<uac_event_shard*>(user_data);
+        shard->pollfdsChanged = true;
+        wake_shard(*shard);
+        std::lock_guard lock(shard->owner->notifiersMutex);
+        if (shard->owner->removedFunc) {
+            shard->owner->removedFunc(fd);
+        }
+    }
+
+    std::vector<libusb_pollfd> uac_context_impl::get_pollfds() const {
+        std::vector<libusb_pollfd> result;
+        for (const auto& shard : shards) {
+            append_pollfds(*shard, result);
+        }
+        return result;
+    }
+
+    void uac_context_impl::set_pollfd_notifiers(pollfd_added_func added, pollfd_removed_func removed) {
+        std::lock_guard lock(notifiersMutex);
+        addedFunc = std::move(added);
+        removedFunc = std::move(removed);
+        for (auto& shard : shards) {
+            if (!shard->notifiersInstalled) {
+                libusb_set_pollfd_notifiers(shard->libusb_ctx, pollfd_added, pollfd_removed, shard.get());
+                shard->notifiersInstalled = true;
+            }
+        }
+    }
+
+    int uac_context_impl::get_next_timeout() const {
+        int timeout = -1;
+        for (const auto& shard : shards) {
+            int shardTimeout = next_timeout(*shard);
+            if (shardTimeout >= 0 && (timeout < 0 || shardTimeout < timeout)) {
+                timeout = shardTimeout;
+            }
+        }
+        return timeout;
+    }
+
+    void uac_context_impl::handle_shard_events(uac_event_shard& shard) {
+        if (shard.wakeFd >= 0) {
+            uint64_t value;
+            while (read(shard.wakeFd, &value, sizeof(value)) > 0) {}
+        }
+        timeval tv {0, 0};
+        libusb_handle_events_timeout_completed(shard.libusb_ctx, &tv, nullptr);
+    }
+
+    void uac_context_impl::handle_events() {
+        for (auto& shard : shards) {
+            handle_shard_events(*shard);
+        }
+    }
+
+    void uac_context_impl::wake_shard(uac_event_shard& shard) {
+        if (shard.wakeFd >= 0) {
+            const uint64_t value = 1;
+            if (write(shard.wakeFd, &value, sizeof(value)) < 0) {
+                LOG_VERBOSE("wake up failed: %s", strerror(errno));
+            }
+        }
+    }
+
+    void uac_context_impl::wake() {
+        for (auto& shard : shards) {
+            wake_shard(*shard);
+        }
+    }
+
+    size_t uac_context_impl::place_device(libusb_device *usb_device) {
+        if (shards.size() == 1) {
+            return 0;
+        }
+        const std::string path = usb_port_path(usb_device);
+        std::lock_guard lock(placementMutex);
+        auto it = placements.find(path);
+        if (it != placements.end()) {
+            return it->second;
+        }
+        size_t index = 0;
+        if (shardPolicy == UAC_SHARD_BY_BUS) {
+            index = libusb_get_bus_number(usb_device) % shards.size();
+        } else {
+            for (size_t i = 1; i < shards.size(); ++i) {
+                if (shards[i]->devices < shards[index]->devices) index = i;
+            }
+        }
+        placements[path] = index;
+        ++shards[index]->devices;
+        LOG_DEBUG("place device %s on shard %zu", path.c_str(), index);
+        return index;
+    }
+
+    static bool same_device(libusb_device *a, libusb_device *b) {
+        return libusb_get_bus_number(a) == libusb_get_bus_number(b) && libusb_get_device_address(a) == libusb_get_device_address(b);
+    }
+
+    static libusb_device* find_device(libusb_device **devices, ssize_t count, libusb_device *like) {
+        for (ssize_t i = 0; i < count; ++i) {
+            if (same_device(devices[i], like)) {
+                return devices[i];
+            }
+        }
+        return nullptr;
+    }
+
+    void uac_context_impl::add_device(const std::string& path, libusb_device *usb_device) {
+        libusb_ref_device(usb_device);
+        std::lock_guard lock(registryMutex);
+        auto it = registry.find(path);
+        if (it != registry.end()) {
+            // replugged without a departure seen
+            libusb_unref_device(it->second.usb_device);
+            registry.erase(it);
+        }
+        registry.emplace(path, registry_entry{usb_device, {}});
+    }
+
+    std::shared_ptr<uac_device> uac_context_impl::obtain_device(const std::string& path) {
+        std::unique_lock lock(registryMutex);
+        auto it = registry.find(path);
+        if (it == registry.end()) {
+            return nullptr;
+        }
+        if (auto device = it->second.device.lock()) {
+            return device;
+        }
+        libusb_device *usb_device = libusb_ref_device(it->second.usb_device);
+        lock.unlock();
+
+        // built without the lock, the descriptors are parsed only on first use
+        std::shared_ptr<uac_device> device = std::make_shared<uac_device_impl>(shared_from_this(), usb_device);
+
+        lock.lock();
+        it = registry.find(path);
+        if (it != registry.end() && it->second.usb_device == usb_device) {
+            if (auto built = it->second.device.lock()) {
+                device = built; // built concurrently
+            } else {
+                it->second.device = device;
+            }
+        }
+        lock.unlock();
+        libusb_unref_device(usb_device);
+        return device;
+    }
+
+    void uac_context_impl::rescan() {
+        // every shard lists its own libusb_device objects, the registry keeps the one of the device's shard
+        std::vector<libusb_device**> deviceLists(shards.size(), nullptr);
+        std::vector<ssize_t> counts(shards.size(), 0);
+        for (size_t i = 0; i < shards.size(); ++i) {
+            counts[i] = libusb_get_device_list(shards[i]->libusb_ctx, &deviceLists[i]);
+        }
+
+        std::set<std::string> present;
+        for (ssize_t i = 0; i < counts[0]; ++i) {
+            libusb_device *usb_device = deviceLists[0][i];
+            const std::string path = usb_port_path(usb_device);
+            present.insert(path);
+            {
+                std::lock_guard lock(registryMutex);
+                auto it = registry.find(path);
+                if (it != registry.end() && same_device(it->second.usb_device, usb_device)) continue;
+            }
+            if (!uac_is_audio_device(usb_device)) continue;
+            const size_t index = place_device(usb_device);
+            if (index != 0) {
+                usb_device = find_device(deviceLists[index], counts[index], usb_device);
+                if (usb_device == nullptr) continue;
+            }
+            add_device(path, usb_device);
+        }
+        {
+            std::lock_guard lock(registryMutex);
+            for (auto it = registry.begin(); it != registry.end();) {
+                if (present.count(it->first) == 0) {
+                    libusb_unref_device(it->second.usb_device);
+                    it = registry.erase(it);
+                } else {
+                    ++it;
+                }
+            }
+        }
+        for (size_t i = 0; i < shards.size(); ++i) {
+            if (deviceLists[i] != nullptr) {
+                libusb_free_device_list(deviceLists[i], 1);
+            }
+        }
+    }
+
+    int LIBUSB_CALL uac_context_impl::hotplug_cb(libusb_context * /*ctx*/, libusb_device *usb_device, libusb_hotplug_event event, void *user_data) {
+        auto *shard = static_cast<uac_event_shard*>(user_data);
+        uac_context_impl *owner = shard->owner;
+        const std::string path = usb_port_path(usb_device);
+        if (event == LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED) {
+            // every shard sees every device, only the one it is placed on keeps it
+            if (!uac_is_audio_device(usb_device) || owner->place_device(usb_device) != shard->index) {
+                return 0;
+            }
+            LOG_DEBUG("device %s arrived", path.c_str());
+            // registered with the callback read, so set_hotplug_callbacks() sees either the device or the callback
+            std::unique_lock lock(owner->hotplugMutex);
+            owner->add_device(path, usb_device);
+            device_arrived_func arrived = owner->arrivedFunc;
+            lock.unlock();
+            if (arrived) {
+                if (auto device = owner->obtain_device(path)) {
+                    arrived(device);
+                }
+            }
+        } else if (event == LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT) {
+            std::shared_ptr<uac_device> device;
+            {
+                std::lock_guard lock(owner->registryMutex);
+                auto it = owner->registry.find(path);
+                if (it == owner->registry.end() || it->second.usb_device != usb_device) {
+                    return 0;
+                }
+                LOG_DEBUG("device %s left", path.c_str());
+                device = it->second.device.lock();
+                libusb_unref_device(it->second.usb_device);
+                owner->registry.erase(it);
+            }
+            std::unique_lock lock(owner->hotplugMutex);
+            device_left_func left = owner->leftFunc;
+            lock.unlock();
+            if (device && left) {
+                left(device);
+            }
+        }
+        return 0;
+    }
+
+    bool uac_context_impl::set_hotplug_callbacks(device_arrived_func arrived, device_left_func left) {
+        if (!hotplug) {
+            return false;
+        }
+        std::vector<std::string> paths;
+        {
+            // a device arriving meanwhile is either in the snapshot or reported by the new callback, not both
+            std::lock_guard lock(hotplugMutex);
+            paths = registered_paths();
+            arrivedFunc = arrived;
+            leftFunc = std::move(left);
+        }
+        if (arrived) {
+            for (const auto& path : paths) {
+                if (auto device = obtain_device(path)) {
+                    arrived(device);
+                }
+            }
+        }
+        return true;
+    }
+
+    std::vector<std::string> uac_context_impl::registered_paths() {
+        std::vector<std::string> paths;
+        std::lock_guard lock(registryMutex);
+        for (const auto& entry : registry) {
+            paths.push_back(entry.first);
+        }
+        return paths;
     }
 
     std::vector<std::shared_ptr<uac_device>> uac_context_impl::query_all_devices() {
+        if (!hotplug) {
+            rescan();
+        }
         auto list = std::vector<std::shared_ptr<uac_device>>();
-        libusb_device** devices = nullptr;
-        
-        ssize_t count = libusb_get_device_list(libusb_ctx, &devices);
-        if (count > 0) {
-            for (size_t i = 0; i < count; ++i) {
-                auto usb_device = devices[i];
-                try {
-                    list.push_back(std::make_shared<uac_device_impl>(shared_from_this(), usb_device));
-                } catch(std::exception &e) {
-                    // skip invalid devices
-                }
+        for (const auto& path : registered_paths()) {
+            if (auto device = obtain_device(path)) {
+                list.push_back(device);
             }
         }
-        libusb_free_device_list(devices, 1);
         return list;
     }
 
     std::shared_ptr<uac_device_handle> uac_context_impl::wrap(int fd) {
+        // the device is unknown until wrapped, so only the load places it
+        size_t index = 0;
+        {
+            std::lock_guard lock(placementMutex);
+            for (size_t i = 1; i < shards.size(); ++i) {
+                if (shards[i]->devices < shards[index]->devices) index = i;
+            }
+        }
         libusb_device_handle *hDev;
-        int errval = libusb_wrap_sys_device(libusb_ctx, fd, &hDev);
+        int errval = libusb_wrap_sys_device(shards[index]->libusb_ctx, fd, &hDev);
         if (errval != LIBUSB_SUCCESS) {
             throw usb_exception_impl("libusb_wrap_sys_device()", static_cast<libusb_error>(errval));
         }
         libusb_device *dev = libusb_get_device(hDev);
+        if (!uac_is_audio_device(dev)) {
+            libusb_close(hDev);
+            throw invalid_device_exception();
+        }
 
         try {
             auto uacDev = std::make_shared<uac_device_impl>(shared_from_this(), dev);
+            if (shards.size() > 1) {
+                std::lock_guard lock(placementMutex);
+                if (placements.emplace(usb_port_path(dev), index).second) {
+                    ++shards[index]->devices;
+                }
+            }
             return uacDev->wrapHandle(hDev);
         } catch (std::exception &e) {
             libusb_close(hDev);
@@ -94,4 +515,3 @@ namespace uac {
     }
 
 }
-
@@ -15,25 +15,106 @@
 #pragma once
 
 #include "libuac.h"
+#include "uac_transfer_pool.h"
+#include "uac_descriptor_cache.h"
 #include <thread>
 #include <atomic>
+#include <mutex>
+#include <map>
+#include <string>
 
 namespace uac {
 
+    class uac_context_impl;
+
+    // one LibUSB context with its polled descriptors and event thread
+    struct uac_event_shard {
+        uac_context_impl *owner = nullptr;
+        size_t index = 0;
+        libusb_context *libusb_ctx = nullptr;
+        std::unique_ptr<std::thread> thread;
+
+        // an eventfd, part of the polled descriptors, to interrupt poll() on shutdown or a changed descriptor set
+        int wakeFd = -1;
+        std::atomic<bool> pollfdsChanged = true;
+        bool notifiersInstalled = false;
+
+        // devices placed on this shard, by query_all_devices(), hotplug events or wrap()
+        size_t devices = 0;
+
+        libusb_hotplug_callback_handle hotplugHandle{};
+        bool hotplugRegistered = false;
+    };
+
     class uac_context_impl : public uac_context, public std::enable_shared_from_this<uac_context> {
     public:
-        uac_context_impl(libusb_context *libusb_ctx);
+        // a null libusb_ctx creates private ones, one per shard, handled by event threads if the options ask for it
+        uac_context_impl(libusb_context *libusb_ctx, const uac_context_options& options = {});
         ~uac_context_impl();
 
         virtual std::vector<std::shared_ptr<uac_device>> query_all_devices();
 
         virtual std::shared_ptr<uac_device_handle> wrap(int fd);
+
+        std::vector<libusb_pollfd> get_pollfds() const override;
+        void set_pollfd_notifiers(pollfd_added_func added, pollfd_removed_func removed) override;
+        int get_next_timeout() const override;
+        void handle_events() override;
+        void wake() override;
+        bool set_hotplug_callbacks(device_arrived_func arrived, device_left_func left) override;
+
+        uac_transfer_pool& get_transfer_pool() {
+            return transferPool;
+        }
+
+        uac_descriptor_cache& get_descriptor_cache() {
+            return descriptorCache;
+        }
         
     private:
-        libusb_context *libusb_ctx;
+        static void pollfd_added(int fd, short events, void *user_data);
+        static void pollfd_removed(int fd, void *user_data);
+        void run_events(uac_event_shard& shard, int priority, int cpu);
+        static void handle_shard_events(uac_event_shard& shard);
+        static void wake_shard(uac_event_shard& shard);
+        static int LIBUSB_CALL hotplug_cb(libusb_context *ctx, libusb_device *usb_device, libusb_hotplug_event event, void *user_data);
+        // a device stays on the shard it was first placed on for the lifetime of the context
+        size_t place_device(libusb_device *usb_device);
+        void add_device(const std::string& path, libusb_device *usb_device);
+        // the audio device at the port path, the same object as long as it is referenced
+        std::shared_ptr<uac_device> obtain_device(const std::string& path);
+        std::vector<std::string> registered_paths();
+        // syncs the registry with the device lists, where there are no hotplug events
+        void rescan();
 
-        std::unique_ptr<std::thread> thread;
+        const bool ownsContext;
+        const uac_shard_policy shardPolicy;
+        std::vector<std::unique_ptr<uac_event_shard>> shards;
         std::atomic<bool> alive;
+
+        std::mutex notifiersMutex;
+        pollfd_added_func addedFunc;
+        pollfd_removed_func removedFunc;
+
+        // port paths of placed devices
+        std::mutex placementMutex;
+        std::map<std::string, size_t> placements;
+
+        // audio devices present by port path, referenced on their shard and built into uac_device objects on demand
+        struct registry_entry {
+            libusb_device *usb_device;
+            std::weak_ptr<uac_device> device;
+        };
+        std::mutex registryMutex;
+        std::map<std::string, registry_entry> registry;
+        bool hotplug = false;
+
+        std::mutex hotplugMutex;
+        device_arrived_func arrivedFunc;
+        device_left_func leftFunc;
+
+        uac_transfer_pool transferPool;
+        uac_descriptor_cache descriptorCache;
     };
 
-}
\ No newline at end of file
+}
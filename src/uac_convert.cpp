@@ -0,0 +1,403 @@
+// Copyright 2023 Jakub Księżniak
+// 
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// 
+//     http://www.apache.org/licenses/LICENSE-2.0
+// 
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "uac_convert.h"
+
+#include <cstring>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define UAC_CONVERT_X86
+#include <immintrin.h>
+#endif
+#if defined(__ARM_NEON)
+#define UAC_CONVERT_NEON
+#include <arm_neon.h>
+#endif
+
+namespace uac {
+
+    namespace {
+        // left-justified samples are scaled as 32-bit ones, int to float is exact up to 24 bits
+        constexpr float SCALE_S32 = 1.0f / 2147483648.0f;
+
+        template<int N>
+        inline int32_t load_sample(const uint8_t *p) {
+            uint32_t value = 0;
+            for (int i = 0; i < N; ++i) {
+                value |= static_cast<uint32_t>(p[i]) << (8 * (4 - N + i));
+            }
+            return static_cast<int32_t>(value);
+        }
+
+        template<int N>
+        void convert_to_s16(const uint8_t *src, uint8_t *dst, size_t samples) {
+            for (size_t i = 0; i < samples; ++i) {
+                int16_t value = static_cast<int16_t>(load_sample<N>(src + i * N) >> 16);
+                memcpy(dst + i * sizeof(value), &value, sizeof(value));
+            }
+        }
+
+        template<int N>
+        void convert_to_s32(const uint8_t *src, uint8_t *dst, size_t samples) {
+            for (size_t i = 0; i < samples; ++i) {
+                int32_t value = load_sample<N>(src + i * N);
+                memcpy(dst + i * sizeof(value), &value, sizeof(value));
+            }
+        }
+
+        template<int N>
+        void convert_to_f32(const uint8_t *src, uint8_t *dst, size_t samples) {
+            for (size_t i = 0; i < samples; ++i) {
+                float value = static_cast<float>(load_sample<N>(src + i * N)) * SCALE_S32;
+                memcpy(dst + i * sizeof(value), &value, sizeof(value));
+            }
+        }
+
+        template<int N>
+        void deinterleave_scalar(const uint8_t *src, uint8_t *dst, size_t frames, uint channels, size_t planePitch) {
+            for (uint c = 0; c < channels; ++c) {
+                const uint8_t *in = src + c * N;
+                uint8_t *out = dst + c * planePitch * N;
+                for (size_t f = 0; f < frames; ++f) {
+                    memcpy(out + f * N, in + f * channels * N, N);
+                }
+            }
+        }
+
+#ifdef UAC_CONVERT_X86
+        // moves the 3 bytes of each packed sample into the top of a 32-bit lane
+        #define UAC_S24_SHUFFLE -1, 0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11
+
+        __attribute__((target("ssse3")))
+        void s16_to_f32_ssse3(const uint8_t *src, uint8_t *dst, size_t samples) {
+            const __m128 scale = _mm_set1_ps(SCALE_S32);
+            const __m128i zero = _mm_setzero_si128();
+            size_t i = 0;
+            for (; i + 8 <= samples; i += 8) {
+                __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i * 2));
+                __m128i lo = _mm_unpacklo_epi16(zero, v);
+                __m128i hi = _mm_unpackhi_epi16(zero, v);
+                _mm_storeu_ps(reinterpret_cast<float*>(dst + i * 4), _mm_mul_ps(_mm_cvtepi32_ps(lo), scale));
+                _mm_storeu_ps(reinterpret_cast<float*>(dst + i * 4 + 16), _mm_mul_ps(_mm_cvtepi32_ps(hi), scale));
+            }
+            convert_to_f32<2>(src + i * 2, dst + i * 4, samples - i);
+        }
+
+        // a 16-byte load covers 4 samples, and must stay within the source
+        __attribute__((target("ssse3")))
+        void s24_to_s32_ssse3(const uint8_t *src, uint8_t *dst, size_t samples) {
+            const __m128i shuffle = _mm_setr_epi8(UAC_S24_SHUFFLE);
+            size_t i = 0;
+            for (; i + 6 <= samples; i += 4) {
+                __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i * 3));
+                _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i * 4), _mm_shuffle_epi8(v, shuffle));
+            }
+            convert_to_s32<3>(src + i * 3, dst + i * 4, samples - i);
+        }
+
+        __attribute__((target("ssse3")))
+        void s24_to_f32_ssse3(const uint8_t *src, uint8_t *dst, size_t samples) {
+            const __m128i shuffle = _mm_setr_epi8(UAC_S24_SHUFFLE);
+            const __m128 scale = _mm_set1_ps(SCALE_S32);
+            size_t i = 0;
+            for (; i + 6 <= samples; i += 4) {
+                __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i * 3));
+                __m128 f = _mm_cvtepi32_ps(_mm_shuffle_epi8(v, shuffle));
+                _mm_storeu_ps(reinterpret_cast<float*>(dst + i * 4), _mm_mul_ps(f, scale));
+            }
+            convert_to_f32<3>(src + i * 3, dst + i * 4, samples - i);
+        }
+
+        __attribute__((target("ssse3")))
+        void s32_to_f32_ssse3(const uint8_t *src, uint8_t *dst, size_t samples) {
+            const __m128 scale = _mm_set1_ps(SCALE_S32);
+            size_t i = 0;
+            for (; i + 4 <= samples; i += 4) {
+                __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i * 4));
+                _mm_storeu_ps(reinterpret_cast<float*>(dst + i * 4), _mm_mul_ps(_mm_cvtepi32_ps(v), scale));
+            }
+            convert_to_f32<4>(src + i * 4, dst + i * 4, samples - i);
+        }
+
+        __attribute__((target("avx2")))
+        void s16_to_f32_avx2(const uint8_t *src, uint8_t *dst, size_t samples) {
+            const __m256 scale = _mm256_set1_ps(SCALE_S32);
+            size_t i = 0;
+            for (; i + 8 <= samples; i += 8) {
+                __m256i v = _mm256_cvtepi16_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i * 2)));
+                __m256 f = _mm256_cvtepi32_ps(_mm256_slli_epi32(v, 16));
+                _mm256_storeu_ps(reinterpret_cast<float*>(dst + i * 4), _mm256_mul_ps(f, scale));
+            }
+            convert_to_f32<2>(src + i * 2, dst + i * 4, samples - i);
+        }
+
+        // two 16-byte loads, 12 bytes apart, fill the lanes with 4 samples each
+        __attribute__((target("avx2")))
+        inline __m256i load_s24_avx2(const uint8_t *p, __m256i shuffle) {
+            __m256i v = _mm256_castsi128_si256(_mm_loadu_si128(reinterpret_cast<const __m128i*>(p)));
+            v = _mm256_inserti128_si256(v, _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + 12)), 1);
+            return _mm256_shuffle_epi8(v, shuffle);
+        }
+
+        __attribute__((target("avx2")))
+        void s24_to_s32_avx2(const uint8_t *src, uint8_t *dst, size_t samples) {
+            const __m256i shuffle = _mm256_setr_epi8(UAC_S24_SHUFFLE, UAC_S24_SHUFFLE);
+            size_t i = 0;
+            for (; i + 10 <= samples; i += 8) {
+                _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + i * 4), load_s24_avx2(src + i * 3, shuffle));
+            }
+            s24_to_s32_ssse3(src + i * 3, dst + i * 4, samples - i);
+        }
+
+        __attribute__((target("avx2")))
+        void s24_to_f32_avx2(const uint8_t *src, uint8_t *dst, size_t samples) {
+            const __m256i shuffle = _mm256_setr_epi8(UAC_S24_SHUFFLE, UAC_S24_SHUFFLE);
+            const __m256 scale = _mm256_set1_ps(SCALE_S32);
+            size_t i = 0;
+            for (; i + 10 <= samples; i += 8) {
+                __m256 f = _mm256_cvtepi32_ps(load_s24_avx2(src + i * 3, shuffle));
+                _mm256_storeu_ps(reinterpret_cast<float*>(dst + i * 4), _mm256_mul_ps(f, scale));
+            }
+            s24_to_f32_ssse3(src + i * 3, dst + i * 4, samples - i);
+        }
+
+        __attribute__((target("avx2")))
+        void s32_to_f32_avx2(const uint8_t *src, uint8_t *dst, size_t samples) {
+            const __m256 scale = _mm256_set1_ps(SCALE_S32);
+            size_t i = 0;
+            for (; i + 8 <= samples; i += 8) {
+                __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + i * 4));
+                _mm256_storeu_ps(reinterpret_cast<float*>(dst + i * 4), _mm256_mul_ps(_mm256_cvtepi32_ps(v), scale));
+            }
+            convert_to_f32<4>(src + i * 4, dst + i * 4, samples - i);
+        }
+
+        // 4x4 blocks of 32-bit samples, the remaining channels and frames are copied one by one
+        __attribute__((target("ssse3")))
+        void deinterleave32_ssse3(const uint8_t *src, uint8_t *dst, size_t frames, uint channels, size_t planePitch) {
+            const uint blockChannels = channels & ~3u;
+            size_t f = 0;
+            for (; f + 4 <= frames; f += 4) {
+                for (uint c = 0; c < blockChannels; c += 4) {
+                    const uint8_t *in = src + (f * channels + c) * 4;
+                    __m128i r0 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in));
+                    __m128i r1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + channels * 4));
+                    __m128i r2 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + channels * 8));
+                    __m128i r3 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + channels * 12));
+                    __m128i t0 = _mm_unpacklo_epi32(r0, r1);
+                    __m128i t1 = _mm_unpacklo_epi32(r2, r3);
+                    __m128i t2 = _mm_unpackhi_epi32(r0, r1);
+                    __m128i t3 = _mm_unpackhi_epi32(r2, r3);
+                    uint8_t *out = dst + (c * planePitch + f) * 4;
+                    _mm_storeu_si128(reinterpret_cast<__m128i*>(out), _mm_unpacklo_epi64(t0, t1));
+                    _mm_storeu_si128(reinterpret_cast<__m128i*>(out + planePitch * 4), _mm_unpackhi_epi64(t0, t1));
+                    _mm_storeu_si128(reinterpret_cast<__m128i*>(out + planePitch * 8), _mm_unpacklo_epi64(t2, t3));
+                    _mm_storeu_si128(reinterpret_cast<__m128i*>(out + planePitch * 12), _mm_unpackhi_epi64(t2, t3));
+                }
+            }
+            if (blockChannels < channels) {
+                for (uint c = blockChannels; c < channels; ++c) {
+                    for (size_t i = 0; i < f; ++i) {
+                        memcpy(dst + (c * planePitch + i) * 4, src + (i * channels + c) * 4, 4);
+                    }
+                }
+            }
+            deinterleave_scalar<4>(src + f * channels * 4, dst + f * 4, frames - f, channels, planePitch);
+        }
+
+        #undef UAC_S24_SHUFFLE
+#endif
+
+#ifdef UAC_CONVERT_NEON
+        inline void store_f32_neon(uint8_t *dst, int32x4_t v) {
+            vst1q_u8(dst, vreinterpretq_u8_f32(vcvtq_n_f32_s32(v, 31)));
+        }
+
+        // vld3 splits 8 packed samples into their low, middle and high bytes
+        inline int32x4x2_t load_s24_neon(const uint8_t *p) {
+            const uint8x8x3_t bytes = vld3_u8(p);
+            const uint8x8x2_t lo = vzip_u8(vdup_n_u8(0), bytes.val[0]);
+            const uint8x8x2_t hi = vzip_u8(bytes.val[1], bytes.val[2]);
+            const uint16x4x2_t first = vzip_u16(vreinterpret_u16_u8(lo.val[0]), vreinterpret_u16_u8(hi.val[0]));
+            const uint16x4x2_t second = vzip_u16(vreinterpret_u16_u8(lo.val[1]), vreinterpret_u16_u8(hi.val[1]));
+            int32x4x2_t result;
+            result.val[0] = vreinterpretq_s32_u16(vcombine_u16(first.val[0], first.val[1]));
+            result.val[1] = vreinterpretq_s32_u16(vcombine_u16(second.val[0], second.val[1]));
+            return result;
+        }
+
+        void s16_to_f32_neon(const uint8_t *src, uint8_t *dst, size_t samples) {
+            size_t i = 0;
+            for (; i + 8 <= samples; i += 8) {
+                int16x8_t v = vreinterpretq_s16_u8(vld1q_u8(src + i * 2));
+                store_f32_neon(dst + i * 4, vshll_n_s16(vget_low_s16(v), 16));
+                store_f32_neon(dst + i * 4 + 16, vshll_n_s16(vget_high_s16(v), 16));
+            }
+            convert_to_f32<2>(src + i * 2, dst + i * 4, samples - i);
+        }
+
+        void s24_to_s32_neon(const uint8_t *src, uint8_t *dst, size_t samples) {
+            size_t i = 0;
+            for (; i + 8 <= samples; i += 8) {
+                int32x4x2_t v = load_s24_neon(src + i * 3);
+                vst1q_u8(dst + i * 4, vreinterpretq_u8_s32(v.val[0]));
+                vst1q_u8(dst + i * 4 + 16, vreinterpretq_u8_s32(v.val[1]));
+            }
+            convert_to_s32<3>(src + i * 3, dst + i * 4, samples - i);
+        }
+
+        void s24_to_f32_neon(const uint8_t *src, uint8_t *dst, size_t samples) {
+            size_t i = 0;
+            for (; i + 8 <= samples; i += 8) {
+                int32x4x2_t v = load_s24_neon(src + i * 3);
+                store_f32_neon(dst + i * 4, v.val[0]);
+                store_f32_neon(dst + i * 4 + 16, v.val[1]);
+            }
+            convert_to_f32<3>(src + i * 3, dst + i * 4, samples - i);
+        }
+
+        void s32_to_f32_neon(const uint8_t *src, uint8_t *dst, size_t samples) {
+            size_t i = 0;
+            for (; i + 4 <= samples; i += 4) {
+                store_f32_neon(dst + i * 4, vreinterpretq_s32_u8(vld1q_u8(src + i * 4)));
+            }
+            convert_to_f32<4>(src + i * 4, dst + i * 4, samples - i);
+        }
+#endif
+
+#ifdef UAC_CONVERT_NEON
+        void deinterleave32_neon(const uint8_t *src, uint8_t *dst, size_t frames, uint channels, size_t planePitch) {
+            const uint blockChannels = channels & ~3u;
+            size_t f = 0;
+            for (; f + 4 <= frames; f += 4) {
+                for (uint c = 0; c < blockChannels; c += 4) {
+                    const uint8_t *in = src + (f * channels + c) * 4;
+                    uint32x4x2_t a = vtrnq_u32(vreinterpretq_u32_u8(vld1q_u8(in)), vreinterpretq_u32_u8(vld1q_u8(in + channels * 4)));
+                    uint32x4x2_t b = vtrnq_u32(vreinterpretq_u32_u8(vld1q_u8(in + channels * 8)), vreinterpretq_u32_u8(vld1q_u8(in + channels * 12)));
+                    uint8_t *out = dst + (c * planePitch + f) * 4;
+                    vst1q_u8(out, vreinterpretq_u8_u32(vcombine_u32(vget_low_u32(a.val[0]), vget_low_u32(b.val[0]))));
+                    vst1q_u8(out + planePitch * 4, vreinterpretq_u8_u32(vcombine_u32(vget_low_u32(a.val[1]), vget_low_u32(b.val[1]))));
+                    vst1q_u8(out + planePitch * 8, vreinterpretq_u8_u32(vcombine_u32(vget_high_u32(a.val[0]), vget_high_u32(b.val[0]))));
+                    vst1q_u8(out + planePitch * 12, vreinterpretq_u8_u32(vcombine_u32(vget_high_u32(a.val[1]), vget_high_u32(b.val[1]))));
+                }
+            }
+            if (blockChannels < channels) {
+                for (uint c = blockChannels; c < channels; ++c) {
+                    for (size_t i = 0; i < f; ++i) {
+                        memcpy(dst + (c * planePitch + i) * 4, src + (i * channels + c) * 4, 4);
+                    }
+                }
+            }
+            deinterleave_scalar<4>(src + f * channels * 4, dst + f * 4, frames - f, channels, planePitch);
+        }
+#endif
+
+        uac_convert_func find_scalar_converter(uint8_t subframeSize, uac_sample_format format) {
+            switch (format) {
+                case UAC_SAMPLE_FORMAT_S16:
+                    return subframeSize == 2 ? convert_to_s16<2> : subframeSize == 3 ? convert_to_s16<3> : subframeSize == 4 ? convert_to_s16<4> : nullptr;
+                case UAC_SAMPLE_FORMAT_S32:
+                    return subframeSize == 2 ? convert_to_s32<2> : subframeSize == 3 ? convert_to_s32<3> : subframeSize == 4 ? convert_to_s32<4> : nullptr;
+                case UAC_SAMPLE_FORMAT_FLOAT32:
+                    return subframeSize == 2 ? convert_to_f32<2> : subframeSize == 3 ? convert_to_f32<3> : subframeSize == 4 ? convert_to_f32<4> : nullptr;
+                default:
+                    return nullptr;
+            }
+        }
+    }
+
+    uac_simd_level detect_simd_level() {
+#if defined(UAC_CONVERT_X86)
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2")) return UAC_SIMD_AVX2;
+        if (__builtin_cpu_supports("ssse3")) return UAC_SIMD_SSSE3;
+#elif defined(UAC_CONVERT_NEON)
+        return UAC_SIMD_NEON;
+#endif
+        return UAC_SIMD_NONE;
+    }
+
+    size_t sample_format_size(uac_sample_format format) {
+        switch (format) {
+            case UAC_SAMPLE_FORMAT_S16:
+                return sizeof(int16_t);
+            case UAC_SAMPLE_FORMAT_S32:
+                return sizeof(int32_t);
+            case UAC_SAMPLE_FORMAT_FLOAT32:
+                return sizeof(float);
+            default:
+                return 0;
+        }
+    }
+
+    uac_convert_func find_converter(uint8_t subframeSize, uac_sample_format format, uac_simd_level level) {
+        // only the widening conversions are vectorized, the others are cheap enough
+        const bool toS32 = format == UAC_SAMPLE_FORMAT_S32 && subframeSize == 3;
+        const bool toF32 = format == UAC_SAMPLE_FORMAT_FLOAT32;
+        switch (level) {
+#ifdef UAC_CONVERT_X86
+            case UAC_SIMD_AVX2:
+                if (toS32) return s24_to_s32_avx2;
+                if (toF32) {
+                    if (subframeSize == 2) return s16_to_f32_avx2;
+                    if (subframeSize == 3) return s24_to_f32_avx2;
+                    if (subframeSize == 4) return s32_to_f32_avx2;
+                }
+                break;
+            case UAC_SIMD_SSSE3:
+                if (toS32) return s24_to_s32_ssse3;
+                if (toF32) {
+                    if (subframeSize == 2) return s16_to_f32_ssse3;
+                    if (subframeSize == 3) return s24_to_f32_ssse3;
+                    if (subframeSize == 4) return s32_to_f32_ssse3;
+                }
+                break;
+#endif
+#ifdef UAC_CONVERT_NEON
+            case UAC_SIMD_NEON:
+                if (toS32) return s24_to_s32_neon;
+                if (toF32) {
+                    if (subframeSize == 2) return s16_to_f32_neon;
+                    if (subframeSize == 3) return s24_to_f32_neon;
+                    if (subframeSize == 4) return s32_to_f32_neon;
+                }
+                break;
+#endif
+            default:
+                break;
+        }
+        return find_scalar_converter(subframeSize, format);
+    }
+
+    uac_deinterleave_func find_deinterleaver(size_t sampleSize, uac_simd_level level) {
+        switch (sampleSize) {
+            case 1:
+                return deinterleave_scalar<1>;
+            case 2:
+                return deinterleave_scalar<2>;
+            case 3:
+                return deinterleave_scalar<3>;
+            case 4:
+#ifdef UAC_CONVERT_X86
+                if (level == UAC_SIMD_SSSE3 || level == UAC_SIMD_AVX2) return deinterleave32_ssse3;
+#endif
+#ifdef UAC_CONVERT_NEON
+                if (level == UAC_SIMD_NEON) return deinterleave32_neon;
+#endif
+                return deinterleave_scalar<4>;
+            default:
+                return nullptr;
+        }
+    }
+}
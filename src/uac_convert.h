@@ -0,0 +1,80 @@
+// Copyright 2023 Jakub Księżniak
+// 
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// 
+//     http://www.apache.org/licenses/LICENSE-2.0
+// 
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include "libuac.h"
+#include <cstddef>
+#include <cstdint>
+
+namespace uac {
+
+    /**
+     * @brief Converts samples of one subframe size to a uac_sample_format.
+     *
+     * Integer subframes are read as left-justified signed PCM, so the bit resolution does not matter.
+     * The destination must not overlap the source.
+     */
+    using uac_convert_func = void (*)(const uint8_t *src, uint8_t *dst, size_t samples);
+
+    enum uac_simd_level {
+        UAC_SIMD_NONE,
+        UAC_SIMD_SSSE3,
+        UAC_SIMD_AVX2,
+        UAC_SIMD_NEON,
+    };
+
+    /**
+     * @brief The best instruction set supported by this CPU and build.
+     */
+    uac_simd_level detect_simd_level();
+
+    /**
+     * @brief The bytes of one sample delivered in the given format, 0 for UAC_SAMPLE_FORMAT_RAW.
+     */
+    size_t sample_format_size(uac_sample_format format);
+
+    /**
+     * @brief Selects the conversion kernel for the given instruction set.
+     *
+     * @param subframeSize the bytes of one device sample, 2, 3 or 4
+     * @param format the delivered format
+     * @param level an instruction set up to detect_simd_level()
+     * @return uac_convert_func or nullptr if the conversion is not supported
+     */
+    uac_convert_func find_converter(uint8_t subframeSize, uac_sample_format format, uac_simd_level level);
+
+    inline uac_convert_func find_converter(uint8_t subframeSize, uac_sample_format format) {
+        return find_converter(subframeSize, format, detect_simd_level());
+    }
+
+    /**
+     * @brief Transposes interleaved frames into one plane per channel.
+     *
+     * Channel c of frame f is stored at sample c * planePitch + f of the destination.
+     * The destination must not overlap the source.
+     */
+    using uac_deinterleave_func = void (*)(const uint8_t *src, uint8_t *dst, size_t frames, uint channels, size_t planePitch);
+
+    /**
+     * @brief Selects the transpose kernel for samples of 1 to 4 bytes.
+     *
+     * @return uac_deinterleave_func or nullptr if the sample size is not supported
+     */
+    uac_deinterleave_func find_deinterleaver(size_t sampleSize, uac_simd_level level);
+
+    inline uac_deinterleave_func find_deinterleaver(size_t sampleSize) {
+        return find_deinterleaver(sampleSize, detect_simd_level());
+    }
+}
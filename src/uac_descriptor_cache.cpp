@@ -0,0 +1,128 @@
+// Copyright 2023 Jakub Księżniak
+// 
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// 
+//     http://www.apache.org/licenses/LICENSE-2.0
+// 
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#include "uac_descriptor_cache.h"
+#include "uac_parser.h"
+#include "logging.h"
+
+namespace uac {
+
+    std::string usb_port_path(libusb_device *usb_device) {
+        uint8_t ports[7];
+        int count = libusb_get_port_numbers(usb_device, ports, sizeof(ports));
+        std::string path = std::to_string(libusb_get_bus_number(usb_device)) + "-";
+        for (int i = 0; i < count; ++i) {
+            path += (i > 0 ? "." : "") + std::to_string(ports[i]);
+        }
+        return path;
+    }
+
+    namespace {
+        struct fnv1a {
+            uint64_t value = 0xcbf29ce484222325ull;
+
+            void add(const uint8_t *data, int size) {
+                for (int i = 0; i < size; ++i) {
+                    add_byte(data[i]);
+                }
+            }
+
+            template<typename T>
+            void add(T field) {
+                for (size_t i = 0; i < sizeof(T); ++i) {
+                    add_byte(static_cast<uint8_t>(static_cast<uint64_t>(field) >> (8 * i)));
+                }
+            }
+
+            void add_byte(uint8_t byte) {
+                value = (value ^ byte) * 0x100000001b3ull;
+            }
+        };
+    }
+
+    uint64_t uac_descriptor_cache::hash_config(const libusb_config_descriptor *config) {
+        // the parsed fields stand for the raw descriptor, the class-specific descriptors are kept raw in extra
+        fnv1a hash;
+        hash.add(config->wTotalLength);
+        hash.add(config->bNumInterfaces);
+        hash.add(config->bConfigurationValue);
+        hash.add(config->bmAttributes);
+        hash.add(config->extra, config->extra_length);
+        for (int i = 0; i < config->bNumInterfaces; ++i) {
+            const libusb_interface &intf = config->interface[i];
+            hash.add(intf.num_altsetting);
+            for (int alt = 0; alt < intf.num_altsetting; ++alt) {
+                const libusb_interface_descriptor &ifdesc = intf.altsetting[alt];
+                hash.add(ifdesc.bInterfaceNumber);
+                hash.add(ifdesc.bAlternateSetting);
+                hash.add(ifdesc.bNumEndpoints);
+                hash.add(ifdesc.bInterfaceClass);
+                hash.add(ifdesc.bInterfaceSubClass);
+                hash.add(ifdesc.bInterfaceProtocol);
+                hash.add(ifdesc.iInterface);
+                hash.add(ifdesc.extra, ifdesc.extra_length);
+                for (int ep = 0; ep < ifdesc.bNumEndpoints; ++ep) {
+                    const libusb_endpoint_descriptor &epdesc = ifdesc.endpoint[ep];
+                    hash.add(epdesc.bEndpointAddress);
+                    hash.add(epdesc.bmAttributes);
+                    hash.add(epdesc.wMaxPacketSize);
+                    hash.add(epdesc.bInterval);
+                    hash.add(epdesc.bRefresh);
+                    hash.add(epdesc.bSynchAddress);
+                    hash.add(epdesc.extra, epdesc.extra_length);
+                }
+            }
+        }
+        return hash.value;
+    }
+
+    uac_parse_error uac_descriptor_cache::obtain(libusb_device *usb_device, const libusb_device_descriptor &desc, const parse_func &parse,
+                                                 std::shared_ptr<uac_audiocontrol> &model) {
+        uac_config_desc config(usb_device);
+        if (config.get() == nullptr) {
+            LOG_WARN("no configuration descriptor: %s", libusb_error_name(config.error()));
+            return UAC_PARSE_NO_CONFIG;
+        }
+        const uint64_t configHash = hash_config(config.get());
+        const std::string path = usb_port_path(usb_device);
+        {
+            std::lock_guard lock(mMutex);
+            auto it = models.find(path);
+            if (it != models.end() && it->second.idVendor == desc.idVendor && it->second.idProduct == desc.idProduct
+                && it->second.bcdDevice == desc.bcdDevice && it->second.configHash == configHash) {
+                LOG_DEBUG("cached model of %04x:%04x at %s", desc.idVendor, desc.idProduct, path.c_str());
+                model = it->second.model;
+                return UAC_PARSE_OK;
+            }
+        }
+        uac_parse_error result = parse(config.get(), model);
+        if (result != UAC_PARSE_OK) {
+            return result;
+        }
+        std::lock_guard lock(mMutex);
+        models[path] = entry{desc.idVendor, desc.idProduct, desc.bcdDevice, configHash, model};
+        return UAC_PARSE_OK;
+    }
+
+    size_t uac_descriptor_cache::size() const {
+        std::lock_guard lock(mMutex);
+        return models.size();
+    }
+
+    void uac_descriptor_cache::clear() {
+        std::lock_guard lock(mMutex);
+        models.clear();
+    }
+}
@@ -0,0 +1,69 @@
+// Copyright 2023 Jakub Księżniak
+// 
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// 
+//     http://www.apache.org/licenses/LICENSE-2.0
+// 
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#pragma once
+
+#include <libusb.h>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include "uac_parser.h"
+
+namespace uac {
+
+    /**
+     * @brief The bus number and port numbers of a device, e.g. "1-2.4", stable across replugs into the same port.
+     */
+    std::string usb_port_path(libusb_device *usb_device);
+
+    /**
+     * @brief The parsed AudioControl models of the devices seen by a context.
+     *
+     * A model is reused while the device at the same port reports the same vid/pid/bcdDevice and configuration
+     * descriptor, so re-enumerating a known device skips the parse and the topology build. One model is kept
+     * per port. Models are shared between device objects and must not change once cached.
+     */
+    class uac_descriptor_cache {
+    public:
+        // parses a device which is not cached, a failed parse is not cached
+        using parse_func = std::function<uac_parse_error(const libusb_config_descriptor *config, std::shared_ptr<uac_audiocontrol> &model)>;
+
+        uac_parse_error obtain(libusb_device *usb_device, const libusb_device_descriptor &desc, const parse_func &parse,
+                               std::shared_ptr<uac_audiocontrol> &model);
+
+        size_t size() const;
+        void clear();
+
+        /**
+         * @brief A 64-bit FNV-1a hash over all fields and class-specific extra bytes of a configuration descriptor.
+         */
+        static uint64_t hash_config(const libusb_config_descriptor *config);
+
+    private:
+        struct entry {
+            uint16_t idVendor;
+            uint16_t idProduct;
+            uint16_t bcdDevice;
+            uint64_t configHash;
+            std::shared_ptr<uac_audiocontrol> model;
+        };
+
+        mutable std::mutex mMutex;
+        std::map<std::string, entry> models;
+    };
+}
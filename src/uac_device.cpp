@@ -20,6 +20,7 @@
 #include <utility>
 #include "uac_parser.h"
 #include "uac_streaming.h"
+#include "uac_duplex.h"
 #include "logging.h"
 #include "uac_exceptions.h"
 
@@ -29,9 +30,7 @@ namespace uac {
         libusb_device_descriptor desc{};
         libusb_get_device_descriptor(usb_device, &desc);
 
-        LOG_DEBUG("try to scan device: %04x:%04x", desc.idVendor, desc.idProduct);
-        audiocontrol = uac_scan_device(usb_device);
-        fix_device_quirks(desc);
+        quirk_swap_channels = has_swapped_channels(desc);
         libusb_ref_device(usb_device);
     }
 
@@ -41,14 +40,46 @@ namespace uac {
         usb_device = nullptr;
     }
 
-    void uac_device_impl::fix_device_quirks(libusb_device_descriptor &desc) {
-        if (desc.idVendor == 0x534d && (desc.idProduct == 0x2109 || desc.idProduct == 0x0021)) {
+    uac_audiocontrol& uac_device_impl::get_audiocontrol() const {
+        // the parse path reports errors by value, a failed parse throws here and the next use tries again
+        std::call_once(audiocontrolOnce, [this] {
+            libusb_device_descriptor desc{};
+            libusb_get_device_descriptor(usb_device, &desc);
+            auto& cache = static_cast<uac_context_impl&>(*context).get_descriptor_cache();
+            auto parse = [&desc](const libusb_config_descriptor *config, std::shared_ptr<uac_audiocontrol> &model) {
+                LOG_DEBUG("try to scan device: %04x:%04x", desc.idVendor, desc.idProduct);
+                std::unique_ptr<uac_audiocontrol> parsed;
+                uac_parse_error result = uac_scan_config(config, parsed);
+                if (result == UAC_PARSE_OK) {
+                    fix_device_quirks(desc, *parsed);
+                    model = std::move(parsed);
+                }
+                return result;
+            };
+            std::shared_ptr<uac_audiocontrol> model;
+            uac_parse_error result = cache.obtain(usb_device, desc, parse, model);
+            if (result != UAC_PARSE_OK) {
+                throw invalid_device_exception(uac_parse_error_name(result));
+            }
+            audiocontrol = std::move(model);
+        });
+        return *audiocontrol;
+    }
+
+    bool uac_device_impl::has_swapped_channels(const libusb_device_descriptor &desc) {
+        return desc.idVendor == 0x534d && (desc.idProduct == 0x2109 || desc.idProduct == 0x0021);
+    }
+
+    void uac_device_impl::fix_device_quirks(const libusb_device_descriptor &desc, uac_audiocontrol &model) {
+        if (has_swapped_channels(desc)) {
             LOG_DEBUG("Apply device quirks!!");
-            auto& setting = audiocontrol->streams.back();
-            auto format = (uac_format_type_1*)(setting.altsettings[0].formatTypeDesc.get());
+            if (model.streams.empty() || model.streams.back().altsettings.empty()) return;
+            auto& setting = model.streams.back();
+            if (setting.altsettings[0].getFormatType1() == nullptr) return;
+            auto format = static_cast<uac_format_type_1*>(setting.altsettings[0].formatTypeDesc);
             format->bNrChannels = 2;
             format->tSamFreq[0] = 48000;
-            quirk_swap_channels = true;
+            setting.index_capabilities(model.arena);
         }
     }
 
@@ -86,7 +117,7 @@ namespace uac {
     }
 
     std::vector<ref_uac_audio_route> uac_device_impl::query_audio_routes(uac_terminal_type termIn, uac_terminal_type termOut) const {
-        auto& routes = audiocontrol->audio_routes();
+        auto routes = get_audiocontrol().audio_routes();
         std::vector<ref_uac_audio_route> elems;
         for (auto&& aft : routes) {
             if (aft.contains_terminal_out(termOut) && aft.contains_terminal_in(termIn)) {
@@ -97,10 +128,11 @@ namespace uac {
     }
 
     const uac_stream_if& uac_device_impl::get_stream_interface(const uac_audio_route& route) const {
-        auto route_impl = static_cast<const uac_audio_route_impl&>(route);
-        for (auto &stream : audiocontrol->streams) {
+        auto& route_impl = static_cast<const uac_audio_route_impl&>(route);
+        for (auto &stream : get_audiocontrol().streams) {
             for (auto& alt : stream.altsettings) {
-                if (alt.general.bTerminalLink == route_impl.entry->outTerminal->bTerminalID) {
+                // capture streams link to the output terminal, playback streams to an input terminal
+                if (route_impl.contains_terminal_id(alt.general.bTerminalLink)) {
                     return stream;
                 }
             }
@@ -115,13 +147,24 @@ namespace uac {
 
     uac_device_handle_impl::~uac_device_handle_impl() {
         LOG_VERBOSE("destructor");
-        close();
+        // streams hold the handle, so none runs any more
+        close_usb_handle();
     }
 
     void uac_device_handle_impl::close() {
         LOG_ENTER();
+        {
+            std::lock_guard lock(claimsMutex);
+            if (usb_handle != nullptr && !interfaceClaims.empty()) {
+                throw std::logic_error("close() while streams are running");
+            }
+        }
+        close_usb_handle();
+    }
+
+    void uac_device_handle_impl::close_usb_handle() noexcept {
         if (usb_handle != nullptr) {
-            detach();
+            get_transfer_pool().purge(usb_handle);
             LOG_VERBOSE("close %p", usb_handle);
             libusb_close(usb_handle);
             usb_handle = nullptr;
@@ -129,22 +172,86 @@ namespace uac {
     }
 
     void uac_device_handle_impl::detach() {
-        LOG_ENTER();
-        if (usb_handle != nullptr) {
-            int bInterfaceNumber = device->audiocontrol->bInterfaceNumber;
-            LOG_DEBUG("release AC intf(%d)", bInterfaceNumber);
-            libusb_release_interface(usb_handle, bInterfaceNumber);
+        // the interfaces are released with the last stream using them
+    }
+
+    void uac_device_handle_impl::claim_interface(uint8_t interfaceNr, bool exclusive) {
+        std::lock_guard lock(claimsMutex);
+        auto claim = interfaceClaims.find(interfaceNr);
+        if (claim != interfaceClaims.end()) {
+            if (exclusive) {
+                throw std::logic_error("the stream interface is already streaming");
+            }
+            ++claim->second;
+            return;
+        }
+        LOG_DEBUG("claim intf(%d)", interfaceNr);
+        int errval = libusb_claim_interface(usb_handle, interfaceNr);
+        if (errval != LIBUSB_SUCCESS) {
+            throw usb_exception_impl("libusb_claim_interface()", (libusb_error)errval);
+        }
+        interfaceClaims[interfaceNr] = 1;
+    }
+
+    void uac_device_handle_impl::release_interface(uint8_t interfaceNr) {
+        std::lock_guard lock(claimsMutex);
+        auto claim = interfaceClaims.find(interfaceNr);
+        if (claim == interfaceClaims.end() || --claim->second > 0) {
+            return;
+        }
+        interfaceClaims.erase(claim);
+        LOG_DEBUG("release intf(%d)", interfaceNr);
+        auto errval = libusb_release_interface(usb_handle, interfaceNr);
+        if (errval != LIBUSB_SUCCESS) {
+            LOG_DEBUG("Got error when releasing intf(%d): %s", interfaceNr, libusb_error_name(errval));
         }
     }
 
+    uint8_t uac_device_handle_impl::get_audiocontrol_interface() const {
+        return device->get_audiocontrol().bInterfaceNumber;
+    }
+
+    uac_transfer_pool& uac_device_handle_impl::get_transfer_pool() const {
+        return static_cast<uac_context_impl&>(*device->context).get_transfer_pool();
+    }
+
     std::shared_ptr<uac_stream_handle> uac_device_handle_impl::start_streaming(const uac_stream_if& streamIf, const uac_audio_config_uncompressed& config, stream_cb_func cb_func) {
         return start_streaming(streamIf, config, cb_func, 1);
     }
 
     std::shared_ptr<uac_stream_handle> uac_device_handle_impl::start_streaming(const uac_stream_if& streamIf, const uac_audio_config_uncompressed& config, stream_cb_func cb_func, int burst) {
-        auto* streamIfImpl = static_cast<const uac_stream_if_impl*>(&streamIf);
-        
+        uac_stream_options options;
+        options.cb_func = std::move(cb_func);
+        options.burst = burst;
+        return start_streaming(streamIf, config, options);
+    }
+
+    std::shared_ptr<uac_stream_handle> uac_device_handle_impl::start_streaming(const uac_stream_if& streamIf, const uac_audio_config_uncompressed& config, const uac_stream_options& options) {
+        if (options.burst < 1) throw std::invalid_argument("invalid burst value");
+
+        auto streamHandle = create_stream(streamIf, config);
+        streamHandle->start(options);
+        return streamHandle;
+    }
+
+    std::shared_ptr<uac_duplex_stream_handle> uac_device_handle_impl::start_duplex_streaming(const uac_stream_if& captureIf, const uac_audio_config_uncompressed& captureConfig,
+                                                                                             const uac_stream_if& playbackIf, const uac_audio_config_uncompressed& playbackConfig,
+                                                                                             duplex_cb_func cb_func, int burst) {
         if (burst < 1) throw std::invalid_argument("invalid burst value");
+        if (!cb_func) throw std::invalid_argument("missing duplex callback");
+
+        auto captureHandle = create_stream(captureIf, captureConfig);
+        auto playbackHandle = create_stream(playbackIf, playbackConfig);
+        if (captureHandle->is_playback() || !playbackHandle->is_playback()) {
+            throw std::invalid_argument("duplex streams need a capture and a playback interface");
+        }
+        auto duplexHandle = std::make_shared<uac_duplex_stream_handle_impl>(captureHandle, playbackHandle, std::move(cb_func));
+        duplexHandle->start(burst);
+        return duplexHandle;
+    }
+
+    std::shared_ptr<uac_stream_handle_impl> uac_device_handle_impl::create_stream(const uac_stream_if& streamIf, const uac_audio_config_uncompressed& config) {
+        auto* streamIfImpl = static_cast<const uac_stream_if_impl*>(&streamIf);
 
         auto result = std::find_if(streamIfImpl->altsettings.begin(), streamIfImpl->altsettings.end(), [config](const uac_altsetting& alt) {
             return config.bAlternateSetting == alt.bAlternateSetting;
@@ -152,23 +259,18 @@ namespace uac {
         if (result == streamIfImpl->altsettings.end()) throw std::invalid_argument("invalid format");
         const auto& altsetting = *result;
 
-        LOG_DEBUG("claim AC intf(%d)", device->audiocontrol->bInterfaceNumber);
-        int errval = libusb_claim_interface(usb_handle, device->audiocontrol->bInterfaceNumber);
-        if (errval != LIBUSB_SUCCESS) {
-            throw usb_exception_impl("libusb_claim_interface()", (libusb_error)errval);
-        }
-
         auto streamHandle = std::make_shared<uac_stream_handle_impl>(shared_from_this(), streamIfImpl->bInterfaceNr, altsetting);
         streamHandle->set_sampling_rate(config.tSampleRate);
-        streamHandle->start(cb_func, burst);
         return streamHandle;
     }
 
     bool uac_device_handle_impl::is_master_muted(const uac_audio_route &route) {
-        auto route_impl = static_cast<const uac_audio_route_impl&>(route);
+        auto& route_impl = static_cast<const uac_audio_route_impl&>(route);
         const int cs = MUTE_CONTROL;
         const int cn = 0;
-        const int unit = route_impl.entry->sources[0]->unit->bUnitID;
+        const uac_unit_desc *unit_desc = route_impl.source_unit();
+        if (unit_desc == nullptr) throw std::invalid_argument("the route has no feature unit");
+        const int unit = unit_desc->bUnitID;
         uint8_t data = 0;
 
         int errval = libusb_control_transfer(
@@ -176,7 +278,7 @@ namespace uac {
             REQ_TYPE_IF_GET,
             REQ_GET_CUR,
             cs << 8 | cn,
-            unit << 8 | device->audiocontrol->bInterfaceNumber,
+            unit << 8 | device->get_audiocontrol().bInterfaceNumber,
             &data,
             sizeof(data),
             0 /* timeout */);
@@ -188,10 +290,12 @@ namespace uac {
     }
 
     int16_t uac_device_handle_impl::get_feature_master_volume(const uac_audio_route &route) {
-        auto route_impl = static_cast<const uac_audio_route_impl&>(route);
+        auto& route_impl = static_cast<const uac_audio_route_impl&>(route);
         const int cs = VOLUME_CONTROL;
         const int cn = 0;
-        const int unit = route_impl.entry->sources[0]->unit->bUnitID;
+        const uac_unit_desc *unit_desc = route_impl.source_unit();
+        if (unit_desc == nullptr) throw std::invalid_argument("the route has no feature unit");
+        const int unit = unit_desc->bUnitID;
         int16_t data = 0;
 
         int errval = libusb_control_transfer(
@@ -199,7 +303,7 @@ namespace uac {
             REQ_TYPE_IF_GET,
             REQ_GET_CUR,
             cs << 8 | cn,
-            unit << 8 | device->audiocontrol->bInterfaceNumber,
+            unit << 8 | device->get_audiocontrol().bInterfaceNumber,
             (uint8_t*) &data,
             sizeof(data),
             0 /* timeout */);
@@ -223,51 +327,58 @@ namespace uac {
     }
 
     std::string uac_device_handle_impl::get_name() const {
-        return getString(device->audiocontrol->iInterface);
+        return getString(device->get_audiocontrol().iInterface);
     }
 
-    static void dump_format(FILE *f, uac_format_type_desc *format);
+    static void dump_format(FILE *f, const uac_format_type_desc *format);
     void uac_device_handle_impl::dump(FILE *f) const {
         if (f == nullptr) f = stderr;
 
         fprintf(f, "--- USB AUDIO DEVICE CONFIGURATION ---\n");
 
         fprintf(f, "Audio Control:\n");
-        fprintf(f, "bcdADC: 0x%04x\n", device->audiocontrol->bcdADC);
-        fprintf(f, "bInterfaceNumber: %d\n", device->audiocontrol->bInterfaceNumber);
+        fprintf(f, "bcdADC: 0x%04x\n", device->get_audiocontrol().bcdADC);
+        fprintf(f, "bInterfaceNumber: %d\n", device->get_audiocontrol().bInterfaceNumber);
 
-        if (device->audiocontrol->iInterface == 0) {
+        if (device->get_audiocontrol().iInterface == 0) {
             fprintf(f, "iInterface: 0\n");
         } else {
             fprintf(f, "iInterface: %s\n", get_name().c_str());
         }
 
         fprintf(f, "Input Terminals:\n");
-        for (auto&& terminal : device->audiocontrol->inputTerminals) {
-            fprintf(f, "- bTerminalID: %d\n", terminal->bTerminalID);
-            fprintf(f, "\twTerminalType: 0x%04x\n", terminal->wTerminalType);
-            fprintf(f, "\tbAssocTerminal: %d\n", terminal->bAssocTerminal);
-            fprintf(f, "\tbNrChannels: %d\n", terminal->bNrChannels);
-            fprintf(f, "\twChannelConfig: 0x%04x\n", terminal->wChannelConfig);
-            fprintf(f, "\tiTerminal: %d\n", terminal->iTerminal);
+        for (auto&& terminal : device->get_audiocontrol().inputTerminals) {
+            fprintf(f, "- bTerminalID: %d\n", terminal.bTerminalID);
+            fprintf(f, "\twTerminalType: 0x%04x\n", terminal.wTerminalType);
+            fprintf(f, "\tbAssocTerminal: %d\n", terminal.bAssocTerminal);
+            fprintf(f, "\tbNrChannels: %d\n", terminal.bNrChannels);
+            fprintf(f, "\twChannelConfig: 0x%04x\n", terminal.wChannelConfig);
+            fprintf(f, "\tiTerminal: %d\n", terminal.iTerminal);
         }
         fprintf(f, "Units:\n");
-        for (auto&& unit : device->audiocontrol->units) {
-            fprintf(f, "- bUnitID: %d\n", unit->bUnitID);
-            fprintf(f, "\tunitType: 0x%02x\n", unit->unitType);
-            // todo print unit types
+        for (auto&& unit : device->get_audiocontrol().units) {
+            fprintf(f, "- bUnitID: %d\n", unit.bUnitID);
+            fprintf(f, "\tunitType: 0x%02x\n", unit.unitType);
+            fprintf(f, "\tbaSourceID:");
+            for (auto sourceId : unit.sourceIds) {
+                fprintf(f, " %d", sourceId);
+            }
+            fprintf(f, "\n");
+            if (unit.unitType == UAC_AC_PROCESSING_UNIT || unit.unitType == UAC_AC_EXTENSION_UNIT) {
+                fprintf(f, "\twProcessType: 0x%04x\n", unit.wProcessType);
+            }
         }
         fprintf(f, "Output Terminals:\n");
-        for (auto&& terminal : device->audiocontrol->outputTerminals) {
-            fprintf(f, "- bTerminalID: %d\n", terminal->bTerminalID);
-            fprintf(f, "\twTerminalType: 0x%04x\n", terminal->wTerminalType);
-            fprintf(f, "\tbAssocTerminal: %d\n", terminal->bAssocTerminal);
-            fprintf(f, "\tbSourceID: %d\n", terminal->bSourceID);
-            fprintf(f, "\tiTerminal: %d\n", terminal->iTerminal);
+        for (auto&& terminal : device->get_audiocontrol().outputTerminals) {
+            fprintf(f, "- bTerminalID: %d\n", terminal.bTerminalID);
+            fprintf(f, "\twTerminalType: 0x%04x\n", terminal.wTerminalType);
+            fprintf(f, "\tbAssocTerminal: %d\n", terminal.bAssocTerminal);
+            fprintf(f, "\tbSourceID: %d\n", terminal.bSourceID);
+            fprintf(f, "\tiTerminal: %d\n", terminal.iTerminal);
         }
 
         fprintf(f, "Audio Streams:\n");
-        for (auto&& as : device->audiocontrol->streams) {
+        for (auto&& as : device->get_audiocontrol().streams) {
             fprintf(f, "- bInterfaceNr: %d\n", as.bInterfaceNr);
             for (int i = 0; i < as.altsettings.size(); ++i) {
                 auto && altsetting = as.altsettings[i];
@@ -275,19 +386,22 @@ namespace uac {
                 fprintf(f, "\t  bTerminalLink: %d\n", altsetting.general.bTerminalLink);
                 fprintf(f, "\t  wFormatTag: 0x%04x\n", altsetting.general.wFormatTag);
                 fprintf(f, "\t  bDelay: %d\n", altsetting.general.bDelay);
-                dump_format(f, altsetting.formatTypeDesc.get());
+                dump_format(f, altsetting.formatTypeDesc);
                 fprintf(f, "\t  wMaxPacketSize: %d\n", altsetting.endpoint.wMaxPacketSize);
+                if (altsetting.hasSyncEndpoint()) {
+                    fprintf(f, "\t  sync bEndpointAddress: 0x%02x\n", altsetting.syncEndpoint.bEndpointAddress);
+                }
             }
         }
     }
 
-    static void dump_format(FILE *f, uac_format_type_desc *format) {
+    static void dump_format(FILE *f, const uac_format_type_desc *format) {
         fprintf(f, "\t  bFormatType: 0x%02x\n", format->bFormatType);
-        uac_format_type_1 *format1;
+        const uac_format_type_1 *format1;
         switch (format->bFormatType) {
         case UAC_FORMAT_TYPE_I:
         case UAC_FORMAT_TYPE_III:
-            format1 = (uac_format_type_1*)format;
+            format1 = static_cast<const uac_format_type_1*>(format);
             fprintf(f, "\t  bNrChannels: %d\n", format1->bNrChannels);
             fprintf(f, "\t  bSubframeSize: %d\n", format1->bSubframeSize);
             fprintf(f, "\t  bBitResolution: %d\n", format1->bBitResolution);
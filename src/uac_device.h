@@ -15,10 +15,14 @@
 #pragma once
 
 #include "libuac.h"
+#include "uac_transfer_pool.h"
+#include <map>
+#include <mutex>
 
 namespace uac {
 
     class uac_audiocontrol;
+    class uac_stream_handle_impl;
 
     class uac_device_impl : public uac_device, public std::enable_shared_from_this<uac_device_impl> {
     public:
@@ -38,12 +42,19 @@ namespace uac {
 
         bool hasQuirkSwapChannels() const;
 
+        // the descriptor model, parsed on first use
+        uac_audiocontrol& get_audiocontrol() const;
+
     private:
-        void fix_device_quirks(libusb_device_descriptor &desc);
+        // quirks change the model while it is parsed, before it is cached and shared
+        static void fix_device_quirks(const libusb_device_descriptor &desc, uac_audiocontrol &model);
+        static bool has_swapped_channels(const libusb_device_descriptor &desc);
 
         libusb_device *usb_device;
         std::shared_ptr<uac_context> context;
-        std::unique_ptr<uac_audiocontrol> audiocontrol;
+        // shared with the other device objects of the same physical device, through the descriptor cache
+        mutable std::once_flag audiocontrolOnce;
+        mutable std::shared_ptr<uac_audiocontrol> audiocontrol;
 
         friend class uac_device_handle_impl;
 
@@ -65,6 +76,10 @@ namespace uac {
 
         std::shared_ptr<uac_stream_handle> start_streaming(const uac_stream_if& streamIf, const uac_audio_config_uncompressed& config, stream_cb_func cb_func) override;
         std::shared_ptr<uac_stream_handle> start_streaming(const uac_stream_if& streamIf, const uac_audio_config_uncompressed& config, stream_cb_func cb_func, int burst) override;
+        std::shared_ptr<uac_stream_handle> start_streaming(const uac_stream_if& streamIf, const uac_audio_config_uncompressed& config, const uac_stream_options& options) override;
+        std::shared_ptr<uac_duplex_stream_handle> start_duplex_streaming(const uac_stream_if& captureIf, const uac_audio_config_uncompressed& captureConfig,
+                                                                         const uac_stream_if& playbackIf, const uac_audio_config_uncompressed& playbackConfig,
+                                                                         duplex_cb_func cb_func, int burst) override;
 
         std::string get_name() const override;
 
@@ -74,10 +89,22 @@ namespace uac {
         void dump(FILE *f) const override;
 
     private:
+        // close() without the check for running streams, for the destructor
+        void close_usb_handle() noexcept;
         std::string getString(uint8_t index) const;
+        uac_transfer_pool& get_transfer_pool() const;
+        std::shared_ptr<uac_stream_handle_impl> create_stream(const uac_stream_if& streamIf, const uac_audio_config_uncompressed& config);
+
+        // streams share the AudioControl interface and own their AudioStreaming interface exclusively
+        void claim_interface(uint8_t interfaceNr, bool exclusive);
+        void release_interface(uint8_t interfaceNr);
+        uint8_t get_audiocontrol_interface() const;
 
         libusb_device_handle *usb_handle;
 
+        std::mutex claimsMutex;
+        std::map<uint8_t, int> interfaceClaims;
+
         std::shared_ptr<uac_device_impl> device;
 
         friend class uac_stream_handle_impl;
@@ -0,0 +1,115 @@
+// Copyright 2023 Jakub Księżniak
+// 
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// 
+//     http://www.apache.org/licenses/LICENSE-2.0
+// 
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "uac_duplex.h"
+
+#include <algorithm>
+#include <stdexcept>
+#include "logging.h"
+
+namespace uac {
+
+    uac_duplex_stream_handle_impl::uac_duplex_stream_handle_impl(std::shared_ptr<uac_stream_handle_impl> capture, std::shared_ptr<uac_stream_handle_impl> playback, duplex_cb_func cb_func) :
+        capture(std::move(capture)), playback(std::move(playback)), cb_func(std::move(cb_func)) {
+    }
+
+    uac_duplex_stream_handle_impl::~uac_duplex_stream_handle_impl() {
+        stop();
+    }
+
+    void uac_duplex_stream_handle_impl::start(int burst) {
+        const uint32_t sampleRate = capture->get_sampling_rate();
+        if (sampleRate != playback->get_sampling_rate()) {
+            throw std::invalid_argument("capture and playback sample rates differ");
+        }
+
+        uac_stream_options captureOptions;
+        captureOptions.transfer_cb_func = [this](const uac_transfer_data& data) {
+            on_capture(data);
+        };
+        captureOptions.burst = burst;
+        capture->prepare(captureOptions);
+
+        // a capture transfer arrives at once, one packet more absorbs the completion order of both directions
+        const uint prefill = capture->get_transfer_frames() + capture->get_max_packet_frames();
+        try {
+            uac_stream_options playbackOptions;
+            playbackOptions.burst = burst;
+            playbackOptions.bufferFrames = prefill + capture->get_queued_frames();
+            playback->prepare(playbackOptions);
+
+            captureSizer = std::make_unique<uac_packet_sizer>(sampleRate, capture->get_packets_per_second());
+            silence.assign(static_cast<size_t>(capture->get_max_packet_frames()) * capture->get_stride(), 0);
+            playbackBuffer.resize(static_cast<size_t>(capture->get_max_packet_frames()) * playback->get_stride());
+
+            // the playback queue starts with silence, then plays the prefill while the first capture transfer is in flight
+            playback->submit();
+            std::vector<uint8_t> prefillData(static_cast<size_t>(prefill) * playback->get_stride(), 0);
+            playback->write(prefillData.data(), prefill, 0);
+        } catch (...) {
+            // neither stream runs, so no altsetting may stay selected
+            playback->stop();
+            playback->unprepare();
+            capture->unprepare();
+            throw;
+        }
+        try {
+            capture->submit();
+        } catch (...) {
+            playback->stop();
+            throw;
+        }
+        roundTripFrames = playback->get_queued_frames() + prefill;
+        LOG_DEBUG("duplex stream at %u Hz, round trip %u frames", sampleRate, roundTripFrames);
+    }
+
+    void uac_duplex_stream_handle_impl::stop() {
+        // no more playback data once capture has stopped
+        capture->stop();
+        playback->stop();
+    }
+
+    void uac_duplex_stream_handle_impl::on_capture(const uac_transfer_data& data) {
+        const uint captureStride = capture->get_stride();
+        const uint maxFrames = capture->get_max_packet_frames();
+        for (uint i = 0; i < data.num_packets; ++i) {
+            const auto& packet = data.packets[i];
+            const uint expected = std::min(captureSizer->next(), maxFrames);
+            const uint8_t *in;
+            uint frames;
+            if (packet.status == LIBUSB_TRANSFER_COMPLETED && packet.actual_length > 0) {
+                in = data.buffer + packet.offset;
+                frames = packet.actual_length / captureStride;
+            } else {
+                in = silence.data();
+                frames = expected;
+            }
+            if (frames == 0) continue;
+            cb_func(in, playbackBuffer.data(), frames);
+            uint written = playback->write(playbackBuffer.data(), frames, 0);
+            if (written < frames) {
+                LOG_VERBOSE("duplex playback overrun, dropped %u frames", frames - written);
+            }
+        }
+    }
+
+    error_code uac_duplex_stream_handle_impl::check_streaming_error() const {
+        error_code error = capture->check_streaming_error();
+        return error != UAC_NO_ERROR ? error : playback->check_streaming_error();
+    }
+
+    uint uac_duplex_stream_handle_impl::get_round_trip_frames() const {
+        return roundTripFrames;
+    }
+}
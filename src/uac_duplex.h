@@ -0,0 +1,54 @@
+// Copyright 2023 Jakub Księżniak
+// 
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// 
+//     http://www.apache.org/licenses/LICENSE-2.0
+// 
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include "libuac.h"
+#include "uac_streaming.h"
+#include "uac_packet_sizer.h"
+
+namespace uac {
+
+    /**
+     * @brief Drives a playback stream from the completions of a capture stream.
+     *
+     * Both streams run on the same device clock, so every captured packet is answered with the same number of
+     * frames written to the playback ring buffer, which is prefilled to bridge one capture transfer.
+     */
+    class uac_duplex_stream_handle_impl : public uac_duplex_stream_handle {
+    public:
+        uac_duplex_stream_handle_impl(std::shared_ptr<uac_stream_handle_impl> capture, std::shared_ptr<uac_stream_handle_impl> playback, duplex_cb_func cb_func);
+        ~uac_duplex_stream_handle_impl();
+
+        void start(int burst);
+        void stop() override;
+
+        error_code check_streaming_error() const override;
+        uint get_round_trip_frames() const override;
+
+    private:
+        void on_capture(const uac_transfer_data& data);
+
+        const std::shared_ptr<uac_stream_handle_impl> capture;
+        const std::shared_ptr<uac_stream_handle_impl> playback;
+        duplex_cb_func cb_func;
+
+        // expected capture frames, to answer lost packets with silence and keep the offset
+        std::unique_ptr<uac_packet_sizer> captureSizer;
+        std::vector<uint8_t> silence;
+        std::vector<uint8_t> playbackBuffer;
+
+        uint roundTripFrames = 0;
+    };
+}
@@ -33,6 +33,7 @@ namespace uac {
     class invalid_device_exception : public uac_exception {
     public:
         invalid_device_exception() : uac_exception("Invalid device") {}
+        explicit invalid_device_exception(const char* reason) : uac_exception("Invalid device: %s", reason) {}
     };
 
     class usb_exception_impl : public usb_exception {
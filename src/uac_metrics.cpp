@@ -0,0 +1,66 @@
+// Copyright 2023 Jakub Księżniak
+// 
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// 
+//     http://www.apache.org/licenses/LICENSE-2.0
+// 
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "uac_metrics.h"
+
+namespace uac {
+
+    size_t uac_atomic_histogram::bucket(uint64_t value) {
+        size_t bits = 0;
+        while (value > 0 && bits < uac_histogram::BUCKETS - 1) {
+            value >>= 1;
+            ++bits;
+        }
+        return bits;
+    }
+
+    uac_histogram uac_atomic_histogram::snapshot() const {
+        uac_histogram result{};
+        for (size_t i = 0; i < uac_histogram::BUCKETS; ++i) {
+            result.counts[i] = counts[i].load(std::memory_order_relaxed);
+        }
+        return result;
+    }
+
+    void uac_atomic_histogram::reset() {
+        for (auto& count : counts) {
+            count.store(0, std::memory_order_relaxed);
+        }
+    }
+
+    uac_stream_metrics uac_stream_counters::snapshot(int inFlightTransfers) const {
+        uac_stream_metrics result{};
+        result.packets = packets.load(std::memory_order_relaxed);
+        result.bytes = bytes.load(std::memory_order_relaxed);
+        result.short_packets = shortPackets.load(std::memory_order_relaxed);
+        result.zero_packets = zeroPackets.load(std::memory_order_relaxed);
+        result.failed_packets = failedPackets.load(std::memory_order_relaxed);
+        result.timeouts = timeouts.load(std::memory_order_relaxed);
+        result.resubmit_failures = resubmitFailures.load(std::memory_order_relaxed);
+        result.deferred_frames = deferredFrames.load(std::memory_order_relaxed);
+        result.in_flight_transfers = inFlightTransfers;
+        result.callback_duration = callbackDuration.snapshot();
+        result.completion_interval = completionInterval.snapshot();
+        return result;
+    }
+
+    void uac_stream_counters::reset() {
+        for (auto* counter : {&packets, &bytes, &shortPackets, &zeroPackets, &failedPackets, &timeouts, &resubmitFailures, &deferredFrames}) {
+            counter->store(0, std::memory_order_relaxed);
+        }
+        callbackDuration.reset();
+        completionInterval.reset();
+        lastCompletion = -1;
+    }
+}
@@ -0,0 +1,71 @@
+// Copyright 2023 Jakub Księżniak
+// 
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// 
+//     http://www.apache.org/licenses/LICENSE-2.0
+// 
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include "libuac.h"
+#include <atomic>
+#include <cstdint>
+
+namespace uac {
+
+    /**
+     * @brief A uac_histogram filled with relaxed atomics by a single writer.
+     */
+    class uac_atomic_histogram {
+    public:
+        static size_t bucket(uint64_t value);
+
+        void record(uint64_t value) {
+            auto& count = counts[bucket(value)];
+            count.store(count.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        }
+
+        uac_histogram snapshot() const;
+        void reset();
+
+    private:
+        std::atomic<uint64_t> counts[uac_histogram::BUCKETS] = {};
+    };
+
+    /**
+     * @brief The counters behind uac_stream_metrics.
+     *
+     * There is one writer at a time, so increments need no read-modify-write: the starting thread while it
+     * prefills playback transfers, which submit() finishes before the first submission, and after that the
+     * USB event thread. libusb_submit_transfer() orders the prefill writes before the first completion.
+     */
+    struct uac_stream_counters {
+        static void add(std::atomic<uint64_t>& counter, uint64_t value) {
+            counter.store(counter.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+        }
+
+        std::atomic<uint64_t> packets{0};
+        std::atomic<uint64_t> bytes{0};
+        std::atomic<uint64_t> shortPackets{0};
+        std::atomic<uint64_t> zeroPackets{0};
+        std::atomic<uint64_t> failedPackets{0};
+        std::atomic<uint64_t> timeouts{0};
+        std::atomic<uint64_t> resubmitFailures{0};
+        std::atomic<uint64_t> deferredFrames{0};
+        uac_atomic_histogram callbackDuration;
+        uac_atomic_histogram completionInterval;
+
+        // the completion before the last one, only touched by the USB event thread
+        int64_t lastCompletion = -1;
+
+        uac_stream_metrics snapshot(int inFlightTransfers) const;
+        void reset();
+    };
+}
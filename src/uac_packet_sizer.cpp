@@ -0,0 +1,75 @@
+// Copyright 2023 Jakub Księżniak
+// 
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// 
+//     http://www.apache.org/licenses/LICENSE-2.0
+// 
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#include "uac_packet_sizer.h"
+
+#include <algorithm>
+
+namespace uac {
+
+    uac_packet_sizer::uac_packet_sizer(uint32_t sampleRate, uint32_t packetsPerSecond) :
+        sampleRate(sampleRate), packetsPerSecond(std::max<uint32_t>(packetsPerSecond, 1)) {
+    }
+
+    uint32_t uac_packet_sizer::next() {
+        uint32_t frames;
+        if (feedback > 0) {
+            feedbackRemainder += feedback;
+            frames = feedbackRemainder >> 16;
+            feedbackRemainder &= 0xFFFF;
+        } else {
+            remainder += sampleRate;
+            frames = remainder / packetsPerSecond;
+            remainder %= packetsPerSecond;
+        }
+        frames += deferred;
+        deferred = 0;
+        return frames;
+    }
+
+    uint32_t uac_packet_sizer::max_frames() const {
+        uint32_t nominal = (sampleRate + packetsPerSecond - 1) / packetsPerSecond;
+        return feedback > 0 ? std::max(nominal, (feedback + 0xFFFF) >> 16) : nominal;
+    }
+
+    void uac_packet_sizer::set_feedback(uint32_t framesPerPacket) {
+        feedback = framesPerPacket;
+    }
+
+    uint32_t decode_feedback(const uint8_t *data, uint32_t length, uint32_t nominal) {
+        uint64_t value;
+        if (length == 3) {
+            value = static_cast<uint64_t>(data[0] | data[1] << 8 | data[2] << 16) << 2;
+        } else if (length >= 4) {
+            value = data[0] | data[1] << 8 | data[2] << 16 | static_cast<uint64_t>(data[3]) << 24;
+        } else {
+            return 0;
+        }
+        // accept values within 25% of the nominal rate, in either format
+        for (uint64_t candidate : {value, value << 2, value >> 2}) {
+            if (candidate * 4 >= nominal * 3ull && candidate * 4 <= nominal * 5ull) {
+                return static_cast<uint32_t>(candidate);
+            }
+        }
+        return 0;
+    }
+
+    uint32_t iso_packets_per_second(uint8_t bInterval, bool highSpeed) {
+        // the service interval is 2^(bInterval-1) frames or microframes
+        int exponent = std::clamp<int>(bInterval, 1, 16) - 1;
+        uint32_t unitsPerSecond = highSpeed ? 8000 : 1000;
+        return std::max<uint32_t>(unitsPerSecond >> exponent, 1);
+    }
+}
@@ -0,0 +1,92 @@
+// Copyright 2023 Jakub Księżniak
+// 
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// 
+//     http://www.apache.org/licenses/LICENSE-2.0
+// 
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#pragma once
+
+#include <cstdint>
+
+namespace uac {
+
+    /**
+     * @brief Computes how many audio frames go into each ISO packet.
+     *
+     * The nominal rate is tracked with an exact remainder, so e.g. 44.1kHz at 1000 packets/s
+     * produces nine packets of 44 frames followed by one packet of 45 frames.
+     * Once an asynchronous device reports its actual rate through a feedback endpoint,
+     * packets follow that rate instead.
+     */
+    class uac_packet_sizer {
+    public:
+        uac_packet_sizer(uint32_t sampleRate, uint32_t packetsPerSecond);
+
+        /**
+         * @return the number of frames of the next packet
+         */
+        uint32_t next();
+
+        /**
+         * @return the largest number of frames a packet may carry
+         */
+        uint32_t max_frames() const;
+
+        uint32_t packets_per_second() const {
+            return packetsPerSecond;
+        }
+
+        /**
+         * Follows the rate measured by the device from now on.
+         *
+         * @param framesPerPacket the number of frames per packet in 16.16 fixed point
+         */
+        void set_feedback(uint32_t framesPerPacket);
+
+        /**
+         * Adds frames which did not fit into a packet to the next one, so the stream keeps the rate.
+         */
+        void defer(uint32_t frames) {
+            deferred += frames;
+        }
+
+    private:
+        const uint32_t sampleRate;
+        const uint32_t packetsPerSecond;
+        uint32_t remainder = 0;
+
+        uint32_t feedback = 0;
+        uint32_t feedbackRemainder = 0;
+        uint32_t deferred = 0;
+    };
+
+    /**
+     * @brief Decodes a value sent by an explicit feedback endpoint.
+     *
+     * Full speed devices send 10.14 fixed point in 3 bytes, high speed devices 16.16 in 4 bytes.
+     * Some devices send the other format, so the value is checked against the nominal rate.
+     *
+     * @param data the feedback packet
+     * @param length the packet length
+     * @param nominal the nominal number of frames per (micro)frame in 16.16 fixed point
+     * @return the number of frames per (micro)frame in 16.16 fixed point, or 0 if the value is implausible
+     */
+    uint32_t decode_feedback(const uint8_t *data, uint32_t length, uint32_t nominal);
+
+    /**
+     * @brief The number of ISO packets per second of an isochronous endpoint.
+     *
+     * @param bInterval the endpoint descriptor interval
+     * @param highSpeed whether the device runs at high speed or faster, where the interval unit is 125us
+     */
+    uint32_t iso_packets_per_second(uint8_t bInterval, bool highSpeed);
+}
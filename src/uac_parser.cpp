@@ -15,54 +15,114 @@
 #include "uac_parser.h"
 #include "logging.h"
 #include "uac_context.h"
-#include "uac_exceptions.h"
-#include <list>
 #include <sstream>
 #include <utility>
 
 namespace uac {
 
-    class uac_config_desc {
-        libusb_config_descriptor *config = nullptr;
-    public:
-        explicit uac_config_desc(libusb_device *udev) {
-            int errval = libusb_get_active_config_descriptor(udev, &config);
-            if (errval != LIBUSB_SUCCESS) {
-                errval = libusb_get_config_descriptor(udev, 0, &config);
-                if (errval != LIBUSB_SUCCESS) {
-                    throw usb_exception_impl("libusb_get_config_descriptor()", (libusb_error) errval);
-                }
-            }
+    const char* uac_parse_error_name(uac_parse_error error) {
+        switch (error) {
+            case UAC_PARSE_OK: return "ok";
+            case UAC_PARSE_NO_CONFIG: return "no configuration descriptor";
+            case UAC_PARSE_NOT_AUDIO: return "not an audio device";
+            case UAC_PARSE_MALFORMED: return "malformed AudioControl descriptors";
         }
-        ~uac_config_desc() {
-            libusb_free_config_descriptor(config);
+        return "unknown";
+    }
+
+    uac_config_desc::uac_config_desc(libusb_device *udev) {
+        int result = libusb_get_active_config_descriptor(udev, &config);
+        if (result != LIBUSB_SUCCESS) {
+            result = libusb_get_config_descriptor(udev, 0, &config);
         }
-        libusb_config_descriptor* operator->() {
-            return config;
+        if (result != LIBUSB_SUCCESS) {
+            config = nullptr;
+            errval = static_cast<libusb_error>(result);
         }
-    };
+    }
+
+    uac_config_desc::~uac_config_desc() {
+        if (config != nullptr) {
+            libusb_free_config_descriptor(config);
+        }
+    }
     
 
-    static std::unique_ptr<uac_audiocontrol> parse_audiocontrol(const libusb_interface_descriptor *ifdesc);
+    static std::unique_ptr<uac_audiocontrol> parse_audiocontrol(const libusb_interface_descriptor *ifdesc, size_t arenaCapacity);
     
     static void scan_audiostreaming(uac_audiocontrol& ac, const libusb_interface *usbintf);
-    static void parse_audiostreaming_intf(uac_stream_if_impl &stream_if, const libusb_interface_descriptor *altsettings, int num_altsetting);
+    static void parse_audiostreaming_intf(uac_arena &arena, uac_stream_if_impl &stream_if, const libusb_interface_descriptor *altsettings, int num_altsetting);
+    static bool find_stream_endpoints(const libusb_interface_descriptor *ifdesc, const libusb_endpoint_descriptor **dataEp, const libusb_endpoint_descriptor **syncEp);
+    static void parse_endpoint(uac_endpoint_desc &desc, const libusb_endpoint_descriptor *ep);
+
+    bool uac_is_audio_device(libusb_device *udev) {
+        libusb_device_descriptor desc{};
+        if (libusb_get_device_descriptor(udev, &desc) != LIBUSB_SUCCESS) {
+            return false;
+        }
+        // hubs, HID and the like declare their class on the device, audio functions on their interfaces
+        if (desc.bDeviceClass != LIBUSB_CLASS_PER_INTERFACE && desc.bDeviceClass != LIBUSB_CLASS_MISCELLANEOUS
+            && desc.bDeviceClass != LIBUSB_CLASS_AUDIO && desc.bDeviceClass != LIBUSB_CLASS_VENDOR_SPEC) {
+            return false;
+        }
+        libusb_config_descriptor *config = nullptr;
+        if (libusb_get_active_config_descriptor(udev, &config) != LIBUSB_SUCCESS
+            && libusb_get_config_descriptor(udev, 0, &config) != LIBUSB_SUCCESS) {
+            return false;
+        }
+        bool audio = uac_has_audiocontrol(config);
+        libusb_free_config_descriptor(config);
+        return audio;
+    }
+
+    bool uac_has_audiocontrol(const libusb_config_descriptor *configDesc) {
+        for (int i = 0; i < configDesc->bNumInterfaces; ++i) {
+            const libusb_interface &intf = configDesc->interface[i];
+            if (intf.num_altsetting > 0 && intf.altsetting[0].bInterfaceClass == LIBUSB_CLASS_AUDIO
+                && intf.altsetting[0].bInterfaceSubClass == uac_subclass_code::UAC_SUBCLASS_AUDIOCONTROL) {
+                return true;
+            }
+        }
+        return false;
+    }
 
-    std::unique_ptr<uac_audiocontrol> uac_scan_device(libusb_device *udev) {
+    uac_parse_error uac_scan_device(libusb_device *udev, std::unique_ptr<uac_audiocontrol> &audiocontrol) {
         uac_config_desc configDesc(udev);
-        std::unique_ptr<uac_audiocontrol> audiocontrol;
+        if (configDesc.get() == nullptr) {
+            LOG_WARN("no configuration descriptor: %s", libusb_error_name(configDesc.error()));
+            return UAC_PARSE_NO_CONFIG;
+        }
+        return uac_scan_config(configDesc.get(), audiocontrol);
+    }
+
+    // the arena size of a model, the parsed structs take a few times the bytes of the raw class-specific descriptors
+    static size_t estimate_model_size(const libusb_config_descriptor *configDesc) {
+        size_t size = 256;
+        for (int i = 0; i < configDesc->bNumInterfaces; ++i) {
+            const libusb_interface &intf = configDesc->interface[i];
+            for (int alt = 0; alt < intf.num_altsetting; ++alt) {
+                size += sizeof(uac_stream_if_impl) + sizeof(uac_altsetting) + 4 * intf.altsetting[alt].extra_length;
+            }
+        }
+        return size;
+    }
+
+    uac_parse_error uac_scan_config(const libusb_config_descriptor *configDesc, std::unique_ptr<uac_audiocontrol> &audiocontrol) {
+        audiocontrol.reset();
+        bool malformed = false;
         for (size_t i = 0; i < configDesc->bNumInterfaces; ++i) {
             auto intf_desc = configDesc->interface[i].altsetting;
             if (intf_desc->bInterfaceClass == LIBUSB_CLASS_AUDIO) {
                 LOG_DEBUG("found AUDIO Class interface, subclass=0x%x, protocol=%d", intf_desc->bInterfaceSubClass, intf_desc->bInterfaceProtocol);
                 switch (intf_desc->bInterfaceSubClass) {
                 case uac_subclass_code::UAC_SUBCLASS_AUDIOCONTROL:
-                    audiocontrol = parse_audiocontrol(intf_desc);
+                    audiocontrol = parse_audiocontrol(intf_desc, estimate_model_size(configDesc));
+                    malformed = !audiocontrol;
                     break;
                 case uac_subclass_code::UAC_SUBCLASS_AUDIOSTREAMING:
                     if (!audiocontrol) {
                         // we expect the AudioControl interface before any AudioStreaming interfaces
-                        throw invalid_device_exception();
+                        return malformed ? UAC_PARSE_MALFORMED : UAC_PARSE_NOT_AUDIO;
                     }
                     scan_audiostreaming(*audiocontrol, &configDesc->interface[i]);
                     break;
@@ -73,28 +133,28 @@ namespace uac {
         }
         if (!audiocontrol) {
             // this is not a valid USB Audio Class device
-            throw invalid_device_exception();
+            return malformed ? UAC_PARSE_MALFORMED : UAC_PARSE_NOT_AUDIO;
         }
-        return audiocontrol;
+        return UAC_PARSE_OK;
     }
 
-    std::unique_ptr<uac_audiocontrol> parse_audiocontrol(const libusb_interface_descriptor *ifdesc) {
+    std::unique_ptr<uac_audiocontrol> parse_audiocontrol(const libusb_interface_descriptor *ifdesc, size_t arenaCapacity) {
         auto data = ifdesc->extra;
         int remaining = ifdesc->extra_length;
 
         if (data == nullptr || remaining < 3) {
-            LOG_ERROR("no extra data available for a given interface: bInterfaceNumber=%d", ifdesc->bInterfaceNumber);
+            LOG_WARN("no extra data available for a given interface: bInterfaceNumber=%d", ifdesc->bInterfaceNumber);
             return nullptr;
         }
         int descSize = data[0];
         int descriptorType = data[1];
         int subtype = data[2];
-        if (subtype != UAC_AC_HEADER || descSize < 8) {
-            LOG_ERROR("expected a HEADER first but got an invalid descriptor sizeof(%d) %d:%d", descSize, descriptorType, subtype);
+        if (subtype != UAC_AC_HEADER || descSize < 8 || descSize > remaining || descSize < 8 + data[7]) {
+            LOG_WARN("expected a HEADER first but got an invalid descriptor sizeof(%d) %d:%d", descSize, descriptorType, subtype);
             return nullptr;
         }
         LOG_DEBUG("got HEADER descriptor. sizeof(%d)", descSize);
-        auto audiocontrol = std::make_unique<uac_audiocontrol>(ifdesc->bInterfaceNumber, ifdesc->iInterface);
+        auto audiocontrol = std::make_unique<uac_audiocontrol>(ifdesc->bInterfaceNumber, ifdesc->iInterface, arenaCapacity);
         parse_ac_header(*audiocontrol, data, descSize);
 
         if (audiocontrol->wTotalLength != remaining) {
@@ -104,12 +164,32 @@ namespace uac {
         remaining -= descSize;
         data += descSize;
 
+        // count the descriptors first, so terminals and units get arrays of their exact size
+        size_t numInputs = 0, numOutputs = 0, numUnits = 0;
+        for (int offset = 0; remaining - offset >= 3 && data[offset] >= 3 && data[offset] <= remaining - offset; offset += data[offset]) {
+            switch (data[offset + 2]) {
+            case UAC_AC_INPUT_TERMINAL: ++numInputs; break;
+            case UAC_AC_OUTPUT_TERMINAL: ++numOutputs; break;
+            case UAC_AC_MIXER_UNIT:
+            case UAC_AC_SELECTOR_UNIT:
+            case UAC_AC_FEATURE_UNIT:
+            case UAC_AC_PROCESSING_UNIT:
+            case UAC_AC_EXTENSION_UNIT: ++numUnits; break;
+            default: break;
+            }
+        }
+        auto& arena = audiocontrol->arena;
+        auto inputTerminals = arena.make_array<uac_input_terminal>(numInputs);
+        auto outputTerminals = arena.make_array<uac_output_terminal>(numOutputs);
+        auto units = arena.make_array<uac_unit_desc>(numUnits);
+        numInputs = numOutputs = numUnits = 0;
+
         // parse other descriptors
         while (remaining >= 3) {
             descSize = data[0];
             descriptorType = data[1];
             subtype = data[2];
-            if (remaining < descSize) {
+            if (remaining < descSize || descSize < 3) {
                 LOG_WARN("Bad descriptor size, exceeds remaining bytes %d < %d", remaining, descSize);
                 break;
             }
@@ -119,16 +199,24 @@ namespace uac {
                 LOG_DEBUG("got another HEADER descriptor. A bug or buggy device?");
                 break;
             case UAC_AC_INPUT_TERMINAL:
-                audiocontrol->inputTerminals.push_back(parse_input_terminal(data, descSize));
+                if (parse_input_terminal(inputTerminals[numInputs], data, descSize)) ++numInputs;
                 break;
             case UAC_AC_OUTPUT_TERMINAL:
-                audiocontrol->outputTerminals.push_back(parse_output_terminal(data, descSize));
+                if (parse_output_terminal(outputTerminals[numOutputs], data, descSize)) ++numOutputs;
                 break;
             case UAC_AC_MIXER_UNIT:
-                audiocontrol->units.push_back(parse_mixer_unit(data, descSize));
+                if (parse_mixer_unit(units[numUnits], arena, data, descSize)) ++numUnits;
+                break;
+            case UAC_AC_SELECTOR_UNIT:
+                if (parse_selector_unit(units[numUnits], arena, data, descSize)) ++numUnits;
                 break;
             case UAC_AC_FEATURE_UNIT:
-                audiocontrol->units.push_back(parse_feature_unit(data, descSize));
+                if (parse_feature_unit(units[numUnits], arena, data, descSize)) ++numUnits;
+                break;
+            case UAC_AC_PROCESSING_UNIT:
+            case UAC_AC_EXTENSION_UNIT:
+                // an extension unit has the layout of a processing unit up to its controls
+                if (parse_processing_unit(units[numUnits], arena, data, descSize)) ++numUnits;
                 break;
             
             default:
@@ -138,6 +226,9 @@ namespace uac {
             remaining -= descSize;
             data += descSize;
         }
+        audiocontrol->inputTerminals = {inputTerminals.data(), numInputs};
+        audiocontrol->outputTerminals = {outputTerminals.data(), numOutputs};
+        audiocontrol->units = {units.data(), numUnits};
 
         audiocontrol->configure_audio_function();
         return audiocontrol;
@@ -148,7 +239,7 @@ namespace uac {
             auto ifdesc = usbintf->altsetting;
             if (stream.bInterfaceNr == ifdesc->bInterfaceNumber) {
                 LOG_DEBUG("parse AS interface %d", ifdesc->bInterfaceNumber);
-                parse_audiostreaming_intf(stream, usbintf->altsetting, usbintf->num_altsetting);
+                parse_audiostreaming_intf(ac.arena, stream, usbintf->altsetting, usbintf->num_altsetting);
                 return;
             }
         }
@@ -156,158 +247,221 @@ namespace uac {
     }
 
     void uac_audiocontrol::configure_audio_function() {
-        for (auto &&terminal : outputTerminals) {
-            auto route = build_audio_topology(terminal);
-            audioFunctionTopology.push_back(route);
+        index_entities();
+        // routes are built in a scratch list, then stored next to each other
+        std::vector<uac_topology_entity> scratch;
+        std::vector<std::pair<size_t, size_t>> ranges;
+        for (size_t i = 0; i < outputTerminals.size(); ++i) {
+            size_t first = scratch.size();
+            build_audio_topology(scratch, i);
+            ranges.emplace_back(first, scratch.size() - first);
+        }
+        entities = arena.copy_array(scratch.data(), scratch.size());
+        audioFunctionTopology = arena.make_array<uac_audio_route_impl>(ranges.size());
+        for (size_t i = 0; i < ranges.size(); ++i) {
+            audioFunctionTopology[i] = uac_audio_route_impl(this, {entities.data() + ranges[i].first, ranges[i].second});
         }
     }
 
-    uac_audio_route_impl uac_audiocontrol::build_audio_topology(std::shared_ptr<uac_output_terminal> outputTerminal) {
+    void uac_audiocontrol::index_entities() {
+        for (auto& slot : entityIds) {
+            slot = entity_slot{};
+        }
+        auto add = [this](uint8_t id, uac_topology_entity::entity_kind kind, size_t index) {
+            if (entityIds[id].kind != uac_topology_entity::NONE) {
+                LOG_WARN("entity id %d is used twice", id);
+                return;
+            }
+            entityIds[id] = entity_slot{kind, static_cast<uint16_t>(index)};
+        };
+        // units first, they took precedence over terminals of the same id before
+        for (size_t i = 0; i < units.size(); ++i) {
+            add(units[i].bUnitID, uac_topology_entity::UNIT, i);
+        }
+        for (size_t i = 0; i < inputTerminals.size(); ++i) {
+            add(inputTerminals[i].bTerminalID, uac_topology_entity::INPUT_TERMINAL, i);
+        }
+        for (size_t i = 0; i < outputTerminals.size(); ++i) {
+            add(outputTerminals[i].bTerminalID, uac_topology_entity::OUTPUT_TERMINAL, i);
+        }
+    }
+
+    void uac_audiocontrol::build_audio_topology(std::vector<uac_topology_entity> &scratch, size_t outputTerminal) const {
         std::stringstream logStream;
-        auto outputEntity = std::make_shared<uac_topology_entity>(outputTerminal);
-
-        std::list<uac_topology_entity*> entities;
-        std::string verbose;
-        entities.push_back(outputEntity.get());
-        logStream << "out " << (int) outputTerminal->bTerminalID;
-        while (!entities.empty()) {
-            auto entity = entities.front();
-            entities.pop_front();
-            for (auto sourceId : entity->source_ids()) {
-                // check unit first
-                auto unit = find_unit(sourceId);
-                if (unit != nullptr) {
-                    logStream << " < unit " << (int) unit->bUnitID;
-                    entity = entity->link_source(unit);
-                    entities.push_back(entity);
+        const size_t first = scratch.size();
+        // each entity is visited once per route, which also ends a cycle in the descriptors
+        bool visited[256] = {};
+        visited[outputTerminals[outputTerminal].bTerminalID] = true;
+        scratch.push_back({uac_topology_entity::OUTPUT_TERMINAL, static_cast<uint16_t>(outputTerminal), uac_topology_entity::NO_SINK, 0, 0});
+        logStream << "out " << (int) outputTerminals[outputTerminal].bTerminalID;
+
+        // breadth-first, the scratch list is the queue
+        for (size_t pos = first; pos < scratch.size(); ++pos) {
+            uac_span<const uint8_t> sourceIds;
+            const uac_topology_entity entity = scratch[pos];
+            if (entity.kind == uac_topology_entity::OUTPUT_TERMINAL) {
+                sourceIds = {&outputTerminals[entity.index].bSourceID, 1};
+            } else if (entity.kind == uac_topology_entity::UNIT) {
+                sourceIds = units[entity.index].sourceIds;
+            }
+            const auto firstSource = static_cast<uint16_t>(scratch.size() - first);
+            const auto sink = static_cast<uint16_t>(pos - first);
+            for (auto sourceId : sourceIds) {
+                const entity_slot& slot = entityIds[sourceId];
+                if (visited[sourceId]) {
+                    continue;
+                }
+                if (slot.kind == uac_topology_entity::UNIT) {
+                    logStream << " < unit " << (int) sourceId;
+                } else if (slot.kind == uac_topology_entity::INPUT_TERMINAL) {
+                    logStream << " < in " << (int) sourceId;
                 } else {
-                    // then maybe it's an input terminal
-                    auto inTerminal = find_input_terminal(sourceId);
-                    if (inTerminal != nullptr) {
-                        logStream << " < in " << (int) inTerminal->bTerminalID;
-                        entity = entity->link_source(inTerminal);
-                    } else {
-                        logStream << " <- This topology looks invalid, not ending with the Terminal.";
-                    }
+                    logStream << " <- This topology looks invalid, not ending with the Terminal.";
+                    continue;
                 }
+                visited[sourceId] = true;
+                scratch.push_back({slot.kind, slot.index, sink, 0, 0});
             }
+            scratch[pos].firstSource = firstSource;
+            scratch[pos].numSources = static_cast<uint16_t>(scratch.size() - first - firstSource);
         }
         LOG_DEBUG("audio route chain : %s", logStream.str().c_str());
-        return {outputEntity};
     }
 
-    std::shared_ptr<uac_unit> uac_audiocontrol::find_unit(int id) {
-        for (auto &&unit : units) {
-            if (unit->bUnitID == id) return unit;
+    void parse_ac_header(uac_audiocontrol& ac, const uint8_t *data, int size) {
+        ac.bcdADC = TO_WORD(data+3);
+        ac.wTotalLength = TO_WORD(data+5);
+        uint8_t bInCollection = data[7];
+        ac.streams = ac.arena.make_array<uac_stream_if_impl>(bInCollection);
+        for (size_t i = 0; i < bInCollection; ++i) {
+            ac.streams[i].bInterfaceNr = data[8+i];
+            LOG_DEBUG("\t got Audio Streaming interface at: %d", ac.streams[i].bInterfaceNr);
         }
-        return {}; // empty
     }
 
-    std::shared_ptr<uac_input_terminal> uac_audiocontrol::find_input_terminal(int id) {
-        for (auto &&terminal : inputTerminals) {
-            if (terminal->bTerminalID == id) return terminal;
+    bool parse_input_terminal(uac_input_terminal &terminal, const uint8_t *data, int size) {
+        if (size < 12) {
+            LOG_WARN("INPUT_TERMINAL too short: %d", size);
+            return false;
         }
-        return {}; // empty
+        terminal.bTerminalID = data[3];
+        terminal.wTerminalType = TO_WORD(data+4);
+        terminal.bAssocTerminal = data[6];
+        terminal.bNrChannels = data[7];
+        terminal.wChannelConfig = TO_WORD(data+8);
+        terminal.iChannelNames = data[10];
+        terminal.iTerminal = data[11];
+        LOG_DEBUG("\t got INPUT_TERMINAL %d: type=0x%x", terminal.bTerminalID, terminal.wTerminalType);
+        return true;
     }
 
-    uac_topology_entity::uac_topology_entity(std::shared_ptr<uac_unit> unit) : unit(std::move(unit)) {}
-
-    uac_topology_entity::uac_topology_entity(std::shared_ptr<uac_input_terminal> inTerminal) : inTerminal(std::move(inTerminal)) {}
-
-    uac_topology_entity::uac_topology_entity(std::shared_ptr<uac_output_terminal> outTerminal) : outTerminal(std::move(outTerminal)) {}
-
-    uac_topology_entity::~uac_topology_entity() {
-        for (auto &&i : sources) {
-            delete i;
+    bool parse_output_terminal(uac_output_terminal &terminal, const uint8_t *data, int size) {
+        if (size < 9) {
+            LOG_WARN("OUTPUT_TERMINAL too short: %d", size);
+            return false;
         }
+        terminal.bTerminalID = data[3];
+        terminal.wTerminalType = TO_WORD(data+4);
+        terminal.bAssocTerminal = data[6];
+        terminal.bSourceID = data[7];
+        terminal.iTerminal = data[8];
+        LOG_DEBUG("\t got OUTPUT_TERMINAL %d: type=0x%x", terminal.bTerminalID, terminal.wTerminalType);
+        return true;
     }
 
-    std::vector<int> uac_topology_entity::source_ids() const {
-        auto ids = std::vector<int>();
-        if (outTerminal != nullptr) {
-            ids.push_back(outTerminal->bSourceID);
-        } else if (unit != nullptr) {
-            if (unit->unitType == UAC_AC_FEATURE_UNIT) {
-                uac_feature_unit *ftunit = static_cast<uac_feature_unit*>(unit.get());
-                ids.push_back(ftunit->bSourceId);
-            }
+    // copies bNrInPins source ids which follow the byte at pins, trailing is the minimum of bytes after them
+    static bool parse_source_ids(uac_unit_desc &unit, uac_arena &arena, const uint8_t *data, int size, int pins, int trailing) {
+        if (size <= pins) {
+            return false;
         }
-        return ids;
-    }
-
-    uac_topology_entity* uac_topology_entity::link_source(std::shared_ptr<uac_unit> srcUnit) {
-        auto entity = new uac_topology_entity(std::move(srcUnit));
-        entity->sink = this;
-        sources.push_back(entity);
-        return entity;
-    }
-
-    uac_topology_entity* uac_topology_entity::link_source(std::shared_ptr<uac_input_terminal> terminal) {
-        auto entity = new uac_topology_entity(std::move(terminal));
-        entity->sink = this;
-        sources.push_back(entity);
-        return entity;
-    }
-
-    void parse_ac_header(uac_audiocontrol& ac, const uint8_t *data, int size) {
-        ac.bcdADC = TO_WORD(data+3);
-        ac.wTotalLength = TO_WORD(data+5);
-        uint8_t bInCollection = data[7];
-        for (size_t i = 0; i < bInCollection; ++i) {
-            ac.streams.emplace_back(data[8+i]);
-            LOG_DEBUG("\t got Audio Streaming interface at: %d", ac.streams.back().bInterfaceNr);
+        const int bNrInPins = data[pins];
+        if (size < pins + 1 + bNrInPins + trailing) {
+            return false;
         }
+        unit.sourceIds = arena.copy_array(data + pins + 1, bNrInPins);
+        return true;
     }
 
-    std::shared_ptr<uac_input_terminal> parse_input_terminal(const uint8_t *data, int size) {
-        auto terminal = std::make_shared<uac_input_terminal>();
-        terminal->bTerminalID = data[3];
-        terminal->wTerminalType = TO_WORD(data+4);
-        terminal->bAssocTerminal = data[6];
-        terminal->bNrChannels = data[7];
-        terminal->wChannelConfig = TO_WORD(data+8);
-        terminal->iChannelNames = data[10];
-        terminal->iTerminal = data[11];
-        LOG_DEBUG("\t got INPUT_TERMINAL %d: type=0x%x", terminal->bTerminalID, terminal->wTerminalType);
-        return terminal;
+    bool parse_mixer_unit(uac_unit_desc &unit, uac_arena &arena, const uint8_t *data, int size) {
+        // bNrChannels, wChannelConfig, iChannelNames and iMixer at least
+        if (!parse_source_ids(unit, arena, data, size, 4, 5)) {
+            LOG_WARN("MIXER_UNIT too short: %d", size);
+            return false;
+        }
+        unit.unitType = (uac_ac_descriptor_subtype) data[2];
+        unit.bUnitID = data[3];
+        LOG_DEBUG("\t got MIXER_UNIT %d: %zu sources", unit.bUnitID, unit.sourceIds.size());
+        return true;
     }
 
-    std::shared_ptr<uac_output_terminal> parse_output_terminal(const uint8_t *data, int size) {
-        auto terminal = std::make_shared<uac_output_terminal>();
-        terminal->bTerminalID = data[3];
-        terminal->wTerminalType = TO_WORD(data+4);
-        terminal->bAssocTerminal = data[6];
-        terminal->bSourceID = data[7];
-        terminal->iTerminal = data[8];
-        LOG_DEBUG("\t got OUTPUT_TERMINAL %d: type=0x%x", terminal->bTerminalID, terminal->wTerminalType);
-        return terminal;
+    bool parse_selector_unit(uac_unit_desc &unit, uac_arena &arena, const uint8_t *data, int size) {
+        // iSelector
+        if (!parse_source_ids(unit, arena, data, size, 4, 1)) {
+            LOG_WARN("SELECTOR_UNIT too short: %d", size);
+            return false;
+        }
+        unit.unitType = (uac_ac_descriptor_subtype) data[2];
+        unit.bUnitID = data[3];
+        LOG_DEBUG("\t got SELECTOR_UNIT %d: %zu sources", unit.bUnitID, unit.sourceIds.size());
+        return true;
     }
 
-    std::shared_ptr<uac_mixer_unit> parse_mixer_unit(const uint8_t *data, int size) {
-        auto unit = std::make_shared<uac_mixer_unit>();
-        unit->unitType = (uac_ac_descriptor_subtype) data[2];
-        unit->bUnitID = data[3];
-        return unit;
+    bool parse_processing_unit(uac_unit_desc &unit, uac_arena &arena, const uint8_t *data, int size) {
+        if (size < 7) {
+            LOG_WARN("PROCESSING_UNIT too short: %d", size);
+            return false;
+        }
+        unit.unitType = (uac_ac_descriptor_subtype) data[2];
+        unit.bUnitID = data[3];
+        unit.wProcessType = TO_WORD(data + 4);
+        // bNrChannels, wChannelConfig, iChannelNames and bControlSize at least
+        if (!parse_source_ids(unit, arena, data, size, 6, 5)) {
+            LOG_WARN("PROCESSING_UNIT too short: %d", size);
+            return false;
+        }
+        LOG_DEBUG("\t got %s %d: type=0x%x, %zu sources", unit.unitType == UAC_AC_EXTENSION_UNIT ? "EXTENSION_UNIT" : "PROCESSING_UNIT",
+                  unit.bUnitID, unit.wProcessType, unit.sourceIds.size());
+        return true;
     }
 
-    std::shared_ptr<uac_feature_unit> parse_feature_unit(const uint8_t *data, int size) {
-        auto unit = std::make_unique<uac_feature_unit>();
-        unit->unitType = (uac_ac_descriptor_subtype) data[2];
-        unit->bUnitID = data[3];
-        unit->bSourceId = data[4];
-        unit->bControlSize = data[5];
-        LOG_DEBUG("\t got FEATURE_UNIT %d: bSourceId=0x%x", unit->bUnitID, unit->bSourceId);
-        return unit;
+    bool parse_feature_unit(uac_unit_desc &unit, uac_arena &arena, const uint8_t *data, int size) {
+        if (size < 6) {
+            LOG_WARN("FEATURE_UNIT too short: %d", size);
+            return false;
+        }
+        unit.unitType = (uac_ac_descriptor_subtype) data[2];
+        unit.bUnitID = data[3];
+        unit.sourceIds = arena.copy_array(data + 4, 1);
+        unit.bControlSize = data[5];
+        if (unit.bControlSize > 0) {
+            // bmaControls up to iFeature, the last byte
+            const int controls = (size - 7) / unit.bControlSize * unit.bControlSize;
+            if (controls > 0) {
+                unit.bmaControls = arena.copy_array(data + 6, controls);
+            }
+        }
+        LOG_DEBUG("\t got FEATURE_UNIT %d: bSourceId=0x%x", unit.bUnitID, data[4]);
+        return true;
     }
 
-    uac_format_type_1* parse_as_format_type_1_3(const uint8_t *data, int size) {
+    uac_format_type_1* parse_as_format_type_1_3(uac_arena &arena, const uint8_t *data, int size) {
+        if (size < 8) {
+            return nullptr;
+        }
         uint8_t bSamFreqType = data[7];
-        uac_format_type_1 *desc = (uac_format_type_1*) malloc(sizeof(uac_format_type_1) + sizeof(uint32_t [bSamFreqType]));
+        if (size < 8 + 3 * (bSamFreqType == 0 ? 2 : bSamFreqType)) {
+            LOG_WARN("FORMAT_TYPE too short for %d sampling frequencies: %d", bSamFreqType, size);
+            return nullptr;
+        }
+        // tSamFreq[0] always exists, it is 0 for a continuous range
+        const size_t freqs = bSamFreqType > 0 ? bSamFreqType : 1;
+        auto desc = static_cast<uac_format_type_1*>(arena.allocate(sizeof(uac_format_type_1) + sizeof(uint32_t) * freqs, alignof(uac_format_type_1)));
         desc->bFormatType = (uac_format_type) data[3];
         desc->bNrChannels = data[4];
         desc->bSubframeSize = data[5];
         desc->bBitResolution = data[6];
         desc->bSamFreqType = bSamFreqType;
+        desc->tSamFreq[0] = 0;
         if (desc->bSamFreqType == 0) {
             desc->tLowerSamFreq = TO_DWORD24(data + 8);
             desc->tUpperSamFreq = TO_DWORD24(data + 11);
@@ -329,17 +483,20 @@ namespace uac {
         generalDesc.wFormatTag = (uac_audio_data_format_type) TO_WORD(data+5);
     }
 
-    std::unique_ptr<uac_format_type_desc> parse_as_format_type(const uint8_t *data, int size) {
-        std::unique_ptr<uac_format_type_desc> format;
+    uac_format_type_desc* parse_as_format_type(uac_arena &arena, const uint8_t *data, int size) {
+        if (size < 4) {
+            return nullptr;
+        }
+        uac_format_type_desc *format;
         uint8_t bFormatType = data[3];
         switch (bFormatType) {
         case UAC_FORMAT_TYPE_I:
         case UAC_FORMAT_TYPE_III:
-            format = std::unique_ptr<uac_format_type_desc>(parse_as_format_type_1_3(data, size));
+            format = parse_as_format_type_1_3(arena, data, size);
             break;
         
         default:
-            format = std::unique_ptr<uac_format_type_desc>((uac_format_type_desc*)malloc(sizeof(uac_format_type_desc)));
+            format = &arena.make_array<uac_format_type_desc>(1)[0];
             format->bFormatType = static_cast<uac_format_type>(bFormatType);
             break;
         }
@@ -350,22 +507,32 @@ namespace uac {
         int remaining = size;
         while (remaining > 3) {
             int length = data[0];
-            remaining -= length;
-            if (data[2] == EP_GENERAL) {
+            if (length < 3 || length > remaining) {
+                break;
+            }
+            if (data[2] == EP_GENERAL && length >= 7) {
                 desc.bmAttributes = data[3];
                 desc.bLockDelayUnits = data[4];
                 desc.wLockDelay = TO_WORD(data + 5);
             }
+            remaining -= length;
+            data += length;
         }
-        
     }
 
-    void parse_audiostreaming_intf(uac_stream_if_impl &stream_if, const libusb_interface_descriptor *altsettings, int num_altsetting) {
+    void parse_audiostreaming_intf(uac_arena &arena, uac_stream_if_impl &stream_if, const libusb_interface_descriptor *altsettings, int num_altsetting) {
+        if (num_altsetting < 2) {
+            return;
+        }
+        // rejected altsettings are overwritten by the next one, the array is only cut to size
+        auto parsed = arena.make_array<uac_altsetting>(num_altsetting - 1);
+        size_t count = 0;
         // skip altsetting 0, because it is non-configurable
         for (size_t i = 1; i < num_altsetting; ++i) {
             auto ifdesc = &altsettings[i];
             LOG_DEBUG("parsing altsetting=%d descriptor...", ifdesc->bAlternateSetting);
-            auto& altsetting = stream_if.altsettings.emplace_back();
+            auto& altsetting = parsed[count];
+            altsetting = uac_altsetting{};
             auto data = ifdesc->extra;
             int remaining = ifdesc->extra_length;
 
@@ -376,16 +543,22 @@ namespace uac {
             while (remaining >= 3) {
                 int descSize = data[0];
                 auto subtype = data[2];
+                if (remaining < descSize || descSize < 3) {
+                    LOG_WARN("Bad descriptor size, exceeds remaining bytes %d < %d", remaining, descSize);
+                    break;
+                }
                 switch (subtype) {
                 case UAC_AS_GENERAL:
                     LOG_DEBUG("got AS_GENERAL descriptor");
-                    parse_as_general(altsetting.general, data, descSize);
-                    hasGeneralDescriptor = true;
+                    if (descSize >= 7) {
+                        parse_as_general(altsetting.general, data, descSize);
+                        hasGeneralDescriptor = true;
+                    }
                     break;
                 case UAC_AS_FORMAT_TYPE:
                     LOG_DEBUG("got AS_FORMAT_TYPE descriptor");
-                    altsetting.formatTypeDesc = parse_as_format_type(data, descSize);
-                    hasFormatDescriptor = true;
+                    altsetting.formatTypeDesc = parse_as_format_type(arena, data, descSize);
+                    hasFormatDescriptor = altsetting.formatTypeDesc != nullptr;
                     break;
                 case UAC_AS_FORMAT_SPECIFIC:
                     LOG_DEBUG("got AS_FORMAT_SPECIFIC descriptor");
@@ -398,27 +571,64 @@ namespace uac {
             }
 
             if (!hasGeneralDescriptor || !hasFormatDescriptor || ifdesc->bNumEndpoints == 0) {
-                stream_if.altsettings.pop_back();
                 continue;
             }
             
-            if (ifdesc->bNumEndpoints != 1) {
-                stream_if.altsettings.pop_back();
-                LOG_ERROR("Invalid number of endpoints in this interface(%d): %d", i, ifdesc->bNumEndpoints);
+            const libusb_endpoint_descriptor *dataEp = nullptr;
+            const libusb_endpoint_descriptor *syncEp = nullptr;
+            if (!find_stream_endpoints(ifdesc, &dataEp, &syncEp)) {
+                LOG_WARN("Invalid number of endpoints in this interface(%zu): %d", i, ifdesc->bNumEndpoints);
             } else {
-                LOG_DEBUG("altsetting endpointAddress=%x, wMaxPacketSize=%d", ifdesc->endpoint->bEndpointAddress, ifdesc->endpoint->wMaxPacketSize);
+                LOG_DEBUG("altsetting endpointAddress=%x, wMaxPacketSize=%d", dataEp->bEndpointAddress, dataEp->wMaxPacketSize);
                 auto& epDesc = altsetting.endpoint;
-                epDesc.bEndpointAddress = ifdesc->endpoint->bEndpointAddress;
-                epDesc.wMaxPacketSize = ifdesc->endpoint->wMaxPacketSize;
-                if ((ifdesc->endpoint->bmAttributes & LIBUSB_TRANSFER_TYPE_MASK) == LIBUSB_TRANSFER_TYPE_ISOCHRONOUS) {
-                    parse_iso_ep(epDesc.iso_desc, ifdesc->endpoint->extra, ifdesc->endpoint->extra_length);
+                parse_endpoint(epDesc, dataEp);
+                if (syncEp != nullptr) {
+                    LOG_DEBUG("altsetting sync endpointAddress=%x, bRefresh=%d", syncEp->bEndpointAddress, syncEp->bRefresh);
+                    parse_endpoint(altsetting.syncEndpoint, syncEp);
+                }
+                if ((dataEp->bmAttributes & LIBUSB_TRANSFER_TYPE_MASK) == LIBUSB_TRANSFER_TYPE_ISOCHRONOUS) {
+                    parse_iso_ep(epDesc.iso_desc, dataEp->extra, dataEp->extra_length);
+                    ++count;
                 } else {
                     LOG_DEBUG("Unsupported transfer type.");
-                    stream_if.altsettings.pop_back();
                 }
             }
         }
-        
+        stream_if.altsettings = {parsed.data(), count};
+        stream_if.index_capabilities(arena);
+    }
+
+    static bool is_feedback_endpoint(const libusb_endpoint_descriptor *ep) {
+        return ((ep->bmAttributes & LIBUSB_ISO_USAGE_TYPE_MASK) >> 4) == LIBUSB_ISO_USAGE_TYPE_FEEDBACK;
+    }
+
+    bool find_stream_endpoints(const libusb_interface_descriptor *ifdesc, const libusb_endpoint_descriptor **dataEp, const libusb_endpoint_descriptor **syncEp) {
+        if (ifdesc->bNumEndpoints == 1) {
+            *dataEp = ifdesc->endpoint;
+            *syncEp = nullptr;
+            return true;
+        } else if (ifdesc->bNumEndpoints != 2) {
+            return false;
+        }
+        // UAC1 links the sync endpoint through bSynchAddress of the data endpoint, USB 2.0 also marks it as a feedback endpoint
+        auto data = &ifdesc->endpoint[0];
+        auto sync = &ifdesc->endpoint[1];
+        if (sync->bSynchAddress == data->bEndpointAddress || is_feedback_endpoint(data)) {
+            std::swap(data, sync);
+        }
+        if (data->bSynchAddress != sync->bEndpointAddress && !is_feedback_endpoint(sync)) {
+            return false;
+        }
+        *dataEp = data;
+        *syncEp = sync;
+        return true;
+    }
+
+    void parse_endpoint(uac_endpoint_desc &desc, const libusb_endpoint_descriptor *ep) {
+        desc.bEndpointAddress = ep->bEndpointAddress;
+        desc.wMaxPacketSize = ep->wMaxPacketSize;
+        desc.bInterval = ep->bInterval;
+        desc.bRefresh = ep->bRefresh;
     }
 
     static bool matches_terminals(uint16_t terminalType, uac_terminal_type expected) {
@@ -430,82 +640,55 @@ namespace uac {
         }
     }
 
-    uac_audio_route_impl::uac_audio_route_impl(std::shared_ptr<uac_topology_entity> entry) : entry(entry) {
-        LOG_DEBUG("construct uac_audio_route_impl %p", this);
-    }
-    
-    uac_topology_entity* uac_audio_route_impl::findInputTerminalByType(uac_topology_entity *entity, uac_terminal_type terminalType) {
-        if (entity->inTerminal != nullptr && matches_terminals(entity->inTerminal->wTerminalType, terminalType)) {
-            return entity;
-        } else {
-            for (auto &&e : entity->sources) {
-                auto other = findInputTerminalByType(e, terminalType);
-                if (other != nullptr) {
-                    return other;
-                }
-            }
-            return nullptr;
-        }
-    }
+    uac_audio_route_impl::uac_audio_route_impl(const uac_audiocontrol *audiocontrol, uac_span<const uac_topology_entity> entities) :
+        audiocontrol(audiocontrol), entities(entities) {}
 
-    bool uac_audio_route_impl::contains_terminal_out(uac_terminal_type terminalType) const {
-        return matches_terminals(entry->outTerminal->wTerminalType, terminalType);
+    const uac_output_terminal& uac_audio_route_impl::output_terminal() const {
+        return audiocontrol->outputTerminals[entities[0].index];
     }
 
-    bool uac_audio_route_impl::contains_terminal_in(uac_terminal_type terminalType) const {
-        return findInputTerminalByType(entry.get(), terminalType) != nullptr;
+    const uac_unit_desc* uac_audio_route_impl::source_unit() const {
+        const auto& entry = entities[0];
+        if (entry.numSources == 0 || entities[entry.firstSource].kind != uac_topology_entity::UNIT) {
+            return nullptr;
+        }
+        return &audiocontrol->units[entities[entry.firstSource].index];
     }
 
-    bool uac_audio_route_impl::contains_terminal(uac_terminal_type terminalType) const {
-        if (matches_terminals(entry->outTerminal->wTerminalType, terminalType)) {
+    bool uac_audio_route_impl::contains_terminal_id(uint8_t terminalId) const {
+        if (output_terminal().bTerminalID == terminalId) {
             return true;
-        } else {
-            return findInputTerminalByType(entry.get(), terminalType) != nullptr;
         }
+        for (auto&& entity : entities) {
+            if (entity.kind == uac_topology_entity::INPUT_TERMINAL && audiocontrol->inputTerminals[entity.index].bTerminalID == terminalId) {
+                return true;
+            }
+        }
+        return false;
     }
 
-    bool uac_altsetting::supportsSampleRate(uint32_t sampleRate) const {
-        bool result = false;
-        const uac_format_type_1 *format1;
-        switch (formatTypeDesc->bFormatType) {
-            case UAC_FORMAT_TYPE_I:
-            case UAC_FORMAT_TYPE_III:
-                format1 = getFormatType1();
-                if (format1->bSamFreqType == 0) {
-                    result = format1->tLowerSamFreq <= sampleRate &&
-                    sampleRate <= format1->tUpperSamFreq;
-                } else {
-                    for (int i = 0; i < format1->bSamFreqType; ++i) {
-                        if (format1->tSamFreq[i] == sampleRate) {
-                            result = true;
-                            break;
-                        }
-                    }
-                }
-                break;
-            default:
-                break;
-        }
-        return result;
+    bool uac_audio_route_impl::contains_terminal_out(uac_terminal_type terminalType) const {
+        return matches_terminals(output_terminal().wTerminalType, terminalType);
     }
 
-    bool uac_altsetting::supportsChannelsCount(uint8_t channelsCount) const {
-        const uac_format_type_1 *format1;
-        switch (formatTypeDesc->bFormatType) {
-            case UAC_FORMAT_TYPE_I:
-            case UAC_FORMAT_TYPE_III:
-                format1 = getFormatType1();
-                return format1->bNrChannels == channelsCount;
-            default:
-                break;
+    bool uac_audio_route_impl::contains_terminal_in(uac_terminal_type terminalType) const {
+        for (auto&& entity : entities) {
+            if (entity.kind == uac_topology_entity::INPUT_TERMINAL
+                && matches_terminals(audiocontrol->inputTerminals[entity.index].wTerminalType, terminalType)) {
+                return true;
+            }
         }
         return false;
     }
 
+    bool uac_audio_route_impl::contains_terminal(uac_terminal_type terminalType) const {
+        return contains_terminal_out(terminalType) || contains_terminal_in(terminalType);
+    }
+
     const uac_format_type_1* uac_altsetting::getFormatType1() const {
         if (formatTypeDesc->bFormatType == UAC_FORMAT_TYPE_I
         || formatTypeDesc->bFormatType == UAC_FORMAT_TYPE_III) {
-            return reinterpret_cast<uac_format_type_1 *>(formatTypeDesc.get());
+            return static_cast<const uac_format_type_1*>(formatTypeDesc);
         } else {
             return nullptr;
         }
@@ -20,6 +20,7 @@
 #include <vector>
 #include "usb_audio.h"
 #include "libuac.h"
+#include "uac_arena.h"
 
 /** Converts an unaligned two-byte little-endian integer into an int16 */
 #define TO_WORD(p) ((uint8_t)(p)[0] | \
@@ -52,46 +53,73 @@
 
 namespace uac {
     
-    struct uac_topology_entity {
-        uac_topology_entity* sink = nullptr;
-        std::vector<uac_topology_entity*> sources;
-
-        // either
-        std::shared_ptr<uac_unit> unit;
-        std::shared_ptr<uac_input_terminal> inTerminal;
-        std::shared_ptr<uac_output_terminal> outTerminal;
-
-        uac_topology_entity(std::shared_ptr<uac_unit> unit);
-        uac_topology_entity(std::shared_ptr<uac_input_terminal> inTerminal);
-        uac_topology_entity(std::shared_ptr<uac_output_terminal> outTerminal);
-        ~uac_topology_entity();
-
-        std::vector<int> source_ids() const;
+    /**
+     * A unit of the audio function. The fields of every unit type share one struct, so the units of a device
+     * sit in one array.
+     */
+    struct uac_unit_desc : uac_unit {
+        uac_span<const uint8_t> sourceIds;  // baSourceID, or bSourceID of a feature unit
+        uint16_t wProcessType;              // processing units, wExtensionCode of extension units
+        uint8_t bControlSize;               // feature units only
+        uac_span<const uint8_t> bmaControls; // feature units only, bControlSize bytes per channel, master first
+    };
 
-        uac_topology_entity* link_source(std::shared_ptr<uac_unit> srcUnit);
-        uac_topology_entity* link_source(std::shared_ptr<uac_input_terminal> terminal);
+    /**
+     * A node of a route. The nodes of a route are stored breadth-first from the output terminal, so the sources
+     * of a node are adjacent and nodes link by their position within the route. An entity reached from several
+     * sinks appears once, linked to the first of them.
+     */
+    struct uac_topology_entity {
+        enum entity_kind : uint8_t {
+            OUTPUT_TERMINAL,
+            INPUT_TERMINAL,
+            UNIT,
+            NONE
+        };
+        static constexpr uint16_t NO_SINK = 0xffff;
+
+        entity_kind kind;
+        uint16_t index;         // into the output terminals, input terminals or units of the audio control
+        uint16_t sink;          // the output terminal has none
+        uint16_t firstSource;
+        uint16_t numSources;
     };
 
+    class uac_audiocontrol;
+
     class uac_audio_route_impl : public uac_audio_route {
         friend class uac_device_impl;
         friend class uac_device_handle_impl;
     public:
-        uac_audio_route_impl(std::shared_ptr<uac_topology_entity> entry);
+        uac_audio_route_impl() = default;
+        uac_audio_route_impl(const uac_audiocontrol *audiocontrol, uac_span<const uac_topology_entity> entities);
 
         bool contains_terminal(uac_terminal_type terminalType) const override;
 
         bool contains_terminal_out(uac_terminal_type terminalType) const;
         bool contains_terminal_in(uac_terminal_type terminalType) const;
+        bool contains_terminal_id(uint8_t terminalId) const;
 
-    private:
-        static uac_topology_entity* findInputTerminalByType(uac_topology_entity *entity, uac_terminal_type terminalType);
+        const uac_output_terminal& output_terminal() const;
+        /**
+         * @return the unit feeding the output terminal, or nullptr if a terminal feeds it directly
+         */
+        const uac_unit_desc* source_unit() const;
+
+        uac_span<const uac_topology_entity> get_entities() const {
+            return entities;
+        }
 
-        std::shared_ptr<uac_topology_entity> entry;
+    private:
+        const uac_audiocontrol *audiocontrol = nullptr;
+        uac_span<const uac_topology_entity> entities;
     };
 
     struct uac_endpoint_desc {
         uint8_t bEndpointAddress;
         uint16_t wMaxPacketSize;
+        uint8_t bInterval;
+        uint8_t bRefresh; // sync endpoints only
         iso_endpoint_desc iso_desc;
     };
 
@@ -99,16 +127,52 @@ namespace uac {
         uint8_t bAlternateSetting;
         uac_as_general general;
         uac_endpoint_desc endpoint;
-        std::unique_ptr<uac_format_type_desc> formatTypeDesc;
+        uac_endpoint_desc syncEndpoint{}; // the explicit feedback endpoint of an asynchronous stream
+        uac_format_type_desc *formatTypeDesc; // allocated in the arena of the audio control
+
+        bool hasSyncEndpoint() const {
+            return syncEndpoint.bEndpointAddress != 0;
+        }
 
         const uac_format_type_1* getFormatType1() const;
-        bool supportsSampleRate(uint32_t sampleRate) const;
-        bool supportsChannelsCount(uint8_t channelsCount) const;
+    };
+
+    /**
+     * The capabilities of an uncompressed altsetting, one row of the capability table of a stream interface.
+     */
+    struct uac_altsetting_caps {
+        const uac_altsetting *altsetting;
+        uac_audio_data_format_type format;
+        uint8_t bNrChannels;
+        uint8_t bSubframeSize;
+        uint8_t bBitResolution;
+        uint16_t wMaxPacketSize;
+        uint32_t minRate;
+        uint32_t maxRate;
+        uac_span<const uint32_t> rates; // discrete rates, empty for a continuous range
+
+        bool supports_rate(uint32_t rate) const;
+        uint32_t closest_rate(uint32_t rate) const;
+    };
+
+    /**
+     * The sorted, distinct values over all altsettings of one wFormatTag.
+     */
+    struct uac_format_caps {
+        uac_audio_data_format_type format;
+        uac_span<const uint8_t> channelCounts;
+        uac_span<const uint32_t> sampleRates;
+        uac_span<const uint8_t> bitResolutions;
     };
 
     class uac_stream_if_impl : public uac_stream_if {
     public:
-        uac_stream_if_impl(uint8_t bInterfaceNr) : bInterfaceNr(bInterfaceNr) {}
+        explicit uac_stream_if_impl(uint8_t bInterfaceNr = 0) : bInterfaceNr(bInterfaceNr) {}
+
+        /**
+         * Builds the capability table from the altsettings, again after the altsettings change.
+         */
+        void index_capabilities(uac_arena &arena);
 
         std::vector<uac_audio_data_format_type> get_audio_formats() const override;
         std::vector<uint8_t> get_channel_counts(uac_audio_data_format_type fmt) const override;
@@ -118,40 +182,116 @@ namespace uac {
         std::unique_ptr<const uac_audio_config_uncompressed> query_config_uncompressed(uac_audio_data_format_type audioDataFormatType,
                                                                          uint8_t numChannels,
                                                                          uint32_t sampleRate) const override;
+        std::vector<uac_audio_config_uncompressed> rank_configs(const uac_config_request& request) const override;
+        std::unique_ptr<const uac_audio_config_uncompressed> negotiate_config(const uac_config_request& request) const override;
 
         uint8_t bInterfaceNr;
-        std::vector<uac_altsetting> altsettings;
+        uac_span<uac_altsetting> altsettings;
+
+    private:
+        struct candidate {
+            const uac_altsetting_caps *caps;
+            uint32_t rate;
+        };
+
+        const uac_format_caps* find_format(uac_audio_data_format_type fmt) const;
+        std::vector<candidate> find_candidates(const uac_config_request& request) const;
+
+        uac_span<const uac_altsetting_caps> altsettingCaps;
+        uac_span<const uac_format_caps> formatCaps;
     };
 
+    /**
+     * The parsed model of an audio function. Terminals, units, streams, altsettings, format descriptors and routes
+     * are contiguous arrays in one arena owned by the model, so the model is released at once and must not move.
+     */
     class uac_audiocontrol : public uac_ac_header {
     public:
-        uac_audiocontrol(uint8_t bInterfaceNr, uint8_t iInterface) : bInterfaceNumber(bInterfaceNr), iInterface(iInterface) {}
+        uac_audiocontrol(uint8_t bInterfaceNr, uint8_t iInterface, size_t arenaCapacity = 1024) :
+            arena(arenaCapacity), bInterfaceNumber(bInterfaceNr), iInterface(iInterface) {}
+
+        uac_audiocontrol(const uac_audiocontrol&) = delete;
+        uac_audiocontrol& operator=(const uac_audiocontrol&) = delete;
+
         void configure_audio_function();
-        const std::vector<uac_audio_route_impl>& audio_routes() {
+        uac_span<const uac_audio_route_impl> audio_routes() const {
             return audioFunctionTopology;
         }
 
-        std::vector<uac_stream_if_impl> streams;
+        uac_arena arena;
+
+        uac_span<uac_stream_if_impl> streams;
 
-        std::vector<std::shared_ptr<uac_input_terminal>> inputTerminals;
-        std::vector<std::shared_ptr<uac_output_terminal>> outputTerminals;
-        std::vector<std::shared_ptr<uac_unit>> units;
+        uac_span<uac_input_terminal> inputTerminals;
+        uac_span<uac_output_terminal> outputTerminals;
+        uac_span<uac_unit_desc> units;
 
         const uint8_t bInterfaceNumber;
         const uint8_t iInterface;
     private:
-        uac_audio_route_impl build_audio_topology(std::shared_ptr<uac_output_terminal> outputTerminal);
-        std::shared_ptr<uac_unit> find_unit(int id);
-        std::shared_ptr<uac_input_terminal> find_input_terminal(int id);
+        void build_audio_topology(std::vector<uac_topology_entity> &entities, size_t outputTerminal) const;
+        void index_entities();
+
+        struct entity_slot {
+            uac_topology_entity::entity_kind kind = uac_topology_entity::NONE;
+            uint16_t index = 0;
+        };
+        // terminals and units by bTerminalID/bUnitID, which share one id space
+        entity_slot entityIds[256];
+
+        uac_span<uac_topology_entity> entities;
+        uac_span<uac_audio_route_impl> audioFunctionTopology;
+    };
 
-        std::vector<uac_audio_route_impl> audioFunctionTopology;
+    /**
+     * The outcome of scanning a device. Scanning never throws, exceptions are raised at the public API only.
+     */
+    enum uac_parse_error {
+        UAC_PARSE_OK = 0,
+        UAC_PARSE_NO_CONFIG,    // the configuration descriptor is not available
+        UAC_PARSE_NOT_AUDIO,    // no AudioControl interface ahead of the AudioStreaming ones
+        UAC_PARSE_MALFORMED,    // the AudioControl interface descriptors can't be parsed
     };
 
-    std::unique_ptr<uac_audiocontrol> uac_scan_device(libusb_device *udev);
+    const char* uac_parse_error_name(uac_parse_error error);
+
+    // the configuration descriptor of a device, the active one or else the first, null if neither is available
+    class uac_config_desc {
+        libusb_config_descriptor *config = nullptr;
+        libusb_error errval = LIBUSB_SUCCESS;
+    public:
+        explicit uac_config_desc(libusb_device *udev);
+        ~uac_config_desc();
+
+        uac_config_desc(const uac_config_desc&) = delete;
+        uac_config_desc& operator=(const uac_config_desc&) = delete;
+
+        libusb_error error() const {
+            return errval;
+        }
+        const libusb_config_descriptor* get() const {
+            return config;
+        }
+        const libusb_config_descriptor* operator->() const {
+            return config;
+        }
+    };
+
+    /**
+     * Tells from the device and configuration descriptors alone, without parsing the class-specific ones,
+     * whether a device may be an audio device. Never throws.
+     */
+    bool uac_is_audio_device(libusb_device *udev);
+    bool uac_has_audiocontrol(const libusb_config_descriptor *configDesc);
+
+    uac_parse_error uac_scan_device(libusb_device *udev, std::unique_ptr<uac_audiocontrol> &audiocontrol);
+    uac_parse_error uac_scan_config(const libusb_config_descriptor *configDesc, std::unique_ptr<uac_audiocontrol> &audiocontrol);
 
     void parse_ac_header(uac_audiocontrol& ac, const uint8_t *data, int size);
-    std::shared_ptr<uac_input_terminal> parse_input_terminal(const uint8_t *data, int size);
-    std::shared_ptr<uac_output_terminal> parse_output_terminal(const uint8_t *data, int size);
-    std::shared_ptr<uac_mixer_unit> parse_mixer_unit(const uint8_t *data, int size);
-    std::shared_ptr<uac_feature_unit> parse_feature_unit(const uint8_t *data, int size);
+    bool parse_input_terminal(uac_input_terminal &terminal, const uint8_t *data, int size);
+    bool parse_output_terminal(uac_output_terminal &terminal, const uint8_t *data, int size);
+    bool parse_mixer_unit(uac_unit_desc &unit, uac_arena &arena, const uint8_t *data, int size);
+    bool parse_selector_unit(uac_unit_desc &unit, uac_arena &arena, const uint8_t *data, int size);
+    bool parse_feature_unit(uac_unit_desc &unit, uac_arena &arena, const uint8_t *data, int size);
+    bool parse_processing_unit(uac_unit_desc &unit, uac_arena &arena, const uint8_t *data, int size);
 }
@@ -0,0 +1,297 @@
+// Copyright 2023 Jakub Księżniak
+// 
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// 
+//     http://www.apache.org/licenses/LICENSE-2.0
+// 
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "uac_resampler.h"
+
+#include <algorithm>
+#include <cmath>
+#include <numeric>
+#include <stdexcept>
+#include "uac_convert.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define UAC_RESAMPLER_X86
+#include <immintrin.h>
+#endif
+#if defined(__ARM_NEON)
+#define UAC_RESAMPLER_NEON
+#include <arm_neon.h>
+#endif
+
+namespace uac {
+
+    namespace {
+        struct filter_spec {
+            uint taps;
+            double beta;    // Kaiser window shape
+            double rolloff; // cutoff relative to the lower Nyquist frequency
+        };
+
+        filter_spec get_filter_spec(uac_resampler_quality quality) {
+            switch (quality) {
+                case UAC_RESAMPLER_QUALITY_LOW:
+                    return {8, 5.0, 0.85};
+                case UAC_RESAMPLER_QUALITY_HIGH:
+                    return {32, 9.0, 0.94};
+                case UAC_RESAMPLER_QUALITY_MEDIUM:
+                default:
+                    return {16, 7.0, 0.9};
+            }
+        }
+
+        double bessel_i0(double x) {
+            double sum = 1.0, term = 1.0;
+            for (int k = 1; k < 32; ++k) {
+                term *= (x / (2 * k)) * (x / (2 * k));
+                sum += term;
+            }
+            return sum;
+        }
+
+        // numRows rows of spec.taps for the offsets row / numPhases,
+        // tap k weighs the input frame k - (taps / 2 - 1) away from the output frame
+        std::vector<float> design_filter(uint32_t numPhases, uint32_t numRows, const filter_spec& spec, double cutoff) {
+            const uint numTaps = spec.taps;
+            const double halfTaps = numTaps / 2.0;
+            const double norm = bessel_i0(spec.beta);
+            std::vector<float> coefficients(static_cast<size_t>(numRows) * numTaps);
+            for (uint32_t p = 0; p < numRows; ++p) {
+                const double frac = static_cast<double>(p) / numPhases;
+                float *row = coefficients.data() + static_cast<size_t>(p) * numTaps;
+                double sum = 0;
+                for (uint k = 0; k < numTaps; ++k) {
+                    const double x = frac + (numTaps / 2 - 1) - k;
+                    const double r = x / halfTaps;
+                    const double window = std::abs(r) < 1 ? bessel_i0(spec.beta * std::sqrt(1 - r * r)) / norm : 0;
+                    const double arg = M_PI * cutoff * x;
+                    const double sinc = std::abs(arg) < 1e-9 ? 1 : std::sin(arg) / arg;
+                    row[k] = static_cast<float>(cutoff * sinc * window);
+                    sum += row[k];
+                }
+                // unity gain at DC for every phase
+                for (uint k = 0; k < numTaps; ++k) {
+                    row[k] = static_cast<float>(row[k] / sum);
+                }
+            }
+            return coefficients;
+        }
+
+        float dot_scalar(const float *a, const float *b, size_t n) {
+            float sum = 0;
+            for (size_t i = 0; i < n; ++i) {
+                sum += a[i] * b[i];
+            }
+            return sum;
+        }
+
+#ifdef UAC_RESAMPLER_X86
+        __attribute__((target("ssse3")))
+        float dot_ssse3(const float *a, const float *b, size_t n) {
+            __m128 acc = _mm_setzero_ps();
+            size_t i = 0;
+            for (; i + 4 <= n; i += 4) {
+                acc = _mm_add_ps(acc, _mm_mul_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i)));
+            }
+            acc = _mm_add_ps(acc, _mm_movehl_ps(acc, acc));
+            acc = _mm_add_ss(acc, _mm_shuffle_ps(acc, acc, 1));
+            return _mm_cvtss_f32(acc) + dot_scalar(a + i, b + i, n - i);
+        }
+
+        __attribute__((target("avx2")))
+        float dot_avx2(const float *a, const float *b, size_t n) {
+            __m256 acc = _mm256_setzero_ps();
+            size_t i = 0;
+            for (; i + 8 <= n; i += 8) {
+                acc = _mm256_add_ps(acc, _mm256_mul_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i)));
+            }
+            __m128 sum = _mm_add_ps(_mm256_castps256_ps128(acc), _mm256_extractf128_ps(acc, 1));
+            sum = _mm_add_ps(sum, _mm_movehl_ps(sum, sum));
+            sum = _mm_add_ss(sum, _mm_shuffle_ps(sum, sum, 1));
+            return _mm_cvtss_f32(sum) + dot_scalar(a + i, b + i, n - i);
+        }
+#endif
+
+#ifdef UAC_RESAMPLER_NEON
+        float dot_neon(const float *a, const float *b, size_t n) {
+            float32x4_t acc = vdupq_n_f32(0);
+            size_t i = 0;
+            for (; i + 4 <= n; i += 4) {
+                acc = vmlaq_f32(acc, vld1q_f32(a + i), vld1q_f32(b + i));
+            }
+            float32x2_t sum = vadd_f32(vget_low_f32(acc), vget_high_f32(acc));
+            return vget_lane_f32(vpadd_f32(sum, sum), 0) + dot_scalar(a + i, b + i, n - i);
+        }
+#endif
+
+        auto find_dot(uac_simd_level level) -> float (*)(const float*, const float*, size_t) {
+            switch (level) {
+#ifdef UAC_RESAMPLER_X86
+                case UAC_SIMD_AVX2:
+                    return dot_avx2;
+                case UAC_SIMD_SSSE3:
+                    return dot_ssse3;
+#endif
+#ifdef UAC_RESAMPLER_NEON
+                case UAC_SIMD_NEON:
+                    return dot_neon;
+#endif
+                default:
+                    return dot_scalar;
+            }
+        }
+    }
+
+    uac_resampler::uac_resampler(uint32_t inputRate, uint32_t outputRate, uint channels, uac_resampler_quality quality, size_t maxInputFrames) :
+        channels(channels) {
+        if (inputRate == 0 || outputRate == 0 || channels == 0) {
+            throw std::invalid_argument("invalid resampler configuration");
+        }
+        const uint32_t divisor = std::gcd(inputRate, outputRate);
+        upFactor = outputRate / divisor;
+        downFactor = inputRate / divisor;
+        numPhases = std::min(upFactor, MAX_PHASES);
+
+        const filter_spec spec = get_filter_spec(quality);
+        numTaps = spec.taps;
+        // when decimating, the cutoff follows the output Nyquist frequency
+        const double cutoff = spec.rolloff * std::min(1.0, static_cast<double>(outputRate) / inputRate);
+        coefficients = design_filter(numPhases, numPhases, spec, cutoff);
+        dot = find_dot(detect_simd_level());
+
+        // the filter reaches numTaps / 2 - 1 frames before the first input
+        workPitch = maxInputFrames + numTaps;
+        work.assign(workPitch * channels, 0.0f);
+        workFrames = numTaps / 2 - 1;
+    }
+
+    size_t uac_resampler::max_output(size_t inputFrames) const {
+        return (inputFrames + numTaps) * upFactor / downFactor + 1;
+    }
+
+    size_t uac_resampler::process(const float *input, size_t inputFrames, float *output) {
+        if (workFrames + inputFrames > workPitch) {
+            throw std::invalid_argument("resampler input too large");
+        }
+        for (uint c = 0; c < channels; ++c) {
+            float *plane = work.data() + c * workPitch + workFrames;
+            for (size_t f = 0; f < inputFrames; ++f) {
+                plane[f] = input[f * channels + c];
+            }
+        }
+        workFrames += inputFrames;
+
+        size_t produced = 0;
+        while (position + numTaps <= workFrames) {
+            const uint32_t row = numPhases == upFactor ? phase : static_cast<uint32_t>(static_cast<uint64_t>(phase) * numPhases / upFactor);
+            const float *h = coefficients.data() + static_cast<size_t>(row) * numTaps;
+            for (uint c = 0; c < channels; ++c) {
+                output[produced * channels + c] = dot(work.data() + c * workPitch + position, h, numTaps);
+            }
+            ++produced;
+            phase += downFactor;
+            position += phase / upFactor;
+            phase %= upFactor;
+        }
+
+        // keep the history, a decimating position may run ahead of the input
+        const size_t consumed = std::min(position, workFrames);
+        if (consumed > 0) {
+            for (uint c = 0; c < channels; ++c) {
+                float *plane = work.data() + c * workPitch;
+                std::copy(plane + consumed, plane + workFrames, plane);
+            }
+            workFrames -= consumed;
+            position -= consumed;
+        }
+        return produced;
+    }
+
+    uac_varispeed::uac_varispeed(uint channels, uac_resampler_quality quality, size_t maxInputFrames) :
+        channels(channels) {
+        if (channels == 0) {
+            throw std::invalid_argument("invalid resampler configuration");
+        }
+        const filter_spec spec = get_filter_spec(quality);
+        numTaps = spec.taps;
+        // one more row, so every offset lies between two rows
+        coefficients = design_filter(PHASES, PHASES + 1, spec, spec.rolloff);
+        dot = find_dot(detect_simd_level());
+
+        workPitch = maxInputFrames + 2 * numTaps;
+        work.assign(workPitch * channels, 0.0f);
+        workFrames = numTaps / 2 - 1;
+        set_ratio(1.0);
+    }
+
+    void uac_varispeed::set_ratio(double ratio) {
+        step = static_cast<uint64_t>(ratio * 4294967296.0);
+    }
+
+    double uac_varispeed::ratio() const {
+        return static_cast<double>(step) / 4294967296.0;
+    }
+
+    size_t uac_varispeed::input_needed(size_t outputFrames) const {
+        if (outputFrames == 0) return 0;
+        const size_t last = static_cast<size_t>((position + (outputFrames - 1) * step) >> 32) + numTaps;
+        return last > workFrames ? last - workFrames : 0;
+    }
+
+    double uac_varispeed::lag() const {
+        return static_cast<double>(workFrames - (numTaps / 2 - 1)) - static_cast<double>(position) / 4294967296.0;
+    }
+
+    size_t uac_varispeed::process(const float *input, size_t inputFrames, float *output, size_t outputFrames) {
+        if (workFrames + inputFrames > workPitch) {
+            throw std::invalid_argument("resampler input too large");
+        }
+        for (uint c = 0; c < channels; ++c) {
+            float *plane = work.data() + c * workPitch + workFrames;
+            for (size_t f = 0; f < inputFrames; ++f) {
+                plane[f] = input[f * channels + c];
+            }
+        }
+        workFrames += inputFrames;
+
+        constexpr int FRACTION_BITS = 32 - PHASE_BITS;
+        size_t produced = 0;
+        while (produced < outputFrames) {
+            const size_t base = static_cast<size_t>(position >> 32);
+            if (base + numTaps > workFrames) break;
+            const uint32_t offset = static_cast<uint32_t>(position);
+            const float *h0 = coefficients.data() + static_cast<size_t>(offset >> FRACTION_BITS) * numTaps;
+            const float *h1 = h0 + numTaps;
+            const float t = static_cast<float>(offset & ((1u << FRACTION_BITS) - 1)) / (1u << FRACTION_BITS);
+            for (uint c = 0; c < channels; ++c) {
+                const float *x = work.data() + c * workPitch + base;
+                const float a = dot(x, h0, numTaps);
+                const float b = dot(x, h1, numTaps);
+                output[produced * channels + c] = a + t * (b - a);
+            }
+            ++produced;
+            position += step;
+        }
+
+        const size_t consumed = std::min(static_cast<size_t>(position >> 32), workFrames);
+        if (consumed > 0) {
+            for (uint c = 0; c < channels; ++c) {
+                float *plane = work.data() + c * workPitch;
+                std::copy(plane + consumed, plane + workFrames, plane);
+            }
+            workFrames -= consumed;
+            position -= static_cast<uint64_t>(consumed) << 32;
+        }
+        return produced;
+    }
+}
@@ -0,0 +1,129 @@
+// Copyright 2023 Jakub Księżniak
+// 
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// 
+//     http://www.apache.org/licenses/LICENSE-2.0
+// 
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include "libuac.h"
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace uac {
+
+    /**
+     * @brief A polyphase sample-rate converter for interleaved float frames.
+     *
+     * The rate ratio is reduced to L/M, every output frame is computed from one of L phases of a Kaiser-windowed
+     * sinc low-pass filter. Input is kept in one plane per channel, so each output sample is a single contiguous
+     * dot product. The first output frame is aligned with the first input frame.
+     */
+    class uac_resampler {
+    public:
+        // ratios with more phases share the nearest of these
+        static constexpr uint32_t MAX_PHASES = 1024;
+
+        /**
+         * @param inputRate
+         * @param outputRate
+         * @param channels
+         * @param quality
+         * @param maxInputFrames the largest input passed to process() at once
+         */
+        uac_resampler(uint32_t inputRate, uint32_t outputRate, uint channels, uac_resampler_quality quality, size_t maxInputFrames);
+
+        uint taps() const {
+            return numTaps;
+        }
+
+        /**
+         * @brief The most frames process() returns for this much input.
+         */
+        size_t max_output(size_t inputFrames) const;
+
+        /**
+         * @brief Resamples input frames, the remaining filter history is kept for the next call.
+         *
+         * @param input interleaved frames
+         * @param inputFrames at most maxInputFrames
+         * @param output interleaved frames, room for max_output(inputFrames)
+         * @return size_t the number of output frames
+         */
+        size_t process(const float *input, size_t inputFrames, float *output);
+
+    private:
+        const uint channels;
+        uint32_t upFactor;   // L
+        uint32_t downFactor; // M
+        uint numTaps;
+        uint32_t numPhases;
+        std::vector<float> coefficients; // numPhases rows of numTaps
+        float (*dot)(const float *a, const float *b, size_t n);
+
+        // planar input history, position and phase of the next output frame
+        std::vector<float> work;
+        size_t workPitch;
+        size_t workFrames;
+        size_t position = 0;
+        uint32_t phase = 0;
+    };
+
+    /**
+     * @brief A resampler with a fine-grained, adjustable ratio close to 1.
+     *
+     * Corrects the drift between two clocks of the same nominal rate. The position of the next output frame
+     * advances in 32.32 fixed point, and its filter is interpolated between the two nearest of PHASES phases.
+     */
+    class uac_varispeed {
+    public:
+        static constexpr int PHASE_BITS = 8;
+        static constexpr uint32_t PHASES = 1u << PHASE_BITS;
+
+        uac_varispeed(uint channels, uac_resampler_quality quality, size_t maxInputFrames);
+
+        /**
+         * @brief Sets the input frames consumed per output frame.
+         */
+        void set_ratio(double ratio);
+        double ratio() const;
+
+        /**
+         * @brief The input frames which process() needs, beyond the buffered ones, for this much output.
+         */
+        size_t input_needed(size_t outputFrames) const;
+
+        /**
+         * @brief How far the next output frame lies behind the end of the input so far, in input frames.
+         */
+        double lag() const;
+
+        /**
+         * @brief Appends the input and resamples up to outputFrames interleaved frames.
+         *
+         * @return size_t the number of output frames
+         */
+        size_t process(const float *input, size_t inputFrames, float *output, size_t outputFrames);
+
+    private:
+        const uint channels;
+        uint numTaps;
+        std::vector<float> coefficients; // PHASES + 1 rows of numTaps
+        float (*dot)(const float *a, const float *b, size_t n);
+
+        std::vector<float> work;
+        size_t workPitch;
+        size_t workFrames;
+        uint64_t position = 0; // 32.32 frames into work
+        uint64_t step = 0;
+    };
+}
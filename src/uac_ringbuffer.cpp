@@ -0,0 +1,73 @@
+// Copyright 2023 Jakub Księżniak
+// 
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// 
+//     http://www.apache.org/licenses/LICENSE-2.0
+// 
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#include "uac_ringbuffer.h"
+
+#include <algorithm>
+#include <cstring>
+
+namespace uac {
+
+    static size_t round_up_pow2(size_t value) {
+        size_t result = 1;
+        while (result < value) result <<= 1;
+        return result;
+    }
+
+    uac_ringbuffer::uac_ringbuffer(size_t capacity) : mask(round_up_pow2(std::max<size_t>(capacity, 1)) - 1), head(0), tail(0) {
+        buffer = std::make_unique<uint8_t[]>(mask + 1);
+    }
+
+    size_t uac_ringbuffer::read_available() const {
+        return head.load(std::memory_order_acquire) - tail.load(std::memory_order_acquire);
+    }
+
+    size_t uac_ringbuffer::write_available() const {
+        return capacity() - read_available();
+    }
+
+    size_t uac_ringbuffer::write(const uint8_t *data, size_t size) {
+        const size_t w = head.load(std::memory_order_relaxed);
+        const size_t r = tail.load(std::memory_order_acquire);
+        size = std::min(size, capacity() - (w - r));
+        if (size == 0) return 0;
+
+        const size_t pos = w & mask;
+        const size_t first = std::min(size, capacity() - pos);
+        memcpy(buffer.get() + pos, data, first);
+        memcpy(buffer.get(), data + first, size - first);
+        head.store(w + size, std::memory_order_release);
+        return size;
+    }
+
+    size_t uac_ringbuffer::read(uint8_t *data, size_t size) {
+        const size_t r = tail.load(std::memory_order_relaxed);
+        const size_t w = head.load(std::memory_order_acquire);
+        size = std::min(size, w - r);
+        if (size == 0) return 0;
+
+        const size_t pos = r & mask;
+        const size_t first = std::min(size, capacity() - pos);
+        memcpy(data, buffer.get() + pos, first);
+        memcpy(data + first, buffer.get(), size - first);
+        tail.store(r + size, std::memory_order_release);
+        return size;
+    }
+
+    void uac_ringbuffer::reset() {
+        head.store(0, std::memory_order_relaxed);
+        tail.store(0, std::memory_order_relaxed);
+    }
+}
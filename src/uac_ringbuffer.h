@@ -0,0 +1,67 @@
+// Copyright 2023 Jakub Księżniak
+// 
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// 
+//     http://www.apache.org/licenses/LICENSE-2.0
+// 
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+namespace uac {
+
+    /**
+     * @brief A lock-free single-producer/single-consumer byte ring buffer.
+     *
+     * The capacity is rounded up to a power of two. One thread may write while another thread reads,
+     * but neither side may be used concurrently from two threads.
+     */
+    class uac_ringbuffer {
+    public:
+        explicit uac_ringbuffer(size_t capacity);
+
+        size_t capacity() const {
+            return mask + 1;
+        }
+
+        size_t read_available() const;
+        size_t write_available() const;
+
+        /**
+         * Copies up to size bytes into the buffer.
+         * @return the number of bytes written
+         */
+        size_t write(const uint8_t *data, size_t size);
+
+        /**
+         * Copies up to size bytes out of the buffer.
+         * @return the number of bytes read
+         */
+        size_t read(uint8_t *data, size_t size);
+
+        /**
+         * Drops all buffered data. Must not race with read() or write().
+         */
+        void reset();
+
+    private:
+        std::unique_ptr<uint8_t[]> buffer;
+        size_t mask;
+
+        // keep producer and consumer positions on separate cache lines
+        alignas(64) std::atomic<size_t> head;
+        alignas(64) std::atomic<size_t> tail;
+    };
+}
@@ -0,0 +1,92 @@
+// Copyright 2023 Jakub Księżniak
+// 
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// 
+//     http://www.apache.org/licenses/LICENSE-2.0
+// 
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#include "uac_stream_tuner.h"
+#include "logging.h"
+
+#include <algorithm>
+
+// stable time required before the queue is made shallower
+#define STABLE_WINDOW_US 2000000
+
+namespace uac {
+
+    uac_stream_tuner::uac_stream_tuner(uint32_t targetLatency, uint32_t packetsPerSecond) :
+        packetsPerSecond(std::max<uint32_t>(packetsPerSecond, 1)),
+        targetPackets(std::max<int>(static_cast<int>(static_cast<uint64_t>(targetLatency) * this->packetsPerSecond / 1000), 1)),
+        initialPackets(std::clamp<int>(targetPackets / 4, 1, MAX_PACKETS)) {
+        numPackets = initialPackets;
+        numTransfers = std::clamp<int>((targetPackets + numPackets - 1) / numPackets, MIN_TRANSFERS, MAX_TRANSFERS);
+        LOG_DEBUG("initial queue: %d transfers x %d packets", numTransfers, numPackets);
+    }
+
+    void uac_stream_tuner::on_completion(int64_t now) {
+        if (lastCompletion < 0) {
+            lastCompletion = now;
+            windowStart = now;
+            return;
+        }
+        int64_t gap = now - lastCompletion;
+        lastCompletion = now;
+        worstGap = std::max(worstGap, gap);
+
+        if (gap * 4 > headroom(numTransfers, numPackets) * 3) {
+            LOG_DEBUG("late completion after %lld us", (long long) gap);
+            grow();
+        } else if (now - windowStart >= STABLE_WINDOW_US) {
+            if (numTransfers * numPackets > targetPackets) {
+                shrink();
+            } else {
+                restart_window();
+            }
+        }
+    }
+
+    void uac_stream_tuner::on_timeout() {
+        grow();
+    }
+
+    void uac_stream_tuner::grow() {
+        if (numTransfers < MAX_TRANSFERS) {
+            ++numTransfers;
+        } else if (numPackets < MAX_PACKETS) {
+            ++numPackets;
+        }
+        LOG_DEBUG("grow queue: %d transfers x %d packets", numTransfers, numPackets);
+        restart_window();
+    }
+
+    void uac_stream_tuner::shrink() {
+        int transfers = numTransfers;
+        int packets = numPackets;
+        if (packets > initialPackets) {
+            --packets;
+        } else if (transfers > MIN_TRANSFERS) {
+            --transfers;
+        }
+        // shrink only if the worst stall seen would still leave plenty of headroom
+        if (worstGap * 2 < headroom(transfers, packets)) {
+            numTransfers = transfers;
+            numPackets = packets;
+            LOG_DEBUG("shrink queue: %d transfers x %d packets", numTransfers, numPackets);
+        }
+        restart_window();
+    }
+
+    void uac_stream_tuner::restart_window() {
+        windowStart = lastCompletion;
+        worstGap = 0;
+    }
+}
@@ -0,0 +1,83 @@
+// Copyright 2023 Jakub Księżniak
+// 
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// 
+//     http://www.apache.org/licenses/LICENSE-2.0
+// 
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#pragma once
+
+#include <cstdint>
+
+namespace uac {
+
+    /**
+     * @brief Adapts the depth of the ISO transfer queue of a running stream.
+     *
+     * The queue holds transfers() transfers of packets() ISO packets each, packetsPerSecond of them per second.
+     * Completions which arrive so late that the queue almost ran dry, and timed out transfers,
+     * make the queue deeper. A queue deeper than the target latency is made shallower again
+     * once the stream stays stable for a while.
+     */
+    class uac_stream_tuner {
+    public:
+        static constexpr int MAX_TRANSFERS = 16;
+        static constexpr int MAX_PACKETS = 16;
+        static constexpr int MIN_TRANSFERS = 2;
+
+        /**
+         * @param targetLatency the preferred queue depth in milliseconds
+         * @param packetsPerSecond the ISO packet rate of the endpoint, 8000 for a high speed endpoint polled every microframe
+         */
+        uac_stream_tuner(uint32_t targetLatency, uint32_t packetsPerSecond);
+
+        int transfers() const {
+            return numTransfers;
+        }
+
+        int packets() const {
+            return numPackets;
+        }
+
+        // the queue depth in milliseconds
+        uint32_t latency() const {
+            return static_cast<uint32_t>(static_cast<uint64_t>(numTransfers) * numPackets * 1000 / packetsPerSecond);
+        }
+
+        /**
+         * Notifies a completed transfer.
+         * @param now a monotonic timestamp in microseconds
+         */
+        void on_completion(int64_t now);
+        void on_timeout();
+
+    private:
+        void grow();
+        void shrink();
+        void restart_window();
+
+        // how long the queue survives a stalled event thread, in microseconds
+        int64_t headroom(int transfers, int packets) const {
+            return static_cast<int64_t>(transfers - 1) * packets * 1000000 / packetsPerSecond;
+        }
+
+        const uint32_t packetsPerSecond;
+        // the target latency in ISO packets
+        const int targetPackets;
+        const int initialPackets;
+        int numTransfers;
+        int numPackets;
+
+        int64_t lastCompletion = -1;
+        int64_t windowStart = -1;
+        int64_t worstGap = 0;
+    };
+}
@@ -15,12 +15,17 @@
 #include "uac_streaming.h"
 
 #include <utility>
+#include <algorithm>
+#include <map>
 #include <set>
+#include <chrono>
 #include "uac_context.h"
+#include "uac_thread.h"
 #include "logging.h"
 #include "uac_exceptions.h"
 
 #define NUM_ISO_TRANSFERS 8
+#define NUM_FEEDBACK_TRANSFERS 2
 
 namespace uac {
 
@@ -28,36 +33,49 @@ namespace uac {
         auto *strmh = static_cast<uac_stream_handle_impl*>(transfer->user_data);
         int errval;
         bool dropTransfer = false;
+        const int64_t now = monotonic_now();
+        auto& counters = strmh->counters;
+        if (transfer->status == LIBUSB_TRANSFER_COMPLETED) {
+            if (counters.lastCompletion >= 0) {
+                counters.completionInterval.record((now - counters.lastCompletion) / 1000);
+            }
+            counters.lastCompletion = now;
+        } else if (transfer->status == LIBUSB_TRANSFER_TIMED_OUT) {
+            uac_stream_counters::add(counters.timeouts, 1);
+        }
+        if (strmh->tuner) {
+            if (transfer->status == LIBUSB_TRANSFER_COMPLETED) {
+                strmh->tuner->on_completion(now / 1000);
+            } else if (transfer->status == LIBUSB_TRANSFER_TIMED_OUT) {
+                strmh->tuner->on_timeout();
+            }
+        }
         switch (transfer->status) {
             case LIBUSB_TRANSFER_COMPLETED:
-                for (int packet_id = 0; packet_id < transfer->num_iso_packets; ++packet_id) {
-                    libusb_iso_packet_descriptor* packet = transfer->iso_packet_desc + packet_id;
-                    //LOG_DEBUG("packet %d actual_len=%u", packet_id, packet->actual_length);
-                    if (packet->actual_length > packet->length) {
-                        LOG_WARN("kernel misbehaviour with returned actual_length (%u>%u)", packet->actual_length, packet->length);
+            case LIBUSB_TRANSFER_TIMED_OUT:
+                // the packets of a timed out capture transfer are lost, deliver them as gaps
+                if (!strmh->playback) {
+                    if (!strmh->collect_packets(transfer)) {
                         strmh->usbTransferError = UAC_ERROR_KERNEL_MALFUNCTION;
                         dropTransfer = true;
                         break;
                     }
-                    if (packet->status == LIBUSB_TRANSFER_COMPLETED && packet->actual_length > 0) {
-                        uint8_t *pktbuf = libusb_get_iso_packet_buffer(transfer, packet_id);
-                        if (strmh->offset_stream > 0) {
-                            uint offset = std::min(strmh->offset_stream, packet->actual_length);
-                            pktbuf += offset;
-                            packet->actual_length -= offset;
-                            strmh->offset_stream -= offset;
-                            LOG_DEBUG("SWAP CHANNELS packet %d actual_len=%d offset=%d", packet_id, packet->actual_length, offset);
-                        }
-                        strmh->cb_func(pktbuf, packet->actual_length);
+                    strmh->update_clock(transfer, now);
+                    if (strmh->deliveryQueue) {
+                        strmh->enqueue_transfer(transfer);
+                    } else {
+                        strmh->deliver_transfer(transfer->buffer, strmh->packets.data(), transfer->num_iso_packets, strmh->clock->last_buffer());
                     }
+                } else if (transfer->status == LIBUSB_TRANSFER_COMPLETED) {
+                    strmh->update_clock(transfer, now);
                 }
-                if (dropTransfer) break;
-                // else, fall through
-            case LIBUSB_TRANSFER_TIMED_OUT:
                 // resubmit transfer
-                errval = strmh->active ? libusb_submit_transfer(transfer) : LIBUSB_ERROR_INTERRUPTED;
+                errval = strmh->active ? strmh->resubmit(transfer) : LIBUSB_ERROR_INTERRUPTED;
                 if (errval != LIBUSB_SUCCESS) {
                     LOG_DEBUG("on time out: submit transfer... %s", libusb_error_name(errval));
+                    if (errval != LIBUSB_ERROR_INTERRUPTED) {
+                        uac_stream_counters::add(counters.resubmitFailures, 1);
+                    }
                     dropTransfer = true;
                 }
                 break;
@@ -71,7 +89,7 @@ namespace uac {
                 break;
         }
         if (dropTransfer) {
-            LOG_DEBUG("drop transfer... %d", strmh->mActiveTransfers);
+            LOG_DEBUG("drop transfer... %d", strmh->mActiveTransfers.load());
             std::unique_lock lock(strmh->mMutex);
             strmh->mActiveTransfers--;
             if (strmh->is_active() && strmh->usbTransferError == UAC_NO_ERROR) {
@@ -80,95 +98,432 @@ namespace uac {
             lock.unlock();
             strmh->mCv.notify_all();
         }
+        counters.callbackDuration.record((monotonic_now() - now) / 1000);
     }
 
-    std::vector<uac_audio_data_format_type> uac_stream_if_impl::get_audio_formats() const {
-        std::set<uac_audio_data_format_type> formats;
-        for (auto &&item : altsettings) {
-            formats.insert(static_cast<uac_audio_data_format_type>(item.general.wFormatTag));
+    void uac_stream_handle_impl::feedback_cb(libusb_transfer *transfer) {
+        auto *strmh = static_cast<uac_stream_handle_impl*>(transfer->user_data);
+        if (transfer->status == LIBUSB_TRANSFER_COMPLETED) {
+            for (int packet_id = 0; packet_id < transfer->num_iso_packets; ++packet_id) {
+                libusb_iso_packet_descriptor* packet = transfer->iso_packet_desc + packet_id;
+                if (packet->status != LIBUSB_TRANSFER_COMPLETED || packet->actual_length < 3) continue;
+                uint8_t *pktbuf = libusb_get_iso_packet_buffer_simple(transfer, packet_id);
+                uint32_t feedback = decode_feedback(pktbuf, packet->actual_length, strmh->nominalFeedback);
+                if (feedback > 0) {
+                    strmh->sizer->set_feedback(feedback * strmh->feedbackUnits);
+                } else {
+                    LOG_VERBOSE("ignore implausible feedback of %u bytes", packet->actual_length);
+                }
+            }
+        }
+        int errval = LIBUSB_ERROR_INTERRUPTED;
+        if (strmh->active && (transfer->status == LIBUSB_TRANSFER_COMPLETED || transfer->status == LIBUSB_TRANSFER_TIMED_OUT)) {
+            errval = libusb_submit_transfer(transfer);
+        }
+        if (errval != LIBUSB_SUCCESS) {
+            // the data stream continues at the last known rate
+            LOG_DEBUG("drop feedback transfer... %s", libusb_error_name(errval));
+            std::unique_lock lock(strmh->mMutex);
+            strmh->mActiveFeedback--;
+            lock.unlock();
+            strmh->mCv.notify_all();
         }
-        return {formats.begin(), formats.end()};
     }
 
-    std::vector<uint8_t> uac_stream_if_impl::get_channel_counts(uac_audio_data_format_type fmt) const {
-        std::set<uint8_t> channels;
-        for (auto &&item : altsettings) {
-            if (item.general.wFormatTag != fmt) continue;
-            const uac_format_type_1* formatType1;
-            switch (item.formatTypeDesc->bFormatType) {
-                case UAC_FORMAT_TYPE_I:
-                case UAC_FORMAT_TYPE_III:
-                    formatType1 = reinterpret_cast<const uac_format_type_1*>(item.formatTypeDesc.get());
-                    channels.insert(formatType1->bNrChannels);
-                    break;
-                default:
-                    break;
+    bool uac_stream_handle_impl::collect_packets(libusb_transfer *transfer) {
+        uint32_t offset = 0;
+        for (int packet_id = 0; packet_id < transfer->num_iso_packets; ++packet_id) {
+            libusb_iso_packet_descriptor* packet = transfer->iso_packet_desc + packet_id;
+            //LOG_DEBUG("packet %d actual_len=%u", packet_id, packet->actual_length);
+            if (packet->actual_length > packet->length) {
+                LOG_WARN("kernel misbehaviour with returned actual_length (%u>%u)", packet->actual_length, packet->length);
+                return false;
+            }
+            auto& desc = packets[packet_id];
+            desc.offset = offset;
+            desc.actual_length = packet->actual_length;
+            desc.status = packet->status;
+            desc.discontinuity = false;
+            offset += packet->length;
+
+            // the sizer follows the device rate through every packet, also the lost ones
+            const uint expected = std::min(sizer->next(), packet->length / stride);
+            if (desc.status == LIBUSB_TRANSFER_COMPLETED && desc.actual_length > 0) {
+                uac_stream_counters::add(counters.packets, 1);
+                uac_stream_counters::add(counters.bytes, desc.actual_length);
+                if (desc.actual_length < nominalPacketFrames * stride) {
+                    uac_stream_counters::add(counters.shortPackets, 1);
+                }
+            } else {
+                uac_stream_counters::add(desc.status == LIBUSB_TRANSFER_COMPLETED ? counters.zeroPackets : counters.failedPackets, 1);
+            }
+
+            if (desc.status == LIBUSB_TRANSFER_COMPLETED && desc.actual_length > 0) {
+                receivedData = true;
+            } else if (receivedData && expected > 0) {
+                memset(transfer->buffer + desc.offset, 0, expected * stride);
+                desc.actual_length = expected * stride;
+                desc.status = LIBUSB_TRANSFER_COMPLETED;
+                desc.discontinuity = true;
+                droppedFrames.fetch_add(expected, std::memory_order_relaxed);
+                LOG_VERBOSE("packet %d lost, inserted %u silent frames", packet_id, expected);
+            }
+
+            if (swapShift > 0 && desc.status == LIBUSB_TRANSFER_COMPLETED && desc.actual_length >= stride) {
+                swap_channels(transfer->buffer + desc.offset, desc);
             }
         }
-        return {channels.begin(), channels.end()};
+        return true;
     }
 
-    std::vector<uint8_t> uac_stream_if_impl::get_bit_resolutions(uac_audio_data_format_type fmt) const {
-        std::set<uint8_t> bitres;
-        for (auto &&item : altsettings) {
-            if (item.general.wFormatTag != fmt) continue;
-            const uac_format_type_1* formatType1;
-            switch (item.formatTypeDesc->bFormatType) {
-                case UAC_FORMAT_TYPE_I:
-                case UAC_FORMAT_TYPE_III:
-                    formatType1 = reinterpret_cast<const uac_format_type_1*>(item.formatTypeDesc.get());
-                    bitres.insert(formatType1->bBitResolution);
-                    break;
-                default:
-                    break;
+    void uac_stream_handle_impl::swap_channels(uint8_t *data, uac_packet_desc& desc) {
+        // shifted in place, so the packet keeps whole frames for the per packet conversion
+        const uint length = desc.actual_length / stride * stride;
+        std::rotate(data, data + length - swapShift, data + length);
+        std::swap_ranges(data, data + swapShift, swapCarry.begin());
+        desc.actual_length = length;
+        if (!swapCarried) {
+            // nothing carried into the first frame yet
+            desc.offset += stride;
+            desc.actual_length -= stride;
+            swapCarried = true;
+            LOG_DEBUG("SWAP CHANNELS by %u bytes", swapShift);
+        }
+    }
+
+    void uac_stream_handle_impl::update_clock(libusb_transfer *transfer, int64_t now) {
+        uint32_t bytes = 0;
+        if (playback) {
+            bytes = transfer->length;
+        } else {
+            for (int packet_id = 0; packet_id < transfer->num_iso_packets; ++packet_id) {
+                if (packets[packet_id].status == LIBUSB_TRANSFER_COMPLETED) {
+                    bytes += packets[packet_id].actual_length;
+                }
             }
         }
-        return {bitres.begin(), bitres.end()};
+        clock->update(now, bytes / stride);
+        timestamps.publish(clock->last_buffer());
     }
 
-    std::vector<uint32_t> uac_stream_if_impl::get_sample_rates(uac_audio_data_format_type fmt) const {
-        std::set<uint32_t> samplingRates;
+    void uac_stream_handle_impl::deliver_transfer(uint8_t *buffer, uac_packet_desc *descs, uint num_packets, const uac_timestamp& timestamp) {
+        if (convert) {
+            buffer = convert_transfer(buffer, descs, num_packets);
+        }
+        if (resampler) {
+            buffer = resample_transfer(buffer, descs, num_packets);
+        }
+        if (deinterleave && !ringbuffer) {
+            buffer = deinterleave_transfer(buffer, descs, num_packets);
+        }
+        if (transfer_cb_func) {
+            transfer_cb_func(uac_transfer_data{buffer, descs, num_packets, timestamp});
+            return;
+        }
+        for (uint packet_id = 0; packet_id < num_packets; ++packet_id) {
+            const auto& desc = descs[packet_id];
+            if (desc.status == LIBUSB_TRANSFER_COMPLETED && desc.actual_length > 0) {
+                deliver(buffer + desc.offset, desc.actual_length);
+            }
+        }
+    }
+
+    uint8_t* uac_stream_handle_impl::convert_transfer(uint8_t *buffer, uac_packet_desc *descs, uint num_packets) {
+        const uint sampleSize = clientStride / (stride / subframeSize);
+        for (uint packet_id = 0; packet_id < num_packets; ++packet_id) {
+            auto& desc = descs[packet_id];
+            // packets keep their position, scaled to the converted sample size
+            uint32_t offset = desc.offset / subframeSize * sampleSize;
+            if (desc.status == LIBUSB_TRANSFER_COMPLETED && desc.actual_length > 0) {
+                uint frames = desc.actual_length / stride;
+                convert(buffer + desc.offset, convertBuffer.data() + offset, static_cast<size_t>(frames) * (stride / subframeSize));
+                desc.actual_length = frames * clientStride;
+            } else {
+                desc.actual_length = 0;
+            }
+            desc.offset = offset;
+        }
+        return convertBuffer.data();
+    }
+
+    uint8_t* uac_stream_handle_impl::resample_transfer(uint8_t *buffer, uac_packet_desc *descs, uint num_packets) {
+        uint32_t offset = 0;
+        for (uint packet_id = 0; packet_id < num_packets; ++packet_id) {
+            auto& desc = descs[packet_id];
+            uint32_t length = 0;
+            if (desc.status == LIBUSB_TRANSFER_COMPLETED && desc.actual_length > 0) {
+                size_t frames = resampler->process(reinterpret_cast<const float*>(buffer + desc.offset), desc.actual_length / clientStride,
+                                                   reinterpret_cast<float*>(resampleBuffer.data() + offset));
+                length = static_cast<uint32_t>(frames * clientStride);
+            }
+            desc.offset = offset;
+            desc.actual_length = length;
+            offset += length;
+        }
+        return resampleBuffer.data();
+    }
+
+    uint8_t* uac_stream_handle_impl::deinterleave_transfer(uint8_t *buffer, uac_packet_desc *descs, uint num_packets) {
+        const uint channels = stride / subframeSize;
+        for (uint packet_id = 0; packet_id < num_packets; ++packet_id) {
+            auto& desc = descs[packet_id];
+            if (desc.status == LIBUSB_TRANSFER_COMPLETED && desc.actual_length > 0) {
+                uint frames = desc.actual_length / clientStride;
+                deinterleave(buffer + desc.offset, planarBuffer.data() + desc.offset, frames, channels, frames);
+                desc.actual_length = frames * clientStride;
+            }
+        }
+        return planarBuffer.data();
+    }
+
+    void uac_stream_handle_impl::deliver(uint8_t *data, uint size) {
+        if (ringbuffer) {
+            // store only whole frames, so the reader never observes a torn frame
+            size_t space = ringbuffer->write_available() / clientStride * clientStride;
+            size_t written = ringbuffer->write(data, std::min<size_t>(size, space));
+            if (written < size) {
+                LOG_VERBOSE("ring buffer overrun, dropped %zu bytes", size - written);
+            }
+            notify_client();
+        } else {
+            cb_func(data, size);
+        }
+    }
+
+    void uac_stream_handle_impl::enqueue_transfer(libusb_transfer *transfer) {
+        auto *slot = deliveryQueue->back();
+        if (slot == nullptr) {
+            // the delivery thread fell behind, never hold up the resubmission for it
+            uint32_t bytes = 0;
+            for (int packet_id = 0; packet_id < transfer->num_iso_packets; ++packet_id) {
+                if (packets[packet_id].status == LIBUSB_TRANSFER_COMPLETED) {
+                    bytes += packets[packet_id].actual_length;
+                }
+            }
+            droppedFrames.fetch_add(bytes / stride, std::memory_order_relaxed);
+            LOG_VERBOSE("delivery queue overrun, dropped %u frames", bytes / stride);
+            return;
+        }
+        // copy only up to the end of the last packet holding data
+        uint32_t end = 0;
+        for (int packet_id = 0; packet_id < transfer->num_iso_packets; ++packet_id) {
+            const auto& desc = packets[packet_id];
+            slot->packets[packet_id] = desc;
+            if (desc.status == LIBUSB_TRANSFER_COMPLETED && desc.actual_length > 0) {
+                end = std::max(end, desc.offset + desc.actual_length);
+            }
+        }
+        memcpy(slot->buffer.get(), transfer->buffer, end);
+        slot->num_packets = transfer->num_iso_packets;
+        slot->timestamp = clock->last_buffer();
+        deliveryQueue->push();
+        notify_client();
+    }
+
+    void uac_stream_handle_impl::run_capture_delivery() {
+        while (true) {
+            auto *slot = deliveryQueue->front();
+            if (slot == nullptr) {
+                if (!is_active()) break;
+                wait_client({}, -1, [this] { return deliveryQueue->size() > 0; });
+                continue;
+            }
+            deliver_transfer(slot->buffer.get(), slot->packets.data(), slot->num_packets, slot->timestamp);
+            deliveryQueue->pop();
+        }
+    }
+
+    void uac_stream_handle_impl::run_playback_delivery() {
+        // produce one nominal packet at a time, the USB event thread takes it from the ring buffer
+        const uint chunkFrames = std::max(nominalPacketFrames, 1u);
+        const size_t chunkSize = static_cast<size_t>(chunkFrames) * stride;
+        std::vector<uint8_t> chunk(chunkSize);
+        while (is_active()) {
+            if (ringbuffer->write_available() < chunkSize) {
+                wait_client({}, -1, [this, chunkSize] { return ringbuffer->write_available() >= chunkSize; });
+                continue;
+            }
+            uint filled = std::min(playback_func(chunk.data(), chunkFrames), chunkFrames);
+            if (filled < chunkFrames) {
+                LOG_VERBOSE("playback underrun, missing %u frames", chunkFrames - filled);
+                droppedFrames.fetch_add(chunkFrames - filled, std::memory_order_relaxed);
+                memset(chunk.data() + filled * stride, 0, (chunkFrames - filled) * stride);
+            }
+            ringbuffer->write(chunk.data(), chunkSize);
+        }
+    }
+
+    void uac_stream_handle_impl::join_delivery() {
+        if (!deliveryThread.joinable()) return;
+        {
+            std::lock_guard lock(mWaitMutex);
+            mWaitCv.notify_all();
+        }
+        deliveryThread.join();
+    }
+
+    void uac_stream_handle_impl::fill_transfer(libusb_transfer *transfer) {
+        const uint maxFrames = altsetting.endpoint.wMaxPacketSize / stride;
+        int length = 0;
+        for (int packet_id = 0; packet_id < transfer->num_iso_packets; ++packet_id) {
+            uint frames = sizer->next();
+            if (frames > maxFrames) {
+                // wMaxPacketSize is too small for the requested rate, the rest goes with the next packet
+                LOG_VERBOSE("defer %u frames beyond wMaxPacketSize", frames - maxFrames);
+                uac_stream_counters::add(counters.deferredFrames, frames - maxFrames);
+                sizer->defer(frames - maxFrames);
+                frames = maxFrames;
+            }
+            fill_packet(transfer->buffer + length, frames);
+            transfer->iso_packet_desc[packet_id].length = frames * stride;
+            length += frames * stride;
+        }
+        transfer->length = length;
+        uac_stream_counters::add(counters.packets, transfer->num_iso_packets);
+        uac_stream_counters::add(counters.bytes, length);
+    }
+
+    void uac_stream_handle_impl::fill_packet(uint8_t *data, uint frames) {
+        uint filled;
+        if (playback_func && !delivering) {
+            filled = std::min(playback_func(data, frames), frames);
+        } else {
+            filled = ringbuffer->read(data, static_cast<size_t>(frames) * stride) / stride;
+            notify_client();
+        }
+        if (filled < frames) {
+            // never starve the device, play silence instead
+            LOG_VERBOSE("playback underrun, missing %u frames", frames - filled);
+            droppedFrames.fetch_add(frames - filled, std::memory_order_relaxed);
+            memset(data + filled * stride, 0, (frames - filled) * stride);
+        }
+    }
+
+    void uac_stream_handle_impl::notify_client() {
+        // pairs with the fence in wait_client(), so either the client sees the ring buffer change or we see the client waiting
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (clientWaiting.load(std::memory_order_relaxed)) {
+            std::lock_guard lock(mWaitMutex);
+            mWaitCv.notify_all();
+        }
+    }
+
+    static uint32_t rate_distance(uint32_t a, uint32_t b) {
+        return a > b ? a - b : b - a;
+    }
+
+    bool uac_altsetting_caps::supports_rate(uint32_t rate) const {
+        if (rates.empty()) {
+            return minRate <= rate && rate <= maxRate;
+        }
+        return std::find(rates.begin(), rates.end(), rate) != rates.end();
+    }
+
+    uint32_t uac_altsetting_caps::closest_rate(uint32_t rate) const {
+        if (rates.empty()) {
+            return std::clamp(rate, minRate, maxRate);
+        }
+        uint32_t closest = rates[0];
+        for (auto r : rates) {
+            if (rate_distance(r, rate) < rate_distance(closest, rate)) closest = r;
+        }
+        return closest;
+    }
+
+    template<typename T>
+    static uac_span<const T> copy_set(uac_arena &arena, const std::set<T> &values) {
+        std::vector<T> items(values.begin(), values.end());
+        return arena.copy_array(items.data(), items.size());
+    }
+
+    void uac_stream_if_impl::index_capabilities(uac_arena &arena) {
+        struct format_values {
+            std::set<uint8_t> channels;
+            std::set<uint32_t> rates;
+            std::set<uint8_t> bitres;
+        };
+        std::vector<uac_altsetting_caps> rows;
+        std::map<uac_audio_data_format_type, format_values> formats;
         for (auto &&item : altsettings) {
-            if (item.general.wFormatTag != fmt) continue;
-            const uac_format_type_1* formatType1;
-            switch (item.formatTypeDesc->bFormatType) {
-                case UAC_FORMAT_TYPE_I:
-                case UAC_FORMAT_TYPE_III:
-                    formatType1 = reinterpret_cast<const uac_format_type_1*>(item.formatTypeDesc.get());
-                    if (formatType1->bSamFreqType > 0) {
-                        for (int i = 0; i < formatType1->bSamFreqType; ++i) {
-                            samplingRates.insert(formatType1->tSamFreq[i]);
-                        }
-                    } else {
-                        samplingRates.insert(formatType1->tLowerSamFreq);
-                        samplingRates.insert(formatType1->tUpperSamFreq);
-                    }
-                    break;
-                default:
-                    break;
+            auto fmt = static_cast<uac_audio_data_format_type>(item.general.wFormatTag);
+            auto& values = formats[fmt];
+            auto format1 = item.getFormatType1();
+            if (format1 == nullptr) continue;
+
+            uac_altsetting_caps row{&item, fmt, format1->bNrChannels, format1->bSubframeSize, format1->bBitResolution,
+                                    item.endpoint.wMaxPacketSize, format1->tLowerSamFreq, format1->tUpperSamFreq, {}};
+            if (format1->bSamFreqType > 0) {
+                row.rates = arena.copy_array(format1->tSamFreq, format1->bSamFreqType);
+                row.minRate = *std::min_element(row.rates.begin(), row.rates.end());
+                row.maxRate = *std::max_element(row.rates.begin(), row.rates.end());
+                values.rates.insert(row.rates.begin(), row.rates.end());
+            } else {
+                values.rates.insert(row.minRate);
+                values.rates.insert(row.maxRate);
             }
+            values.channels.insert(row.bNrChannels);
+            values.bitres.insert(row.bBitResolution);
+            rows.push_back(row);
+        }
+
+        altsettingCaps = arena.copy_array(rows.data(), rows.size());
+        auto caps = arena.make_array<uac_format_caps>(formats.size());
+        size_t i = 0;
+        for (auto &&[fmt, values] : formats) {
+            caps[i++] = uac_format_caps{fmt, copy_set(arena, values.channels), copy_set(arena, values.rates), copy_set(arena, values.bitres)};
         }
-        return { samplingRates.begin(), samplingRates.end() };
+        formatCaps = caps;
+    }
+
+    const uac_format_caps* uac_stream_if_impl::find_format(uac_audio_data_format_type fmt) const {
+        for (auto &&caps : formatCaps) {
+            if (caps.format == fmt) return &caps;
+        }
+        return nullptr;
+    }
+
+    std::vector<uac_audio_data_format_type> uac_stream_if_impl::get_audio_formats() const {
+        std::vector<uac_audio_data_format_type> formats;
+        for (auto &&caps : formatCaps) {
+            formats.push_back(caps.format);
+        }
+        return formats;
+    }
+
+    std::vector<uint8_t> uac_stream_if_impl::get_channel_counts(uac_audio_data_format_type fmt) const {
+        auto caps = find_format(fmt);
+        if (caps == nullptr) return {};
+        return {caps->channelCounts.begin(), caps->channelCounts.end()};
+    }
+
+    std::vector<uint8_t> uac_stream_if_impl::get_bit_resolutions(uac_audio_data_format_type fmt) const {
+        auto caps = find_format(fmt);
+        if (caps == nullptr) return {};
+        return {caps->bitResolutions.begin(), caps->bitResolutions.end()};
+    }
+
+    std::vector<uint32_t> uac_stream_if_impl::get_sample_rates(uac_audio_data_format_type fmt) const {
+        auto caps = find_format(fmt);
+        if (caps == nullptr) return {};
+        return {caps->sampleRates.begin(), caps->sampleRates.end()};
     }
 
     std::unique_ptr<const uac_audio_config_uncompressed> uac_stream_if_impl::query_config_uncompressed(
             uac_audio_data_format_type audioDataFormatType,
             uint8_t numChannels,
             uint32_t sampleRate) const {
-        for (auto&& setting : altsettings) {
-            auto format1 = setting.getFormatType1();
-            if (format1 == nullptr) continue;
-            if ((audioDataFormatType == UAC_FORMAT_DATA_ANY || setting.general.wFormatTag == audioDataFormatType)
-                && setting.supportsChannelsCount(numChannels)
-                && setting.supportsSampleRate(sampleRate)) {
+        for (auto &&caps : altsettingCaps) {
+            if ((audioDataFormatType == UAC_FORMAT_DATA_ANY || caps.format == audioDataFormatType)
+                && caps.bNrChannels == numChannels
+                && caps.supports_rate(sampleRate)) {
                 return std::make_unique<uac_audio_config_uncompressed>(
                         uac_audio_config_uncompressed{
                             audioDataFormatType,
-                            setting.bAlternateSetting,
-                            format1->bSubframeSize,
-                            format1->bBitResolution,
-                            format1->bNrChannels,
-                            setting.endpoint.wMaxPacketSize,
+                            caps.altsetting->bAlternateSetting,
+                            caps.bSubframeSize,
+                            caps.bBitResolution,
+                            caps.bNrChannels,
+                            caps.wMaxPacketSize,
                             sampleRate
                             });
             }
@@ -176,41 +531,250 @@ namespace uac {
         return {nullptr};
     }
 
+    std::vector<uac_stream_if_impl::candidate> uac_stream_if_impl::find_candidates(const uac_config_request& request) const {
+        std::vector<candidate> candidates;
+        for (auto &&caps : altsettingCaps) {
+            if (request.format != UAC_FORMAT_DATA_ANY && caps.format != request.format) continue;
+            if (caps.bNrChannels < request.minChannels || caps.bNrChannels > request.maxChannels) continue;
+            uint32_t rate;
+            if (request.sampleRate == 0) {
+                rate = caps.maxRate;
+            } else if (caps.supports_rate(request.sampleRate)) {
+                rate = request.sampleRate;
+            } else if (request.exactRate) {
+                continue;
+            } else {
+                rate = caps.closest_rate(request.sampleRate);
+            }
+            candidates.push_back({&caps, rate});
+        }
+        return candidates;
+    }
+
+    // true if a ranks before b, a tie on every preference is false
+    static bool ranks_before(const uac_config_request& request, const uac_altsetting_caps &a, uint32_t aRate,
+                             const uac_altsetting_caps &b, uint32_t bRate) {
+        for (auto preference : request.preferences) {
+            switch (preference) {
+            case UAC_PREFER_CLOSEST_RATE:
+                if (request.sampleRate != 0 && rate_distance(aRate, request.sampleRate) != rate_distance(bRate, request.sampleRate)) {
+                    return rate_distance(aRate, request.sampleRate) < rate_distance(bRate, request.sampleRate);
+                }
+                break;
+            case UAC_PREFER_LOWEST_BANDWIDTH: {
+                const uint64_t aBytes = uint64_t(aRate) * a.bNrChannels * a.bSubframeSize;
+                const uint64_t bBytes = uint64_t(bRate) * b.bNrChannels * b.bSubframeSize;
+                if (aBytes != bBytes) return aBytes < bBytes;
+                if (a.wMaxPacketSize != b.wMaxPacketSize) return a.wMaxPacketSize < b.wMaxPacketSize;
+                break;
+            }
+            case UAC_PREFER_HIGHEST_BIT_DEPTH:
+                if (a.bBitResolution != b.bBitResolution) return a.bBitResolution > b.bBitResolution;
+                break;
+            case UAC_PREFER_FEWEST_CHANNELS:
+                if (a.bNrChannels != b.bNrChannels) return a.bNrChannels < b.bNrChannels;
+                break;
+            }
+        }
+        return false;
+    }
+
+    static uac_audio_config_uncompressed make_config(const uac_altsetting_caps &caps, uint32_t rate) {
+        return uac_audio_config_uncompressed{
+            caps.format,
+            caps.altsetting->bAlternateSetting,
+            caps.bSubframeSize,
+            caps.bBitResolution,
+            caps.bNrChannels,
+            caps.wMaxPacketSize,
+            rate
+        };
+    }
+
+    std::vector<uac_audio_config_uncompressed> uac_stream_if_impl::rank_configs(const uac_config_request& request) const {
+        auto candidates = find_candidates(request);
+        std::stable_sort(candidates.begin(), candidates.end(), [&request](const candidate &a, const candidate &b) {
+            return ranks_before(request, *a.caps, a.rate, *b.caps, b.rate);
+        });
+        std::vector<uac_audio_config_uncompressed> configs;
+        configs.reserve(candidates.size());
+        for (auto &&c : candidates) {
+            configs.push_back(make_config(*c.caps, c.rate));
+        }
+        return configs;
+    }
+
+    std::unique_ptr<const uac_audio_config_uncompressed> uac_stream_if_impl::negotiate_config(const uac_config_request& request) const {
+        auto candidates = find_candidates(request);
+        if (candidates.empty()) {
+            return {nullptr};
+        }
+        const candidate *best = &candidates[0];
+        for (auto &&c : candidates) {
+            if (ranks_before(request, *c.caps, c.rate, *best->caps, best->rate)) best = &c;
+        }
+        return std::make_unique<uac_audio_config_uncompressed>(make_config(*best->caps, best->rate));
+    }
+
     uac_stream_handle_impl::uac_stream_handle_impl(const std::shared_ptr<uac_device_handle_impl>& dev_handle, uint8_t interfaceNr, const uac_altsetting& altsetting) :
-        dev_handle(dev_handle), bInterfaceNr(interfaceNr), altsetting(altsetting), mActiveTransfers(0) {
+        dev_handle(dev_handle), bInterfaceNr(interfaceNr), altsetting(altsetting),
+        playback((altsetting.endpoint.bEndpointAddress & LIBUSB_ENDPOINT_DIR_MASK) == LIBUSB_ENDPOINT_OUT),
+        mActiveTransfers(0) {
 
-        int errval;
-        LOG_DEBUG("claim AS intf(%d)", bInterfaceNr);
-        errval = libusb_claim_interface(dev_handle->usb_handle, bInterfaceNr);
-        if (errval != LIBUSB_SUCCESS) {
-            throw usb_exception_impl("libusb_claim_interface()", (libusb_error)errval);
+        highSpeed = libusb_get_device_speed(libusb_get_device(dev_handle->usb_handle)) >= LIBUSB_SPEED_HIGH;
+        packetsPerSecond = iso_packets_per_second(altsetting.endpoint.bInterval, highSpeed);
+
+        // every stream holds the AudioControl interface, so it stays claimed while any stream of the device runs
+        const uint8_t acInterfaceNr = dev_handle->get_audiocontrol_interface();
+        dev_handle->claim_interface(acInterfaceNr, false);
+        try {
+            dev_handle->claim_interface(bInterfaceNr, true);
+        } catch (...) {
+            dev_handle->release_interface(acInterfaceNr);
+            throw;
         }
-        uac_format_type_1 *format = (uac_format_type_1*) altsetting.formatTypeDesc.get();
+        const uac_format_type_1 *format = altsetting.getFormatType1();
         target_sampling_rate = format->tSamFreq[0];
+        subframeSize = format->bSubframeSize;
         stride = format->bSubframeSize * format->bNrChannels;
+        clientStride = stride;
 
         if (dev_handle->device->hasQuirkSwapChannels()) {
-            offset_stream = format->bSubframeSize;
-        } else {
-            offset_stream = 0;
+            swapShift = format->bSubframeSize;
+            swapCarry.resize(swapShift);
         }
     }
 
     uac_stream_handle_impl::~uac_stream_handle_impl() {
         stop();
         LOG_DEBUG("Destroy stream handle and release intf(%d)", bInterfaceNr);
-        auto errval = libusb_release_interface(dev_handle->usb_handle, bInterfaceNr);
-        if (errval != LIBUSB_SUCCESS) {
-            LOG_DEBUG("Got error when releasing a stream: %s", libusb_error_name(errval));
-        }
+        dev_handle->release_interface(bInterfaceNr);
+        dev_handle->release_interface(dev_handle->get_audiocontrol_interface());
     }
 
-    void uac_stream_handle_impl::start(stream_cb_func stream_cb_func, int burst) {
-        this->cb_func = std::move(stream_cb_func);
-        const int iso_packets = burst;
+    void uac_stream_handle_impl::start(const uac_stream_options& options) {
+        prepare(options);
+        submit();
+    }
+
+    void uac_stream_handle_impl::prepare(const uac_stream_options& options) {
+        this->cb_func = options.cb_func;
+        this->transfer_cb_func = options.transfer_cb_func;
+        this->playback_func = options.playback_func;
+        if (playback && (cb_func || transfer_cb_func)) {
+            throw std::invalid_argument("capture callback given for a playback stream");
+        } else if (!playback && playback_func) {
+            throw std::invalid_argument("playback callback given for a capture stream");
+        }
+        uac_sample_format sampleFormat = options.sampleFormat;
+        const bool resample = options.outputSampleRate > 0 && options.outputSampleRate != target_sampling_rate;
+        if (resample) {
+            if (playback) {
+                throw std::invalid_argument("resampling requires a capture stream");
+            } else if (sampleFormat != UAC_SAMPLE_FORMAT_RAW && sampleFormat != UAC_SAMPLE_FORMAT_FLOAT32) {
+                throw std::invalid_argument("resampled streams deliver float32 samples");
+            }
+            // the resampler works on float frames, convert anything else
+            bool nativeFloat = altsetting.general.wFormatTag == UAC_FORMAT_DATA_IEEE_FLOAT && subframeSize == sizeof(float);
+            sampleFormat = nativeFloat ? UAC_SAMPLE_FORMAT_RAW : UAC_SAMPLE_FORMAT_FLOAT32;
+        }
+        convert = nullptr;
+        clientStride = stride;
+        if (sampleFormat != UAC_SAMPLE_FORMAT_RAW) {
+            if (playback || altsetting.general.wFormatTag != UAC_FORMAT_DATA_PCM) {
+                throw std::invalid_argument("sample format conversion requires a PCM capture stream");
+            }
+            convert = find_converter(subframeSize, sampleFormat);
+            if (convert == nullptr) {
+                throw std::invalid_argument("unsupported subframe size for sample format conversion");
+            }
+            clientStride = stride / subframeSize * sample_format_size(sampleFormat);
+        }
+        deliveredFormat = sampleFormat;
+        if (altsetting.general.wFormatTag == UAC_FORMAT_DATA_IEEE_FLOAT && subframeSize == sizeof(float)) {
+            deliveredFormat = UAC_SAMPLE_FORMAT_FLOAT32;
+        }
+        deliveredRate = resample ? options.outputSampleRate : target_sampling_rate;
+        resampler.reset();
+        if (resample) {
+            const uint maxPacketFrames = altsetting.endpoint.wMaxPacketSize / stride;
+            LOG_DEBUG("resample %u Hz to %u Hz", target_sampling_rate, options.outputSampleRate);
+            resampler = std::make_unique<uac_resampler>(target_sampling_rate, options.outputSampleRate, stride / subframeSize,
+                                                        options.resamplerQuality, maxPacketFrames);
+            resampledPacketFrames = resampler->max_output(maxPacketFrames);
+        }
+        deinterleave = nullptr;
+        if (options.planar) {
+            if (playback) {
+                throw std::invalid_argument("planar delivery requires a capture stream");
+            }
+            deinterleave = find_deinterleaver(clientStride / (stride / subframeSize));
+            if (deinterleave == nullptr) {
+                throw std::invalid_argument("unsupported sample size for planar delivery");
+            }
+        }
+        const bool callbacks = cb_func || transfer_cb_func || playback_func;
+        delivering = options.deliveryThread;
+        deliveryPriority = options.deliveryPriority;
+        deliveryCpu = options.deliveryCpu;
+        if (delivering && !callbacks) {
+            throw std::invalid_argument("a delivery thread requires a callback");
+        }
+        ringbuffer.reset();
+        if (!callbacks) {
+            uint32_t bufferFrames = options.bufferFrames > 0 ? options.bufferFrames : deliveredRate / 10;
+            LOG_DEBUG("%s ring buffer of %u frames", playback ? "playback from" : "capture into", bufferFrames);
+            ringbuffer = std::make_unique<uac_ringbuffer>(static_cast<size_t>(bufferFrames) * clientStride);
+        }
+        // sizes playback packets, and the gaps of lost capture packets
+        sizer = std::make_unique<uac_packet_sizer>(target_sampling_rate, packetsPerSecond);
+        receivedData = false;
+        swapCarried = false;
+        droppedFrames = 0;
+        nominalPacketFrames = target_sampling_rate / packetsPerSecond;
+        counters.reset();
+        if (playback) {
+            LOG_DEBUG("playback at %u Hz, %u packets/s", target_sampling_rate, packetsPerSecond);
+
+            const uint32_t unitsPerSecond = highSpeed ? 8000 : 1000;
+            nominalFeedback = static_cast<uint32_t>((static_cast<uint64_t>(target_sampling_rate) << 16) / unitsPerSecond);
+            feedbackUnits = unitsPerSecond / packetsPerSecond;
+        }
+        clock = std::make_unique<uac_clock_estimator>(target_sampling_rate);
+        timestamps.publish({});
+        if (options.targetLatency > 0) {
+            tuner = std::make_unique<uac_stream_tuner>(options.targetLatency, packetsPerSecond);
+        }
+        // in auto mode, allocate for the deepest queue and submit only a part of it
+        numTransfers = tuner ? uac_stream_tuner::MAX_TRANSFERS : NUM_ISO_TRANSFERS;
+        queuedTransfers = tuner ? tuner->transfers() : NUM_ISO_TRANSFERS;
+        maxPackets = tuner ? uac_stream_tuner::MAX_PACKETS : options.burst;
+        isoPackets = tuner ? tuner->packets() : options.burst;
+        packets.resize(maxPackets);
         const uint16_t wMaxPacketSize = altsetting.endpoint.wMaxPacketSize;
-        const int transfer_size = iso_packets * wMaxPacketSize;
-        LOG_DEBUG("configure iso packets: wMaxPacketSize=%d, transfer_size=%d", wMaxPacketSize, transfer_size);
+        deliveryQueue.reset();
+        if (delivering && playback) {
+            // the delivery thread keeps about two transfers ahead of the device
+            uint32_t bufferFrames = options.bufferFrames > 0 ? options.bufferFrames : 2 * isoPackets * (wMaxPacketSize / stride);
+            LOG_DEBUG("deliver playback through a ring buffer of %u frames", bufferFrames);
+            ringbuffer = std::make_unique<uac_ringbuffer>(static_cast<size_t>(bufferFrames) * stride);
+        } else if (delivering) {
+            LOG_DEBUG("deliver capture through a queue of %u transfers", options.deliveryQueueTransfers);
+            deliveryQueue = std::make_unique<uac_transfer_queue>(options.deliveryQueueTransfers, static_cast<size_t>(maxPackets) * wMaxPacketSize, maxPackets);
+        }
+        size_t clientTransferSize = static_cast<size_t>(maxPackets) * wMaxPacketSize / subframeSize * (clientStride / (stride / subframeSize));
+        if (convert) {
+            convertBuffer.resize(clientTransferSize);
+        }
+        if (resampler) {
+            clientTransferSize = static_cast<size_t>(maxPackets) * resampledPacketFrames * clientStride;
+            resampleBuffer.resize(clientTransferSize);
+        }
+        if (deinterleave) {
+            // pull mode transposes in read(), into a buffer sized there
+            planarBuffer.resize(ringbuffer ? 0 : clientTransferSize);
+        }
+        LOG_DEBUG("configure iso packets: wMaxPacketSize=%d, transfer_size=%d", wMaxPacketSize, maxPackets * wMaxPacketSize);
         auto bmAttributes = altsetting.endpoint.iso_desc.bmAttributes;
         if (bmAttributes & SAMPLING_FREQ_CONTROL) { // the endpoints supports sampling frequency, so probe it
             set_sampling_freq(target_sampling_rate);
@@ -221,51 +785,164 @@ namespace uac {
         if (errval != LIBUSB_SUCCESS) {
             throw usb_exception_impl("libusb_set_interface_alt_setting()", (libusb_error)errval);
         }
+    }
 
+    void uac_stream_handle_impl::unprepare() {
+        LOG_DEBUG("reset intf(%d) to altsetting 0", bInterfaceNr);
+        libusb_set_interface_alt_setting(dev_handle->usb_handle, bInterfaceNr, 0);
+    }
+
+    void uac_stream_handle_impl::submit() {
+        const int transfer_size = maxPackets * altsetting.endpoint.wMaxPacketSize;
+        int errval;
         mActiveTransfers = 0;
-        for (int i = 0; i < NUM_ISO_TRANSFERS; ++i) {
-            libusb_transfer* transfer = libusb_alloc_transfer(iso_packets);
+        mActiveFeedback = 0;
+        active = true;
+        if (delivering) {
+            deliveryThread = std::thread([this] {
+                configure_current_thread("uac-delivery", deliveryPriority, deliveryCpu);
+                if (playback) {
+                    run_playback_delivery();
+                } else {
+                    run_capture_delivery();
+                }
+            });
+        }
+        // both lists are complete before the first submission, resubmit() takes parked transfers from the idle list
+        auto& pool = dev_handle->get_transfer_pool();
+        std::vector<libusb_transfer*> queued;
+        for (int i = 0; i < numTransfers; ++i) {
+            libusb_transfer* transfer = pool.acquire(dev_handle->usb_handle, maxPackets, transfer_size);
             if (transfer == nullptr) {
                 break;
             }
-            uint8_t *buffer = new (std::nothrow) uint8_t[transfer_size];
-            if (buffer == nullptr) {
-                libusb_free_transfer(transfer);
-                break;
+
+            libusb_fill_iso_transfer(transfer, dev_handle->usb_handle, altsetting.endpoint.bEndpointAddress, transfer->buffer, transfer_size, maxPackets, cb, this, 1000);
+            transfers.push_back(transfer);
+            if (i >= queuedTransfers) {
+                idleTransfers.push_back(transfer);
+            } else {
+                queued.push_back(transfer);
             }
-            memset(buffer, 0, transfer_size);
+        }
+        // playback transfers are all prefilled before the first submission; once one is in flight the event
+        // thread refills it on completion, and the sizer, ring buffer and playback callback have one user
+        for (libusb_transfer* transfer : queued) {
+            configure_transfer(transfer, isoPackets);
+        }
+        {
+            std::lock_guard lock(mMutex);
+            for (size_t i = 0; i < queued.size(); ++i) {
+                libusb_transfer* transfer = queued[i];
+                errval = libusb_submit_transfer(transfer);
+                LOG_DEBUG("submit transfer %zu... %s", i, libusb_error_name(errval));
+                if (errval == LIBUSB_SUCCESS) {
+                    ++mActiveTransfers;
+                } else {
+                    // never in flight, so no callback refers to it
+                    transfers.erase(std::find(transfers.begin(), transfers.end(), transfer));
+                    pool.release(transfer);
+                }
+            }
+        }
 
-            libusb_fill_iso_transfer(transfer, dev_handle->usb_handle, altsetting.endpoint.bEndpointAddress, buffer, transfer_size, iso_packets, cb, this, 1000);
-            libusb_set_iso_packet_lengths(transfer, wMaxPacketSize);
-            errval = libusb_submit_transfer(transfer);
-            LOG_DEBUG("submit transfer %d... %s", i, libusb_error_name(errval));
+        if (mActiveTransfers == 0) {
+            active = false;
+            join_delivery();
+            libusb_set_interface_alt_setting(dev_handle->usb_handle, bInterfaceNr, 0);
+            for (libusb_transfer* transfer : transfers) {
+                pool.release(transfer);
+            }
+            transfers.clear();
+            idleTransfers.clear();
+            throw std::runtime_error("No transfers submitted!");
+        }
+
+        if (playback && altsetting.hasSyncEndpoint()) {
+            start_feedback();
+        }
+    }
+
+    void uac_stream_handle_impl::start_feedback() {
+        const auto& syncEndpoint = altsetting.syncEndpoint;
+        if ((syncEndpoint.bEndpointAddress & LIBUSB_ENDPOINT_DIR_MASK) != LIBUSB_ENDPOINT_IN) {
+            LOG_WARN("unsupported sync endpoint 0x%x", syncEndpoint.bEndpointAddress);
+            return;
+        }
+        LOG_DEBUG("start feedback from ep 0x%x, wMaxPacketSize=%d", syncEndpoint.bEndpointAddress, syncEndpoint.wMaxPacketSize);
+        auto& pool = dev_handle->get_transfer_pool();
+        for (int i = 0; i < NUM_FEEDBACK_TRANSFERS; ++i) {
+            libusb_transfer* transfer = pool.acquire(dev_handle->usb_handle, 1, syncEndpoint.wMaxPacketSize);
+            if (transfer == nullptr) {
+                break;
+            }
+            libusb_fill_iso_transfer(transfer, dev_handle->usb_handle, syncEndpoint.bEndpointAddress, transfer->buffer, syncEndpoint.wMaxPacketSize, 1, feedback_cb, this, 1000);
+            libusb_set_iso_packet_lengths(transfer, syncEndpoint.wMaxPacketSize);
+            std::unique_lock lock(mMutex);
+            int errval = libusb_submit_transfer(transfer);
+            LOG_DEBUG("submit feedback transfer %d... %s", i, libusb_error_name(errval));
             if (errval == LIBUSB_SUCCESS) {
                 transfers.push_back(transfer);
-                ++mActiveTransfers;
+                ++mActiveFeedback;
             } else {
-                libusb_free_transfer(transfer);
-                delete[] buffer;
+                pool.release(transfer);
             }
         }
+    }
 
-        if (transfers.empty()) {
-            libusb_set_interface_alt_setting(dev_handle->usb_handle, bInterfaceNr, 0);
-            throw std::runtime_error("No transfers submitted!");
+    void uac_stream_handle_impl::configure_transfer(libusb_transfer *transfer, int iso_packets) {
+        const uint16_t wMaxPacketSize = altsetting.endpoint.wMaxPacketSize;
+        transfer->num_iso_packets = iso_packets;
+        if (playback) {
+            fill_transfer(transfer);
+            return;
         }
-        
+        transfer->length = iso_packets * wMaxPacketSize;
+        libusb_set_iso_packet_lengths(transfer, wMaxPacketSize);
+    }
 
-        active = true;
+    int uac_stream_handle_impl::resubmit(libusb_transfer *transfer) {
+        if (!tuner) {
+            if (playback) {
+                fill_transfer(transfer);
+            }
+            return libusb_submit_transfer(transfer);
+        }
+        std::unique_lock lock(mMutex);
+        if (mActiveTransfers > tuner->transfers()) {
+            // make the queue shallower by parking this transfer
+            --mActiveTransfers;
+            idleTransfers.push_back(transfer);
+            return LIBUSB_SUCCESS;
+        }
+        configure_transfer(transfer, tuner->packets());
+        int errval = libusb_submit_transfer(transfer);
+        // make the queue deeper with parked transfers
+        while (errval == LIBUSB_SUCCESS && active && mActiveTransfers < tuner->transfers() && !idleTransfers.empty()) {
+            libusb_transfer *idle = idleTransfers.back();
+            configure_transfer(idle, tuner->packets());
+            if (libusb_submit_transfer(idle) != LIBUSB_SUCCESS) break;
+            idleTransfers.pop_back();
+            ++mActiveTransfers;
+        }
+        return errval;
     }
 
     void uac_stream_handle_impl::stop() {
         if (!active) return;
         active = false;
         LOG_DEBUG("Stop stream intf(%d), altsetting=%d", bInterfaceNr, altsetting.bAlternateSetting);
-        active = false;
+        if (ringbuffer) {
+            // wake up a blocked client
+            std::lock_guard readLock(mWaitMutex);
+            mWaitCv.notify_all();
+        }
         for (libusb_transfer* transfer : transfers) {
             libusb_cancel_transfer(transfer);
         }
-        
+        // no callback runs once the delivery thread is gone, the USB event thread only enqueues
+        join_delivery();
+
         libusb_set_interface_alt_setting(dev_handle->usb_handle, bInterfaceNr, 0);
 
         if (transfers.empty()) {
@@ -274,20 +951,21 @@ namespace uac {
 
         // wait for transfers to complete
         std::unique_lock lock(mMutex);
-        mCv.wait(lock, [this] { return mActiveTransfers == 0; });
+        mCv.wait(lock, [this] { return mActiveTransfers == 0 && mActiveFeedback == 0; });
 
-        // free transfers
-        LOG_DEBUG("Free up transfers..");
+        // return transfers to the pool for the next start
+        LOG_DEBUG("Release transfers..");
+        auto& pool = dev_handle->get_transfer_pool();
         for (libusb_transfer* transfer : transfers) {
-            delete[] transfer->buffer;
-            libusb_free_transfer(transfer);
+            pool.release(transfer);
         }
         transfers.clear();
+        idleTransfers.clear();
     }
 
     void uac_stream_handle_impl::set_sampling_rate(const uint32_t samplingRate) {
         if (samplingRate == 0) {
-            uac_format_type_1 *format = (uac_format_type_1*) altsetting.formatTypeDesc.get();
+            const uac_format_type_1 *format = altsetting.getFormatType1();
             target_sampling_rate = format->tSamFreq[0];
         } else {
             target_sampling_rate = samplingRate;
@@ -344,4 +1022,132 @@ namespace uac {
     bool uac_stream_handle_impl::is_active() const {
         return active;
     }
+
+    bool uac_stream_handle_impl::is_playback() const {
+        return playback;
+    }
+
+    uint uac_stream_handle_impl::get_stride() const {
+        return stride;
+    }
+
+    uint32_t uac_stream_handle_impl::get_sampling_rate() const {
+        return target_sampling_rate;
+    }
+
+    uint32_t uac_stream_handle_impl::get_packets_per_second() const {
+        return packetsPerSecond;
+    }
+
+    uint uac_stream_handle_impl::get_max_packet_frames() const {
+        return altsetting.endpoint.wMaxPacketSize / stride;
+    }
+
+    uint uac_stream_handle_impl::get_transfer_frames() const {
+        return static_cast<uint>(static_cast<uint64_t>(target_sampling_rate) * isoPackets / packetsPerSecond);
+    }
+
+    uint uac_stream_handle_impl::get_queued_frames() const {
+        return get_transfer_frames() * queuedTransfers;
+    }
+
+    uint uac_stream_handle_impl::get_channels() const {
+        return stride / subframeSize;
+    }
+
+    uint32_t uac_stream_handle_impl::get_delivered_rate() const {
+        return deliveredRate;
+    }
+
+    uac_sample_format uac_stream_handle_impl::get_delivered_format() const {
+        return deliveredFormat;
+    }
+
+    bool uac_stream_handle_impl::is_planar() const {
+        return deinterleave != nullptr;
+    }
+
+    bool uac_stream_handle_impl::has_ringbuffer() const {
+        return ringbuffer != nullptr;
+    }
+
+    bool uac_stream_handle_impl::wait_client(std::chrono::steady_clock::time_point deadline, int timeout, const std::function<bool()>& ready) {
+        std::unique_lock lock(mWaitMutex);
+        clientWaiting = true;
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        bool expired = false;
+        if (!ready() && is_active()) {
+            if (timeout < 0) {
+                mWaitCv.wait(lock);
+            } else {
+                expired = mWaitCv.wait_until(lock, deadline) == std::cv_status::timeout;
+            }
+        }
+        clientWaiting = false;
+        return !expired;
+    }
+
+    uint uac_stream_handle_impl::read(uint8_t *buffer, uint frames, int timeout) {
+        if (!ringbuffer || playback) {
+            throw std::logic_error("read() requires a capture stream started without a callback");
+        }
+        const auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout);
+        const size_t requested = static_cast<size_t>(frames) * clientStride;
+        uint8_t *target = buffer;
+        if (deinterleave) {
+            if (planarBuffer.size() < requested) planarBuffer.resize(requested);
+            target = planarBuffer.data();
+        }
+        size_t done = ringbuffer->read(target, requested);
+        while (done < requested && timeout != 0 && is_active()) {
+            if (!wait_client(deadline, timeout, [this] { return ringbuffer->read_available() > 0; })) {
+                timeout = 0;
+            }
+            done += ringbuffer->read(target + done, requested - done);
+        }
+        if (deinterleave) {
+            deinterleave(target, buffer, done / clientStride, stride / subframeSize, frames);
+        }
+        return done / clientStride;
+    }
+
+    uint uac_stream_handle_impl::write(const uint8_t *buffer, uint frames, int timeout) {
+        if (!ringbuffer || !playback || playback_func) {
+            throw std::logic_error("write() requires a playback stream started without a callback");
+        }
+        const auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout);
+        const size_t requested = static_cast<size_t>(frames) * stride;
+        // store only whole frames, so the USB event thread never sends a torn frame
+        auto write_frames = [this, buffer, requested](size_t done) {
+            size_t space = ringbuffer->write_available() / stride * stride;
+            return ringbuffer->write(buffer + done, std::min(requested - done, space));
+        };
+        size_t done = write_frames(0);
+        while (done < requested && timeout != 0 && is_active()) {
+            if (!wait_client(deadline, timeout, [this] { return ringbuffer->write_available() >= stride; })) {
+                timeout = 0;
+            }
+            done += write_frames(done);
+        }
+        return done / stride;
+    }
+
+    uint uac_stream_handle_impl::available() const {
+        if (!ringbuffer) {
+            return 0;
+        }
+        return (playback ? ringbuffer->write_available() / stride : ringbuffer->read_available() / clientStride);
+    }
+
+    uac_timestamp uac_stream_handle_impl::get_timestamp() const {
+        return timestamps.load();
+    }
+
+    uint64_t uac_stream_handle_impl::get_dropped_frames() const {
+        return droppedFrames.load(std::memory_order_relaxed);
+    }
+
+    uac_stream_metrics uac_stream_handle_impl::get_metrics() const {
+        return counters.snapshot(mActiveTransfers.load(std::memory_order_relaxed));
+    }
 }
@@ -17,8 +17,19 @@
 #include "libuac.h"
 #include "uac_device.h"
 #include "uac_parser.h"
+#include "uac_ringbuffer.h"
+#include "uac_stream_tuner.h"
+#include "uac_packet_sizer.h"
+#include "uac_convert.h"
+#include "uac_resampler.h"
+#include "uac_clock.h"
+#include "uac_metrics.h"
+#include "uac_transfer_queue.h"
+#include <atomic>
 #include <mutex>
 #include <condition_variable>
+#include <chrono>
+#include <thread>
 
 namespace uac {
 
@@ -27,41 +38,163 @@ namespace uac {
         uac_stream_handle_impl(const std::shared_ptr<uac_device_handle_impl>& dev_handle, uint8_t interfaceNr, const uac_altsetting& altsetting);
         ~uac_stream_handle_impl();
 
-        void start(stream_cb_func stream_cb_func, int burst);
+        void start(const uac_stream_options& options);
+        // start() in two steps, so paired streams can be configured before either submits transfers
+        void prepare(const uac_stream_options& options);
+        void submit();
+        // back to altsetting 0 after prepare(), for a stream which is not going to be submitted
+        void unprepare();
         void stop() override;
 
         void set_sampling_rate(const uint32_t samplingRate) override;
 
         error_code check_streaming_error() const override;
 
+        uint read(uint8_t *buffer, uint frames, int timeout) override;
+        uint write(const uint8_t *buffer, uint frames, int timeout) override;
+        uint available() const override;
+        uac_timestamp get_timestamp() const override;
+        uint64_t get_dropped_frames() const override;
+        uac_stream_metrics get_metrics() const override;
+
         bool is_active() const;
+        bool is_playback() const;
+
+        uint get_stride() const;
+        uint32_t get_sampling_rate() const;
+        uint32_t get_packets_per_second() const;
+        uint get_max_packet_frames() const;
+        // nominal audio frames of one transfer, and of all transfers queued at start
+        uint get_transfer_frames() const;
+        uint get_queued_frames() const;
+
+        // what a capture stream delivers to its client
+        uint get_channels() const;
+        uint32_t get_delivered_rate() const;
+        uac_sample_format get_delivered_format() const;
+        bool is_planar() const;
+        bool has_ringbuffer() const;
 
     protected:
         void set_sampling_freq(uint32_t sampling);
         uint32_t get_sampling_freq();
 
     private:
+        uac_stream_handle_impl* get_impl() override { return this; }
+
         static void cb(libusb_transfer *transfer);
+        static void feedback_cb(libusb_transfer *transfer);
+        void start_feedback();
+        void configure_transfer(libusb_transfer *transfer, int iso_packets);
+        int resubmit(libusb_transfer *transfer);
+        bool collect_packets(libusb_transfer *transfer);
+        void swap_channels(uint8_t *data, uac_packet_desc& desc);
+        void update_clock(libusb_transfer *transfer, int64_t now);
+        void deliver_transfer(uint8_t *buffer, uac_packet_desc *descs, uint num_packets, const uac_timestamp& timestamp);
+        uint8_t* convert_transfer(uint8_t *buffer, uac_packet_desc *descs, uint num_packets);
+        uint8_t* resample_transfer(uint8_t *buffer, uac_packet_desc *descs, uint num_packets);
+        uint8_t* deinterleave_transfer(uint8_t *buffer, uac_packet_desc *descs, uint num_packets);
+        void deliver(uint8_t *data, uint size);
+        void enqueue_transfer(libusb_transfer *transfer);
+        void run_capture_delivery();
+        void run_playback_delivery();
+        void join_delivery();
+        void fill_transfer(libusb_transfer *transfer);
+        void fill_packet(uint8_t *data, uint frames);
+        void notify_client();
+        bool wait_client(std::chrono::steady_clock::time_point deadline, int timeout, const std::function<bool()>& ready);
+
         const std::shared_ptr<uac_device_handle_impl> dev_handle;
 
         const uac_altsetting& altsetting;
         uint8_t bInterfaceNr;
 
+        // data flows to the device
+        const bool playback;
+        bool highSpeed;
+        uint32_t packetsPerSecond;
+
         stream_cb_func cb_func;
+        stream_transfer_cb_func transfer_cb_func;
+        playback_cb_func playback_func;
+        std::unique_ptr<uac_packet_sizer> sizer;
+
+        // explicit feedback of an asynchronous playback stream, in frames per (micro)frame
+        uint32_t nominalFeedback = 0;
+        uint32_t feedbackUnits = 1; // (micro)frames per data packet
+
+        // packet descriptors of the transfer being completed
+        std::vector<uac_packet_desc> packets;
+
+        // lost packets are filled with silence once data has arrived
+        bool receivedData = false;
+        std::atomic<uint64_t> droppedFrames = 0;
+        uint nominalPacketFrames = 0;
+
+        uac_stream_counters counters;
+
+        // pull mode, the USB event thread produces and the reader consumes, or the other way round for playback
+        std::unique_ptr<uac_ringbuffer> ringbuffer;
+        std::mutex mWaitMutex;
+        std::condition_variable mWaitCv;
+        std::atomic<bool> clientWaiting = false;
+
+        // callbacks run on a delivery thread, fed with completed capture transfers through the queue,
+        // or filling the playback ring buffer ahead of the USB event thread
+        bool delivering = false;
+        int deliveryPriority = 0;
+        int deliveryCpu = -1;
+        std::unique_ptr<uac_transfer_queue> deliveryQueue;
+        std::thread deliveryThread;
 
         std::mutex mMutex;
         std::condition_variable mCv;
-        int mActiveTransfers;
+        // atomic only for the metrics, changed under mMutex
+        std::atomic<int> mActiveTransfers;
+        // feedback transfers in flight, counted apart so the data queue depth stays exact
+        int mActiveFeedback = 0;
 
         uint stride;
-
-        // quirks
-        uint offset_stream;
+        uint subframeSize;
+
+        // captured samples are converted into a buffer of frames of clientStride bytes
+        uac_convert_func convert = nullptr;
+        uint clientStride;
+        std::vector<uint8_t> convertBuffer;
+        uac_sample_format deliveredFormat = UAC_SAMPLE_FORMAT_RAW;
+        uint32_t deliveredRate = 0;
+
+        // float frames are resampled into packed packets
+        std::unique_ptr<uac_resampler> resampler;
+        size_t resampledPacketFrames = 0;
+        std::vector<uint8_t> resampleBuffer;
+
+        // planar delivery, transposed per packet, or per read() from the interleaved ring buffer
+        uac_deinterleave_func deinterleave = nullptr;
+        std::vector<uint8_t> planarBuffer;
+
+        // quirks: a stream with swapped channels is shifted by one subframe, so every frame is completed by the first
+        // subframe of the next one, carried over from the previous packet
+        uint swapShift = 0;
+        std::vector<uint8_t> swapCarry;
+        bool swapCarried = false;
 
         uint32_t target_sampling_rate;
 
         std::atomic<bool> active = false;
         std::vector<libusb_transfer*> transfers;
+        int numTransfers = 0;
+        int queuedTransfers = 0;
+        int maxPackets = 0;
+        int isoPackets = 0;
+
+        // host time of the stream frames
+        std::unique_ptr<uac_clock_estimator> clock;
+        uac_timestamp_publisher timestamps;
+
+        // auto-tuned queue depth, transfers not in flight are parked
+        std::unique_ptr<uac_stream_tuner> tuner;
+        std::vector<libusb_transfer*> idleTransfers;
 
         error_code usbTransferError = UAC_NO_ERROR;
     };
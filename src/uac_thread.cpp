@@ -0,0 +1,51 @@
+// Copyright 2023 Jakub Księżniak
+// 
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// 
+//     http://www.apache.org/licenses/LICENSE-2.0
+// 
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#include "uac_thread.h"
+
+#include <pthread.h>
+#include <sched.h>
+#include <cerrno>
+#include "logging.h"
+
+namespace uac {
+
+    void configure_current_thread(const char *name, int priority, int cpu) {
+#ifdef __linux__
+        pthread_setname_np(pthread_self(), name);
+        if (priority > 0) {
+            sched_param param{};
+            param.sched_priority = priority;
+            int errval = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+            if (errval != 0) {
+                LOG_WARN("%s: SCHED_FIFO priority %d not applied: %s", name, priority, strerror(errval));
+            }
+        }
+        if (cpu >= 0) {
+            // sched_setaffinity() with pid 0 targets the calling thread, also where pthread_setaffinity_np() is missing
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            CPU_SET(cpu, &set);
+            if (sched_setaffinity(0, sizeof(set), &set) != 0) {
+                LOG_WARN("%s: affinity to cpu %d not applied: %s", name, cpu, strerror(errno));
+            }
+        }
+#else
+        if (priority > 0 || cpu >= 0) {
+            LOG_WARN("%s: thread priority and affinity are not supported on this platform", name);
+        }
+#endif
+    }
+}
@@ -0,0 +1,27 @@
+// Copyright 2023 Jakub Księżniak
+// 
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// 
+//     http://www.apache.org/licenses/LICENSE-2.0
+// 
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#pragma once
+
+namespace uac {
+
+    /**
+     * @brief Names the calling thread and applies the real-time options of a library thread.
+     *
+     * A priority from 1 to 99 switches to SCHED_FIFO, 0 keeps the current policy. A cpu of -1 leaves the
+     * affinity alone. Failures, e.g. without the privilege to raise the priority, are logged and ignored.
+     */
+    void configure_current_thread(const char *name, int priority, int cpu);
+}
@@ -0,0 +1,141 @@
+// Copyright 2023 Jakub Księżniak
+// 
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// 
+//     http://www.apache.org/licenses/LICENSE-2.0
+// 
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#include "uac_transfer_pool.h"
+#include "logging.h"
+
+#include <algorithm>
+#include <cstdlib>
+
+#define CACHE_LINE_SIZE 64
+// keep at most this many idle transfers
+#define MAX_FREE_SLOTS 64
+
+namespace uac {
+
+    uac_transfer_pool::~uac_transfer_pool() {
+        for (auto &&s : freeSlots) {
+            if (s.dev_mem_handle != nullptr) {
+                LOG_WARN("device memory of handle %p was not purged", s.dev_mem_handle);
+                libusb_free_transfer(s.transfer);
+            } else {
+                free_slot(s);
+            }
+        }
+        if (!usedSlots.empty()) {
+            LOG_WARN("%zu transfers are still in use", usedSlots.size());
+        }
+    }
+
+    libusb_transfer* uac_transfer_pool::acquire(libusb_device_handle *dev_handle, int iso_packets, int buffer_size) {
+        std::lock_guard lock(mMutex);
+
+        // the best match is the smallest fitting slot, preferring device memory of this handle
+        auto best = freeSlots.end();
+        for (auto it = freeSlots.begin(); it != freeSlots.end(); ++it) {
+            if (it->iso_packets < iso_packets || it->size < buffer_size) continue;
+            if (it->dev_mem_handle != nullptr && it->dev_mem_handle != dev_handle) continue;
+            if (best == freeSlots.end()
+                || (it->dev_mem_handle != nullptr && best->dev_mem_handle == nullptr)
+                || (it->dev_mem_handle == best->dev_mem_handle && it->size < best->size)) {
+                best = it;
+            }
+        }
+        if (best != freeSlots.end()) {
+            slot s = *best;
+            freeSlots.erase(best);
+            s.transfer->buffer = s.buffer;
+            usedSlots.emplace(s.transfer, s);
+            return s.transfer;
+        }
+
+        slot s{};
+        s.transfer = libusb_alloc_transfer(iso_packets);
+        if (s.transfer == nullptr) {
+            return nullptr;
+        }
+        s.buffer = alloc_buffer(dev_handle, buffer_size, &s.dev_mem_handle);
+        if (s.buffer == nullptr) {
+            libusb_free_transfer(s.transfer);
+            return nullptr;
+        }
+        s.iso_packets = iso_packets;
+        s.size = buffer_size;
+        s.transfer->buffer = s.buffer;
+        usedSlots.emplace(s.transfer, s);
+        return s.transfer;
+    }
+
+    void uac_transfer_pool::release(libusb_transfer *transfer) {
+        std::lock_guard lock(mMutex);
+        auto it = usedSlots.find(transfer);
+        if (it == usedSlots.end()) {
+            LOG_WARN("transfer %p does not belong to this pool", transfer);
+            return;
+        }
+        slot s = it->second;
+        usedSlots.erase(it);
+        if (freeSlots.size() < MAX_FREE_SLOTS) {
+            freeSlots.push_back(s);
+        } else {
+            free_slot(s);
+        }
+    }
+
+    void uac_transfer_pool::purge(libusb_device_handle *dev_handle) {
+        std::lock_guard lock(mMutex);
+        auto it = std::remove_if(freeSlots.begin(), freeSlots.end(), [dev_handle](const slot &s) {
+            return s.dev_mem_handle == dev_handle;
+        });
+        std::for_each(it, freeSlots.end(), free_slot);
+        freeSlots.erase(it, freeSlots.end());
+        noDevMemHandles.erase(std::remove(noDevMemHandles.begin(), noDevMemHandles.end(), dev_handle), noDevMemHandles.end());
+    }
+
+    uint8_t* uac_transfer_pool::alloc_buffer(libusb_device_handle *dev_handle, int size, libusb_device_handle **dev_mem_handle) {
+        *dev_mem_handle = nullptr;
+#if LIBUSB_API_VERSION >= 0x01000105
+        if (dev_handle != nullptr && std::find(noDevMemHandles.begin(), noDevMemHandles.end(), dev_handle) == noDevMemHandles.end()) {
+            uint8_t *buffer = libusb_dev_mem_alloc(dev_handle, size);
+            if (buffer != nullptr) {
+                *dev_mem_handle = dev_handle;
+                return buffer;
+            }
+            LOG_DEBUG("libusb_dev_mem_alloc() is not supported, fall back to heap buffers");
+            noDevMemHandles.push_back(dev_handle);
+        }
+#endif
+        size_t aligned_size = (static_cast<size_t>(size) + CACHE_LINE_SIZE - 1) / CACHE_LINE_SIZE * CACHE_LINE_SIZE;
+        auto *buffer = static_cast<uint8_t*>(aligned_alloc(CACHE_LINE_SIZE, aligned_size));
+        if (buffer != nullptr) {
+            memset(buffer, 0, aligned_size);
+        }
+        return buffer;
+    }
+
+    void uac_transfer_pool::free_slot(const slot &s) {
+#if LIBUSB_API_VERSION >= 0x01000105
+        if (s.dev_mem_handle != nullptr) {
+            libusb_dev_mem_free(s.dev_mem_handle, s.buffer, s.size);
+        } else {
+            free(s.buffer);
+        }
+#else
+        free(s.buffer);
+#endif
+        s.transfer->buffer = nullptr;
+        libusb_free_transfer(s.transfer);
+    }
+}
@@ -0,0 +1,73 @@
+// Copyright 2023 Jakub Księżniak
+// 
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// 
+//     http://www.apache.org/licenses/LICENSE-2.0
+// 
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#pragma once
+
+#include <libusb.h>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+namespace uac {
+
+    /**
+     * @brief A cache of ISO transfers and their buffers, reused across stream start/stop cycles.
+     *
+     * Buffers are cache-line aligned. When the kernel supports it, they are allocated with
+     * libusb_dev_mem_alloc(), so usbfs can DMA directly into the user-mapped memory.
+     * Such buffers are bound to the device handle, which has to be purged before it's closed.
+     */
+    class uac_transfer_pool {
+    public:
+        uac_transfer_pool() = default;
+        ~uac_transfer_pool();
+
+        uac_transfer_pool(const uac_transfer_pool&) = delete;
+        uac_transfer_pool& operator=(const uac_transfer_pool&) = delete;
+
+        /**
+         * Takes a transfer with at least iso_packets packet descriptors and a buffer of at least buffer_size bytes.
+         * @return the transfer with its buffer set, or nullptr when out of memory
+         */
+        libusb_transfer* acquire(libusb_device_handle *dev_handle, int iso_packets, int buffer_size);
+
+        /**
+         * Returns a transfer taken with acquire(). The transfer must not be in flight.
+         */
+        void release(libusb_transfer *transfer);
+
+        /**
+         * Frees all cached transfers with buffers bound to the device handle.
+         */
+        void purge(libusb_device_handle *dev_handle);
+
+    private:
+        struct slot {
+            libusb_transfer *transfer;
+            int iso_packets;
+            int size;
+            uint8_t *buffer;
+            libusb_device_handle *dev_mem_handle; // owner of a libusb_dev_mem_alloc() buffer, if any
+        };
+
+        uint8_t* alloc_buffer(libusb_device_handle *dev_handle, int size, libusb_device_handle **dev_mem_handle);
+        static void free_slot(const slot &s);
+
+        std::mutex mMutex;
+        std::vector<slot> freeSlots;
+        std::unordered_map<libusb_transfer*, slot> usedSlots;
+        std::vector<libusb_device_handle*> noDevMemHandles;
+    };
+}
@@ -0,0 +1,63 @@
+// Copyright 2023 Jakub Księżniak
+// 
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// 
+//     http://www.apache.org/licenses/LICENSE-2.0
+// 
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#include "uac_transfer_queue.h"
+
+#include <algorithm>
+
+namespace uac {
+
+    static size_t round_up_pow2(size_t value) {
+        size_t result = 1;
+        while (result < value) result <<= 1;
+        return result;
+    }
+
+    uac_transfer_queue::uac_transfer_queue(size_t slots, size_t bufferSize, size_t maxPackets) :
+            slots(round_up_pow2(std::max<size_t>(slots, 1))), mask(this->slots.size() - 1), head(0), tail(0) {
+        for (auto& slot : this->slots) {
+            slot.buffer = std::make_unique<uint8_t[]>(bufferSize);
+            slot.packets.resize(maxPackets);
+        }
+    }
+
+    size_t uac_transfer_queue::size() const {
+        return head.load(std::memory_order_acquire) - tail.load(std::memory_order_acquire);
+    }
+
+    uac_transfer_queue::slot* uac_transfer_queue::back() {
+        const size_t w = head.load(std::memory_order_relaxed);
+        if (w - tail.load(std::memory_order_acquire) == capacity()) {
+            return nullptr;
+        }
+        return &slots[w & mask];
+    }
+
+    void uac_transfer_queue::push() {
+        head.store(head.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+    }
+
+    uac_transfer_queue::slot* uac_transfer_queue::front() {
+        const size_t r = tail.load(std::memory_order_relaxed);
+        if (head.load(std::memory_order_acquire) == r) {
+            return nullptr;
+        }
+        return &slots[r & mask];
+    }
+
+    void uac_transfer_queue::pop() {
+        tail.store(tail.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+    }
+}
@@ -0,0 +1,70 @@
+// Copyright 2023 Jakub Księżniak
+// 
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// 
+//     http://www.apache.org/licenses/LICENSE-2.0
+// 
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#pragma once
+
+#include "libuac.h"
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+namespace uac {
+
+    /**
+     * @brief A lock-free single-producer/single-consumer queue of completed capture transfers.
+     *
+     * Slots are allocated up front, the producer fills the slot returned by back() and publishes it with push(),
+     * the consumer processes front() and recycles it with pop(). The number of slots is rounded up to a power of two.
+     */
+    class uac_transfer_queue {
+    public:
+        struct slot {
+            std::unique_ptr<uint8_t[]> buffer;
+            std::vector<uac_packet_desc> packets;
+            uint num_packets = 0;
+            uac_timestamp timestamp;
+        };
+
+        uac_transfer_queue(size_t slots, size_t bufferSize, size_t maxPackets);
+
+        size_t capacity() const {
+            return mask + 1;
+        }
+
+        size_t size() const;
+
+        /**
+         * @return the slot to fill, or nullptr if the queue is full
+         */
+        slot* back();
+        void push();
+
+        /**
+         * @return the oldest slot, or nullptr if the queue is empty
+         */
+        slot* front();
+        void pop();
+
+    private:
+        std::vector<slot> slots;
+        size_t mask;
+
+        // keep producer and consumer positions on separate cache lines
+        alignas(64) std::atomic<size_t> head;
+        alignas(64) std::atomic<size_t> tail;
+    };
+}
@@ -0,0 +1,116 @@
+#include <doctest.h>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+#include "uac_aggregate.h"
+
+using namespace uac;
+
+namespace {
+    // host time in nanoseconds, advanced by the reads from the first stream
+    struct sim_clock {
+        std::atomic<int64_t> now{0};
+    };
+
+    // a 50Hz tone of host time, so aligned streams carry the same samples
+    class sim_source : public uac_aggregate_source {
+    public:
+        sim_source(sim_clock& clock, int64_t start, double period, bool master) :
+            clock(clock), start(start), period(period), master(master) {}
+
+        uint get_channels() const override { return 1; }
+        uint32_t get_device_rate() const override { return 48000; }
+        uint32_t get_delivered_rate() const override { return 48000; }
+
+        uint read(float *buffer, uint frames, int /*timeout*/) override {
+            if (master) {
+                // the frames arrive 5ms after they were sampled
+                clock.now = start + static_cast<int64_t>((consumed + frames) * period) + 5000000;
+            } else {
+                frames = std::min(frames, available());
+            }
+            for (uint f = 0; f < frames; ++f) {
+                buffer[f] = sample(consumed + f);
+            }
+            consumed += frames;
+            return frames;
+        }
+        uint available() const override { return static_cast<uint>(produced() - consumed); }
+        uac_timestamp get_timestamp() const override {
+            const uint64_t frame = produced();
+            return { frame, start + static_cast<int64_t>(frame * period), period };
+        }
+        bool is_active() const override { return true; }
+        error_code check_streaming_error() const override { return UAC_NO_ERROR; }
+
+    private:
+        uint64_t produced() const {
+            return clock.now > start ? static_cast<uint64_t>((clock.now - start) / period) : 0;
+        }
+        float sample(uint64_t frame) const {
+            return static_cast<float>(0.5 * std::sin(2 * M_PI * 50 * (start + frame * period) * 1e-9));
+        }
+
+        sim_clock& clock;
+        const int64_t start;
+        const double period;
+        const bool master;
+        uint64_t consumed = 0;
+    };
+}
+
+TEST_CASE("test uac_aggregate aligns a drifting stream") {
+    // the second device runs 200ppm fast and started 3ms before the first
+    const double masterPeriod = 1e9 / 48000;
+    const double memberPeriod = masterPeriod / 1.0002;
+    sim_clock clock;
+    auto master = std::make_shared<sim_source>(clock, 1000000000, masterPeriod, true);
+    auto member = std::make_shared<sim_source>(clock, 997000000, memberPeriod, false);
+
+    // 20s of 10ms periods
+    const size_t periods = 2000;
+    std::vector<float> output;
+    output.reserve(periods * 480 * 2);
+    std::atomic<size_t> delivered{0};
+    uac_aggregate_options options;
+    auto aggregate = std::make_shared<uac_aggregate_stream_handle_impl>(std::vector<std::shared_ptr<uac_aggregate_source>>{ master, member },
+        [&](const float *frames, uint count) {
+            if (delivered < periods) {
+                output.insert(output.end(), frames, frames + count * 2);
+                ++delivered;
+            }
+        }, options);
+    CHECK(aggregate->get_channel_count() == 2);
+    aggregate->start();
+    while (delivered < periods) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    aggregate->stop();
+    CHECK(aggregate->check_streaming_error() == UAC_NO_ERROR);
+
+    CHECK(std::abs(aggregate->get_drift_ratio(1) - 1.0002) < 1e-5);
+    // over the last second, a frame of misalignment would differ by up to 0.0033
+    double worst = 0;
+    const size_t frames = output.size() / 2;
+    for (size_t f = frames - 48000; f < frames; ++f) {
+        worst = std::max(worst, static_cast<double>(std::abs(output[f * 2] - output[f * 2 + 1])));
+    }
+    CHECK(worst < 0.001);
+}
+
+TEST_CASE("test uac_aggregate reports a throwing callback") {
+    sim_clock clock;
+    auto master = std::make_shared<sim_source>(clock, 1000000000, 1e9 / 48000, true);
+    uac_aggregate_options options;
+    auto aggregate = std::make_shared<uac_aggregate_stream_handle_impl>(std::vector<std::shared_ptr<uac_aggregate_source>>{ master },
+        [](const float*, uint) { throw std::runtime_error("callback failed"); }, options);
+    aggregate->start();
+    for (int i = 0; i < 1000 && aggregate->check_streaming_error() == UAC_NO_ERROR; ++i) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    CHECK(aggregate->check_streaming_error() == UAC_ERROR_UNKNOWN);
+    aggregate->stop();
+}
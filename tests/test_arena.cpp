@@ -0,0 +1,47 @@
+#include <doctest.h>
+#include "uac_arena.h"
+
+using namespace uac;
+
+namespace {
+    struct counted {
+        static int alive;
+        counted() { ++alive; }
+        ~counted() { --alive; }
+    };
+    int counted::alive = 0;
+}
+
+TEST_CASE("test uac_arena arrays") {
+    uac_arena arena(64);
+
+    auto values = arena.make_array<uint32_t>(4);
+    REQUIRE(values.size() == 4);
+    CHECK(values[0] == 0);
+    CHECK(values[3] == 0);
+    CHECK(reinterpret_cast<uintptr_t>(values.data()) % alignof(uint32_t) == 0);
+
+    const uint8_t bytes[] = {1, 2, 3};
+    auto copy = arena.copy_array(bytes, sizeof(bytes));
+    CHECK(copy.size() == 3);
+    CHECK(copy.back() == 3);
+    CHECK(arena.blocks() == 1);
+
+    CHECK(arena.make_array<uint8_t>(0).empty());
+
+    // an estimate which falls short chains another block
+    auto large = arena.make_array<uint64_t>(32);
+    CHECK(large.size() == 32);
+    CHECK(arena.blocks() == 2);
+    CHECK(arena.used() >= 16 + 3 + 32 * 8);
+}
+
+TEST_CASE("test uac_arena destroys objects") {
+    {
+        uac_arena arena(256);
+        arena.make_array<counted>(3);
+        arena.make_array<counted>(2);
+        CHECK(counted::alive == 5);
+    }
+    CHECK(counted::alive == 0);
+}
@@ -0,0 +1,54 @@
+#include <doctest.h>
+#include <cmath>
+#include <cstdlib>
+#include "uac_clock.h"
+
+using namespace uac;
+
+TEST_CASE("test uac_clock_estimator tracks a fast device") {
+    // 48kHz nominal, the device runs 100ppm fast and completions jitter by up to 300us
+    const double truePeriod = 1e9 / (48000 * 1.0001);
+    uac_clock_estimator clock(48000);
+    srand(1);
+    uint64_t frame = 0;
+    double worst = 0;
+    for (int i = 0; i < 20000; ++i) {
+        uint32_t frames = i % 10 == 9 ? 49 : 48;
+        frame += frames;
+        const double jitter = (rand() % 300000);
+        clock.update(static_cast<int64_t>(1e9 + frame * truePeriod + jitter), frames);
+        if (i > 10000) {
+            // the buffer start, relative to the true start, includes the mean jitter
+            const double expected = 1e9 + (frame - frames) * truePeriod + 150000;
+            worst = std::max(worst, std::abs(clock.last_buffer().time - expected));
+            CHECK(clock.last_buffer().frame == frame - frames);
+        }
+    }
+    CHECK(worst < 100000);
+    CHECK(std::abs(clock.frame_period() - truePeriod) < truePeriod * 1e-5);
+    CHECK(clock.ratio() > 1.00009);
+    CHECK(clock.ratio() < 1.00011);
+}
+
+TEST_CASE("test uac_clock_estimator restarts after a stall") {
+    uac_clock_estimator clock(48000);
+    int64_t now = 1000000000;
+    for (int i = 0; i < 100; ++i) {
+        now += 1000000;
+        clock.update(now, 48);
+    }
+    // the event thread stalled for 100ms, the frames still count
+    now += 100000000;
+    clock.update(now, 48);
+    CHECK(clock.frames() == 101 * 48);
+    CHECK(clock.last_buffer().time == now - 1000000);
+}
+
+TEST_CASE("test uac_timestamp_publisher") {
+    uac_timestamp_publisher publisher;
+    publisher.publish({480, 123456789, 20833.3});
+    auto timestamp = publisher.load();
+    CHECK(timestamp.frame == 480);
+    CHECK(timestamp.time == 123456789);
+    CHECK(timestamp.frame_period == 20833.3);
+}
@@ -1,5 +1,6 @@
 #include <doctest.h>
 #include <libuac.h>
+#include <poll.h>
 
 TEST_CASE("test uac_context::create()") {
     auto context = uac::uac_context::create();
@@ -11,3 +12,57 @@ TEST_CASE("test query_all_devices()") {
     auto devices = context->query_all_devices();
     CHECK(devices.size() >= 0);
 }
+
+TEST_CASE("test uac_context driven by an application loop") {
+    uac::uac_context_options options;
+    options.eventThread = false;
+    auto context = uac::uac_context::create(options);
+
+    auto usbfds = context->get_pollfds();
+    REQUIRE(usbfds.size() >= 1);
+    std::vector<pollfd> fds;
+    for (const auto& usbfd : usbfds) {
+        fds.push_back(pollfd{usbfd.fd, usbfd.events, 0});
+    }
+
+    // the wake-up descriptor interrupts the poll, and handle_events() consumes it
+    context->wake();
+    CHECK(poll(fds.data(), fds.size(), 1000) >= 1);
+    context->handle_events();
+    CHECK(poll(fds.data(), fds.size(), 0) == 0);
+}
+
+TEST_CASE("test uac_context with sharded event threads") {
+    uac::uac_context_options options;
+    options.shards = 3;
+    auto context = uac::uac_context::create(options);
+
+    // every shard polls its own wake-up descriptor at least
+    CHECK(context->get_pollfds().size() >= 3);
+
+    // a device stays on the shard it was placed on, so it is the same object again
+    auto devices = context->query_all_devices();
+    auto again = context->query_all_devices();
+    REQUIRE(again.size() == devices.size());
+    for (size_t i = 0; i < devices.size(); ++i) {
+        CHECK(again[i] == devices[i]);
+    }
+}
+
+TEST_CASE("test query_all_devices() returns referenced devices again") {
+    auto context = uac::uac_context::create();
+
+    auto devices = context->query_all_devices();
+    auto again = context->query_all_devices();
+    REQUIRE(again.size() == devices.size());
+    for (size_t i = 0; i < devices.size(); ++i) {
+        CHECK(again[i] == devices[i]);
+    }
+
+    // present devices arrive at once, where hotplug events are supported
+    size_t arrived = 0;
+    if (context->set_hotplug_callbacks([&arrived](const std::shared_ptr<uac::uac_device>&) { ++arrived; }, nullptr)) {
+        CHECK(arrived == devices.size());
+        context->set_hotplug_callbacks(nullptr, nullptr);
+    }
+}
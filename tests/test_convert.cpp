@@ -0,0 +1,96 @@
+#include <doctest.h>
+#include <cstring>
+#include <vector>
+#include "uac_convert.h"
+
+using namespace uac;
+
+TEST_CASE("test sample conversion values") {
+    // 24-bit little endian: full scale negative, -1 LSB, one half
+    const uint8_t s24[] = {0x00, 0x00, 0x80, 0xff, 0xff, 0xff, 0x00, 0x00, 0x40};
+    float f[3];
+    find_converter(3, UAC_SAMPLE_FORMAT_FLOAT32, UAC_SIMD_NONE)(s24, reinterpret_cast<uint8_t*>(f), 3);
+    CHECK(f[0] == -1.0f);
+    CHECK(f[1] == -1.0f / 8388608);
+    CHECK(f[2] == 0.5f);
+
+    int32_t s32[3];
+    find_converter(3, UAC_SAMPLE_FORMAT_S32, UAC_SIMD_NONE)(s24, reinterpret_cast<uint8_t*>(s32), 3);
+    CHECK(s32[0] == INT32_MIN);
+    CHECK(s32[1] == -256);
+    CHECK(s32[2] == 0x40000000);
+
+    int16_t s16[3];
+    find_converter(3, UAC_SAMPLE_FORMAT_S16, UAC_SIMD_NONE)(s24, reinterpret_cast<uint8_t*>(s16), 3);
+    CHECK(s16[0] == INT16_MIN);
+    CHECK(s16[1] == -1);
+    CHECK(s16[2] == 0x4000);
+
+    CHECK(find_converter(1, UAC_SAMPLE_FORMAT_FLOAT32) == nullptr);
+    CHECK(find_converter(2, UAC_SAMPLE_FORMAT_RAW) == nullptr);
+    CHECK(sample_format_size(UAC_SAMPLE_FORMAT_FLOAT32) == 4);
+}
+
+TEST_CASE("test SIMD conversion matches scalar") {
+    std::vector<uac_simd_level> levels{detect_simd_level()};
+    if (levels[0] == UAC_SIMD_AVX2) {
+        levels.push_back(UAC_SIMD_SSSE3);
+    }
+    const uac_sample_format formats[] = {UAC_SAMPLE_FORMAT_S16, UAC_SAMPLE_FORMAT_S32, UAC_SAMPLE_FORMAT_FLOAT32};
+
+    uint32_t seed = 1;
+    std::vector<uint8_t> src(4 * 101);
+    for (auto& byte : src) {
+        seed = seed * 1664525 + 1013904223;
+        byte = seed >> 24;
+    }
+
+    for (uint8_t subframeSize = 2; subframeSize <= 4; ++subframeSize) {
+        for (auto format : formats) {
+            // odd lengths exercise the scalar tails and the bounds of the vector loads
+            for (size_t samples : {0, 1, 5, 6, 9, 10, 17, 101}) {
+                const size_t size = samples * sample_format_size(format);
+                std::vector<uint8_t> expected(size + 1, 0xaa);
+                find_converter(subframeSize, format, UAC_SIMD_NONE)(src.data(), expected.data(), samples);
+                for (auto level : levels) {
+                    std::vector<uint8_t> actual(size + 1, 0xaa);
+                    find_converter(subframeSize, format, level)(src.data(), actual.data(), samples);
+                    CHECK(memcmp(expected.data(), actual.data(), size + 1) == 0);
+                }
+            }
+        }
+    }
+}
+
+TEST_CASE("test deinterleave") {
+    std::vector<uac_simd_level> levels{UAC_SIMD_NONE, detect_simd_level()};
+
+    for (size_t sampleSize = 1; sampleSize <= 4; ++sampleSize) {
+        for (uint channels : {1u, 2u, 4u, 6u, 8u, 16u}) {
+            for (size_t frames : {0, 3, 4, 13, 48}) {
+                std::vector<uint8_t> src(frames * channels * sampleSize);
+                for (size_t i = 0; i < src.size(); ++i) {
+                    src[i] = static_cast<uint8_t>(i * 7 + 3);
+                }
+                // a plane pitch beyond the frame count, as read() uses
+                const size_t pitch = frames + 2;
+                for (auto level : levels) {
+                    std::vector<uint8_t> dst(pitch * channels * sampleSize, 0xaa);
+                    find_deinterleaver(sampleSize, level)(src.data(), dst.data(), frames, channels, pitch);
+                    bool match = true;
+                    for (uint c = 0; c < channels; ++c) {
+                        for (size_t f = 0; f < pitch; ++f) {
+                            const uint8_t *out = dst.data() + (c * pitch + f) * sampleSize;
+                            for (size_t b = 0; b < sampleSize; ++b) {
+                                uint8_t expected = f < frames ? src[(f * channels + c) * sampleSize + b] : 0xaa;
+                                match = match && out[b] == expected;
+                            }
+                        }
+                    }
+                    CHECK(match);
+                }
+            }
+        }
+    }
+    CHECK(find_deinterleaver(5) == nullptr);
+}
@@ -0,0 +1,51 @@
+#include <doctest.h>
+#include "uac_descriptor_cache.h"
+
+using namespace uac;
+
+TEST_CASE("test uac_descriptor_cache config hash") {
+    unsigned char acExtra[] = {0x09, 0x24, 0x01, 0x00, 0x01, 0x1e, 0x00, 0x01, 0x01};
+    unsigned char asExtra[] = {0x07, 0x24, 0x01, 0x02, 0x01, 0x01, 0x00};
+    libusb_endpoint_descriptor endpoint{};
+    endpoint.bEndpointAddress = 0x81;
+    endpoint.bmAttributes = 0x05;
+    endpoint.wMaxPacketSize = 96;
+    endpoint.bInterval = 1;
+
+    libusb_interface_descriptor altsettings[2] = {};
+    altsettings[0].bInterfaceNumber = 1;
+    altsettings[1].bInterfaceNumber = 1;
+    altsettings[1].bAlternateSetting = 1;
+    altsettings[1].bNumEndpoints = 1;
+    altsettings[1].endpoint = &endpoint;
+    altsettings[1].extra = asExtra;
+    altsettings[1].extra_length = sizeof(asExtra);
+    libusb_interface_descriptor control{};
+    control.bInterfaceClass = LIBUSB_CLASS_AUDIO;
+    control.bInterfaceSubClass = 1;
+    control.extra = acExtra;
+    control.extra_length = sizeof(acExtra);
+
+    libusb_interface interfaces[2] = {{&control, 1}, {altsettings, 2}};
+    libusb_config_descriptor config{};
+    config.bNumInterfaces = 2;
+    config.bConfigurationValue = 1;
+    config.interface = interfaces;
+
+    const uint64_t hash = uac_descriptor_cache::hash_config(&config);
+    CHECK(uac_descriptor_cache::hash_config(&config) == hash);
+
+    // class-specific bytes and endpoint fields are covered
+    asExtra[3] = 0x04;
+    CHECK(uac_descriptor_cache::hash_config(&config) != hash);
+    asExtra[3] = 0x02;
+    CHECK(uac_descriptor_cache::hash_config(&config) == hash);
+
+    endpoint.wMaxPacketSize = 192;
+    CHECK(uac_descriptor_cache::hash_config(&config) != hash);
+    endpoint.wMaxPacketSize = 96;
+
+    // an interface less is a different configuration
+    config.bNumInterfaces = 1;
+    CHECK(uac_descriptor_cache::hash_config(&config) != hash);
+}
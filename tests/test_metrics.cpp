@@ -0,0 +1,44 @@
+#include <doctest.h>
+#include "uac_metrics.h"
+
+using namespace uac;
+
+TEST_CASE("test uac_atomic_histogram buckets") {
+    CHECK(uac_atomic_histogram::bucket(0) == 0);
+    CHECK(uac_atomic_histogram::bucket(1) == 1);
+    CHECK(uac_atomic_histogram::bucket(2) == 2);
+    CHECK(uac_atomic_histogram::bucket(3) == 2);
+    CHECK(uac_atomic_histogram::bucket(1000) == 10);
+    CHECK(uac_atomic_histogram::bucket(1ull << 14) == uac_histogram::BUCKETS - 1);
+    CHECK(uac_atomic_histogram::bucket(UINT64_MAX) == uac_histogram::BUCKETS - 1);
+
+    uac_atomic_histogram histogram;
+    histogram.record(1000);
+    histogram.record(1001);
+    histogram.record(0);
+    auto snapshot = histogram.snapshot();
+    CHECK(snapshot.counts[10] == 2);
+    CHECK(snapshot.counts[0] == 1);
+
+    histogram.reset();
+    CHECK(histogram.snapshot().counts[10] == 0);
+}
+
+TEST_CASE("test uac_stream_counters snapshot") {
+    uac_stream_counters counters;
+    uac_stream_counters::add(counters.packets, 3);
+    uac_stream_counters::add(counters.bytes, 576);
+    uac_stream_counters::add(counters.timeouts, 1);
+    counters.completionInterval.record(1000);
+
+    auto metrics = counters.snapshot(8);
+    CHECK(metrics.packets == 3);
+    CHECK(metrics.bytes == 576);
+    CHECK(metrics.timeouts == 1);
+    CHECK(metrics.failed_packets == 0);
+    CHECK(metrics.in_flight_transfers == 8);
+    CHECK(metrics.completion_interval.counts[10] == 1);
+
+    counters.reset();
+    CHECK(counters.snapshot(0).packets == 0);
+}
@@ -0,0 +1,77 @@
+#include <doctest.h>
+#include "uac_packet_sizer.h"
+
+using namespace uac;
+
+TEST_CASE("test uac_packet_sizer 48kHz") {
+    uac_packet_sizer sizer(48000, 1000);
+    for (int i = 0; i < 100; ++i) {
+        CHECK(sizer.next() == 48);
+    }
+    CHECK(sizer.max_frames() == 48);
+}
+
+TEST_CASE("test uac_packet_sizer 44.1kHz pattern") {
+    uac_packet_sizer sizer(44100, 1000);
+    CHECK(sizer.max_frames() == 45);
+
+    uint32_t total = 0;
+    for (int i = 0; i < 10; ++i) {
+        uint32_t frames = sizer.next();
+        CHECK((frames == 44 || frames == 45));
+        total += frames;
+    }
+    CHECK(total == 441);
+
+    // no drift over a long run
+    for (int i = 0; i < 999990; ++i) {
+        total += sizer.next();
+    }
+    CHECK(total == 44100 * 1000);
+}
+
+TEST_CASE("test uac_packet_sizer deferred frames") {
+    uac_packet_sizer sizer(48000, 1000);
+    sizer.defer(3);
+    CHECK(sizer.next() == 51);
+    CHECK(sizer.next() == 48);
+}
+
+TEST_CASE("test iso_packets_per_second()") {
+    CHECK(iso_packets_per_second(1, false) == 1000);
+    CHECK(iso_packets_per_second(1, true) == 8000);
+    CHECK(iso_packets_per_second(4, true) == 1000);
+}
+
+TEST_CASE("test decode_feedback()") {
+    const uint32_t nominal = 48u << 16;
+
+    // full speed 10.14, 48.5 frames per frame
+    uint32_t fs = (48u << 14) | (1u << 13);
+    uint8_t fsData[3] = {(uint8_t) fs, (uint8_t) (fs >> 8), (uint8_t) (fs >> 16)};
+    CHECK(decode_feedback(fsData, 3, nominal) == ((48u << 16) | (1u << 15)));
+
+    // high speed 16.16
+    uint32_t hs = (47u << 16) | (1u << 15);
+    uint8_t hsData[4] = {(uint8_t) hs, (uint8_t) (hs >> 8), (uint8_t) (hs >> 16), (uint8_t) (hs >> 24)};
+    CHECK(decode_feedback(hsData, 4, nominal) == hs);
+
+    // 10.14 sent in 4 bytes
+    uint8_t mixedData[4] = {fsData[0], fsData[1], fsData[2], 0};
+    CHECK(decode_feedback(mixedData, 4, nominal) == ((48u << 16) | (1u << 15)));
+
+    uint8_t garbage[3] = {1, 0, 0};
+    CHECK(decode_feedback(garbage, 3, nominal) == 0);
+}
+
+TEST_CASE("test uac_packet_sizer follows feedback") {
+    uac_packet_sizer sizer(48000, 1000);
+    sizer.set_feedback((48u << 16) | (1u << 15));
+
+    uint32_t total = 0;
+    for (int i = 0; i < 1000; ++i) {
+        total += sizer.next();
+    }
+    CHECK(total == 48500);
+    CHECK(sizer.max_frames() == 49);
+}
@@ -18,17 +18,33 @@ TEST_CASE("test building audio function topology") {
     uac_audiocontrol ac(1, 0);
     
     uac_output_terminal ot = uac_output_terminal {1, 0x100, 0, 3};
-    uac_feature_unit ftunit = uac_feature_unit {UAC_AC_FEATURE_UNIT, 3, 2};
     uac_input_terminal it = uac_input_terminal {2, 0x200};
+    const uint8_t ftSource = 2;
+    uac_unit_desc ftunit{};
+    ftunit.unitType = UAC_AC_FEATURE_UNIT;
+    ftunit.bUnitID = 3;
+    ftunit.sourceIds = {&ftSource, 1};
     
-    ac.outputTerminals.push_back(std::make_shared<uac_output_terminal>(ot));
-    ac.inputTerminals.push_back(std::make_shared<uac_input_terminal>(it));
-    ac.units.push_back(std::make_shared<uac_feature_unit>(ftunit));
+    ac.outputTerminals = ac.arena.copy_array(&ot, 1);
+    ac.inputTerminals = ac.arena.copy_array(&it, 1);
+    ac.units = ac.arena.make_array<uac_unit_desc>(1);
+    ac.units[0] = ftunit;
 
     ac.configure_audio_function();
     REQUIRE(ac.audio_routes().size() == 1);
 
     auto& route = ac.audio_routes()[0];
+    auto entities = route.get_entities();
+    REQUIRE(entities.size() == 3);
+    CHECK(entities[0].kind == uac_topology_entity::OUTPUT_TERMINAL);
+    CHECK(entities[0].firstSource == 1);
+    CHECK(entities[0].numSources == 1);
+    CHECK(entities[1].kind == uac_topology_entity::UNIT);
+    CHECK(entities[1].sink == 0);
+    CHECK(entities[2].kind == uac_topology_entity::INPUT_TERMINAL);
+    CHECK(entities[2].sink == 1);
+    REQUIRE(route.source_unit() != nullptr);
+    CHECK(route.source_unit()->bUnitID == 3);
 
     ref_uac_audio_route ref_route = route;
     std::vector<ref_uac_audio_route> list;
@@ -39,18 +55,259 @@ TEST_CASE("test building audio function topology") {
 }
 
 TEST_CASE("test topology()") {
+    uac_audiocontrol ac(1, 0);
     uac_output_terminal ot = uac_output_terminal {1, UAC_TERMINAL_USB_STREAMING, 0, 2};
     uac_input_terminal it = uac_input_terminal {2, UAC_TERMINAL_MICROPHONE};
 
     REQUIRE_EQ(UAC_TERMINAL_USB_UNDEFINED & 0xFF , 0);
     REQUIRE_EQ(UAC_TERMINAL_USB_STREAMING & 0xFF , 1);
 
-    auto entry = std::make_shared<uac_topology_entity>(std::make_shared<uac_output_terminal>(ot));
-    entry->link_source(std::make_shared<uac_input_terminal>(it));
-    uac_audio_route_impl topology(entry);
+    ac.outputTerminals = ac.arena.copy_array(&ot, 1);
+    ac.inputTerminals = ac.arena.copy_array(&it, 1);
+    ac.configure_audio_function();
+    REQUIRE(ac.audio_routes().size() == 1);
+    auto& topology = ac.audio_routes()[0];
 
     CHECK(topology.contains_terminal(UAC_TERMINAL_USB_STREAMING) == true);
     CHECK(topology.contains_terminal(UAC_TERMINAL_USB_UNDEFINED) == true);
     CHECK(topology.contains_terminal(UAC_TERMINAL_MICROPHONE) == true);
     CHECK(topology.contains_terminal(UAC_TERMINAL_INPUT_UNDEFINED) == true);
+    CHECK(topology.source_unit() == nullptr);
+}
+
+TEST_CASE("test route terminal ids") {
+    uac_audiocontrol ac(1, 0);
+    uac_output_terminal ot = uac_output_terminal {1, UAC_TERMINAL_SPEAKER, 0, 2};
+    uac_input_terminal it = uac_input_terminal {2, UAC_TERMINAL_USB_STREAMING};
+
+    ac.outputTerminals = ac.arena.copy_array(&ot, 1);
+    ac.inputTerminals = ac.arena.copy_array(&it, 1);
+    ac.configure_audio_function();
+    REQUIRE(ac.audio_routes().size() == 1);
+    auto& route = ac.audio_routes()[0];
+
+    // a playback stream links to the USB streaming input terminal
+    CHECK(route.contains_terminal_id(1));
+    CHECK(route.contains_terminal_id(2));
+    CHECK_FALSE(route.contains_terminal_id(3));
+}
+
+TEST_CASE("test cyclic topology is bounded") {
+    uac_audiocontrol ac(1, 0);
+    uac_output_terminal ot = uac_output_terminal {1, UAC_TERMINAL_SPEAKER, 0, 3};
+    const uint8_t ftSource = 3;
+    uac_unit_desc ftunit{};
+    ftunit.unitType = UAC_AC_FEATURE_UNIT;
+    ftunit.bUnitID = 3;
+    ftunit.sourceIds = {&ftSource, 1};
+
+    ac.outputTerminals = ac.arena.copy_array(&ot, 1);
+    ac.units = ac.arena.make_array<uac_unit_desc>(1);
+    ac.units[0] = ftunit;
+    ac.configure_audio_function();
+    REQUIRE(ac.audio_routes().size() == 1);
+    CHECK(ac.audio_routes()[0].get_entities().size() == 2);
+}
+
+TEST_CASE("test routes through all unit types") {
+    uint8_t extra[] = {
+        8, 0x24, UAC_AC_HEADER, 0x00, 0x01, 0, 0, 0,
+        12, 0x24, UAC_AC_INPUT_TERMINAL, 1, 0x01, 0x02, 0, 1, 0, 0, 0, 0,  // microphone
+        12, 0x24, UAC_AC_INPUT_TERMINAL, 2, 0x01, 0x01, 0, 2, 3, 0, 0, 0,  // USB streaming
+        8, 0x24, UAC_AC_SELECTOR_UNIT, 4, 2, 1, 2, 0,
+        13, 0x24, UAC_AC_PROCESSING_UNIT, 5, 0x01, 0x00, 1, 4, 2, 3, 0, 0, 0,
+        13, 0x24, UAC_AC_EXTENSION_UNIT, 6, 0x34, 0x12, 1, 5, 2, 3, 0, 0, 0,
+        9, 0x24, UAC_AC_FEATURE_UNIT, 7, 6, 1, 0x01, 0x00, 0,
+        9, 0x24, UAC_AC_OUTPUT_TERMINAL, 8, 0x01, 0x01, 0, 7, 0,           // USB streaming
+        13, 0x24, UAC_AC_MIXER_UNIT, 3, 2, 1, 2, 2, 3, 0, 0, 0x00, 0,
+        9, 0x24, UAC_AC_OUTPUT_TERMINAL, 9, 0x01, 0x03, 0, 3, 0,           // speaker
+    };
+    libusb_interface_descriptor control{};
+    control.bInterfaceClass = LIBUSB_CLASS_AUDIO;
+    control.bInterfaceSubClass = UAC_SUBCLASS_AUDIOCONTROL;
+    control.extra = extra;
+    control.extra_length = sizeof(extra);
+    libusb_interface interfaces[1] = {{&control, 1}};
+    libusb_config_descriptor config{};
+    config.bNumInterfaces = 1;
+    config.interface = interfaces;
+
+    std::unique_ptr<uac_audiocontrol> audiocontrol;
+    REQUIRE(uac_scan_config(&config, audiocontrol) == UAC_PARSE_OK);
+    REQUIRE(audiocontrol->units.size() == 5);
+    CHECK(audiocontrol->units[2].wProcessType == 0x1234);
+    REQUIRE(audiocontrol->audio_routes().size() == 2);
+
+    // feature < extension < processing < selector < both input terminals
+    auto& capture = audiocontrol->audio_routes()[0];
+    CHECK(capture.get_entities().size() == 7);
+    CHECK(capture.contains_terminal_in(UAC_TERMINAL_MICROPHONE));
+    CHECK(capture.contains_terminal_id(1));
+    CHECK(capture.contains_terminal_id(2));
+    REQUIRE(capture.source_unit() != nullptr);
+    CHECK(capture.source_unit()->bUnitID == 7);
+
+    auto& playback = audiocontrol->audio_routes()[1];
+    CHECK(playback.get_entities().size() == 4);
+    CHECK(playback.contains_terminal_out(UAC_TERMINAL_SPEAKER));
+    CHECK(playback.contains_terminal_in(UAC_TERMINAL_USB_STREAMING));
+    REQUIRE(playback.source_unit() != nullptr);
+    CHECK(playback.source_unit()->unitType == UAC_AC_MIXER_UNIT);
+    CHECK(playback.source_unit()->sourceIds.size() == 2);
+}
+
+TEST_CASE("test uac_has_audiocontrol()") {
+    libusb_interface_descriptor hid{};
+    hid.bInterfaceClass = LIBUSB_CLASS_HID;
+    libusb_interface_descriptor control{};
+    control.bInterfaceClass = LIBUSB_CLASS_AUDIO;
+    control.bInterfaceSubClass = UAC_SUBCLASS_AUDIOCONTROL;
+
+    libusb_interface interfaces[2] = {{&hid, 1}, {&control, 1}};
+    libusb_config_descriptor config{};
+    config.interface = interfaces;
+
+    config.bNumInterfaces = 1;
+    CHECK_FALSE(uac_has_audiocontrol(&config));
+    config.bNumInterfaces = 2;
+    CHECK(uac_has_audiocontrol(&config));
+
+    // an AudioStreaming interface alone does not make an audio function
+    control.bInterfaceSubClass = UAC_SUBCLASS_AUDIOSTREAMING;
+    CHECK_FALSE(uac_has_audiocontrol(&config));
+}
+
+TEST_CASE("test uac_scan_config() errors") {
+    uint8_t header[] = { 9, 0x24, UAC_AC_HEADER, /*bcdADC*/0, 1, /*wTotalLength*/9, 0, /*bInCollection*/1, /*baInterfaceNr*/1 };
+    libusb_interface_descriptor hid{};
+    hid.bInterfaceClass = LIBUSB_CLASS_HID;
+    libusb_interface_descriptor control{};
+    control.bInterfaceClass = LIBUSB_CLASS_AUDIO;
+    control.bInterfaceSubClass = UAC_SUBCLASS_AUDIOCONTROL;
+
+    libusb_interface interfaces[2] = {{&hid, 1}, {&control, 1}};
+    libusb_config_descriptor config{};
+    config.interface = interfaces;
+    std::unique_ptr<uac_audiocontrol> audiocontrol;
+
+    config.bNumInterfaces = 1;
+    CHECK(uac_scan_config(&config, audiocontrol) == UAC_PARSE_NOT_AUDIO);
+    CHECK_FALSE(audiocontrol);
+
+    // the AudioControl interface without a HEADER
+    config.bNumInterfaces = 2;
+    CHECK(uac_scan_config(&config, audiocontrol) == UAC_PARSE_MALFORMED);
+    CHECK_FALSE(audiocontrol);
+
+    // a HEADER listing more streaming interfaces than it holds
+    control.extra = header;
+    control.extra_length = 8;
+    header[0] = 8;
+    CHECK(uac_scan_config(&config, audiocontrol) == UAC_PARSE_MALFORMED);
+
+    control.extra_length = sizeof(header);
+    header[0] = sizeof(header);
+    REQUIRE(uac_scan_config(&config, audiocontrol) == UAC_PARSE_OK);
+    REQUIRE(audiocontrol);
+    CHECK(audiocontrol->streams.size() == 1);
+}
+
+TEST_CASE("test stream capabilities and negotiation") {
+    uint8_t acExtra[] = {9, 0x24, UAC_AC_HEADER, 0x00, 0x01, 9, 0, 1, 1};
+    uint8_t alt1[] = {
+        7, 0x24, UAC_AS_GENERAL, 2, 1, 0x01, 0x00,
+        14, 0x24, UAC_AS_FORMAT_TYPE, UAC_FORMAT_TYPE_I, 2, 2, 16, 2, 0x44, 0xac, 0x00, 0x80, 0xbb, 0x00,
+    };
+    uint8_t alt2[] = {
+        7, 0x24, UAC_AS_GENERAL, 2, 1, 0x01, 0x00,
+        14, 0x24, UAC_AS_FORMAT_TYPE, UAC_FORMAT_TYPE_I, 2, 3, 24, 2, 0x80, 0xbb, 0x00, 0x00, 0x77, 0x01,
+    };
+    uint8_t alt3[] = {
+        7, 0x24, UAC_AS_GENERAL, 2, 1, 0x01, 0x00,
+        14, 0x24, UAC_AS_FORMAT_TYPE, UAC_FORMAT_TYPE_I, 1, 2, 16, 0, 0x40, 0x1f, 0x00, 0x80, 0xbb, 0x00,
+    };
+    libusb_endpoint_descriptor endpoints[3] = {};
+    const uint16_t packetSizes[3] = {192, 576, 96};
+    libusb_interface_descriptor altsettings[4] = {};
+    uint8_t *extras[3] = {alt1, alt2, alt3};
+    for (int i = 0; i < 4; ++i) {
+        altsettings[i].bInterfaceNumber = 1;
+        altsettings[i].bAlternateSetting = i;
+        altsettings[i].bInterfaceClass = LIBUSB_CLASS_AUDIO;
+        altsettings[i].bInterfaceSubClass = UAC_SUBCLASS_AUDIOSTREAMING;
+        if (i == 0) continue;
+        endpoints[i - 1].bEndpointAddress = 0x81;
+        endpoints[i - 1].bmAttributes = LIBUSB_TRANSFER_TYPE_ISOCHRONOUS | 0x04;
+        endpoints[i - 1].wMaxPacketSize = packetSizes[i - 1];
+        endpoints[i - 1].bInterval = 1;
+        altsettings[i].bNumEndpoints = 1;
+        altsettings[i].endpoint = &endpoints[i - 1];
+        altsettings[i].extra = extras[i - 1];
+        altsettings[i].extra_length = sizeof(alt1);
+    }
+    libusb_interface_descriptor control{};
+    control.bInterfaceClass = LIBUSB_CLASS_AUDIO;
+    control.bInterfaceSubClass = UAC_SUBCLASS_AUDIOCONTROL;
+    control.extra = acExtra;
+    control.extra_length = sizeof(acExtra);
+    libusb_interface interfaces[2] = {{&control, 1}, {altsettings, 4}};
+    libusb_config_descriptor config{};
+    config.bNumInterfaces = 2;
+    config.interface = interfaces;
+
+    std::unique_ptr<uac_audiocontrol> audiocontrol;
+    REQUIRE(uac_scan_config(&config, audiocontrol) == UAC_PARSE_OK);
+    REQUIRE(audiocontrol->streams.size() == 1);
+    const uac_stream_if& stream = audiocontrol->streams[0];
+
+    CHECK(stream.get_audio_formats() == std::vector<uac_audio_data_format_type>{UAC_FORMAT_DATA_PCM});
+    CHECK(stream.get_channel_counts(UAC_FORMAT_DATA_PCM) == std::vector<uint8_t>{1, 2});
+    CHECK(stream.get_bit_resolutions(UAC_FORMAT_DATA_PCM) == std::vector<uint8_t>{16, 24});
+    CHECK(stream.get_sample_rates(UAC_FORMAT_DATA_PCM) == std::vector<uint32_t>{8000, 44100, 48000, 96000});
+    CHECK(stream.get_sample_rates(UAC_FORMAT_DATA_IEEE_FLOAT).empty());
+
+    auto first = stream.query_config_uncompressed(UAC_FORMAT_DATA_PCM, 2, 96000);
+    REQUIRE(first);
+    CHECK(first->bAlternateSetting == 2);
+
+    uac_config_request request;
+    request.sampleRate = 48000;
+    auto best = stream.negotiate_config(request);
+    REQUIRE(best);
+    CHECK(best->bAlternateSetting == 2);
+    CHECK(best->tSampleRate == 48000);
+
+    request.preferences = {UAC_PREFER_LOWEST_BANDWIDTH};
+    best = stream.negotiate_config(request);
+    REQUIRE(best);
+    CHECK(best->bAlternateSetting == 3);
+
+    request.preferences = {UAC_PREFER_FEWEST_CHANNELS, UAC_PREFER_HIGHEST_BIT_DEPTH};
+    request.minChannels = 2;
+    best = stream.negotiate_config(request);
+    REQUIRE(best);
+    CHECK(best->bAlternateSetting == 2);
+
+    // the continuous range holds 22050, the stereo altsettings fall back to their closest rate
+    request = uac_config_request{};
+    request.sampleRate = 22050;
+    best = stream.negotiate_config(request);
+    REQUIRE(best);
+    CHECK(best->bAlternateSetting == 3);
+    CHECK(best->tSampleRate == 22050);
+    request.minChannels = 2;
+    best = stream.negotiate_config(request);
+    REQUIRE(best);
+    CHECK(best->bAlternateSetting == 1);
+    CHECK(best->tSampleRate == 44100);
+    request.exactRate = true;
+    CHECK_FALSE(stream.negotiate_config(request));
+
+    // any rate takes the highest of each altsetting
+    auto ranked = stream.rank_configs(uac_config_request{});
+    REQUIRE(ranked.size() == 3);
+    CHECK(ranked[0].bAlternateSetting == 2);
+    CHECK(ranked[0].tSampleRate == 96000);
+    CHECK(ranked[1].bAlternateSetting == 3);
+    CHECK(ranked[2].bAlternateSetting == 1);
 }
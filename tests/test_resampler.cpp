@@ -0,0 +1,134 @@
+#include <doctest.h>
+#include <cmath>
+#include <vector>
+#include "uac_resampler.h"
+
+using namespace uac;
+
+namespace {
+    // resamples a second of a tone in 10ms chunks, as a stream does packet by packet
+    std::vector<float> resample_tone(uint32_t inputRate, uint32_t outputRate, double frequency, uac_resampler_quality quality, uint channels = 1) {
+        const size_t packetFrames = inputRate / 100;
+        uac_resampler resampler(inputRate, outputRate, channels, quality, packetFrames);
+        std::vector<float> input(packetFrames * channels);
+        std::vector<float> output;
+        std::vector<float> packet(resampler.max_output(packetFrames) * channels);
+        for (size_t start = 0; start < inputRate; start += packetFrames) {
+            for (size_t f = 0; f < packetFrames; ++f) {
+                for (uint c = 0; c < channels; ++c) {
+                    input[f * channels + c] = static_cast<float>(0.5 * std::sin(2 * M_PI * frequency * (start + f) / inputRate)) * (c + 1);
+                }
+            }
+            size_t frames = resampler.process(input.data(), packetFrames, packet.data());
+            CHECK(frames <= resampler.max_output(packetFrames));
+            output.insert(output.end(), packet.begin(), packet.begin() + frames * channels);
+        }
+        return output;
+    }
+}
+
+TEST_CASE("test uac_resampler 44.1kHz to 48kHz") {
+    const uint channels = 2;
+    auto output = resample_tone(44100, 48000, 1000, UAC_RESAMPLER_QUALITY_MEDIUM, channels);
+    const size_t frames = output.size() / channels;
+    // the filter holds back half its length
+    CHECK(frames <= 48000);
+    CHECK(frames >= 48000 - 16);
+
+    double worst = 0;
+    for (size_t n = 100; n < frames; ++n) {
+        for (uint c = 0; c < channels; ++c) {
+            double expected = 0.5 * std::sin(2 * M_PI * 1000 * n / 48000) * (c + 1);
+            worst = std::max(worst, std::abs(output[n * channels + c] - expected));
+        }
+    }
+    CHECK(worst < 2e-3);
+}
+
+TEST_CASE("test uac_resampler 48kHz to 16kHz rejects aliases") {
+    auto passband = resample_tone(48000, 16000, 1000, UAC_RESAMPLER_QUALITY_HIGH);
+    CHECK(passband.size() >= 16000 - 32);
+    double worst = 0;
+    for (size_t n = 100; n < passband.size(); ++n) {
+        worst = std::max(worst, std::abs(passband[n] - 0.5 * std::sin(2 * M_PI * 1000 * n / 16000)));
+    }
+    CHECK(worst < 2e-3);
+
+    // 12kHz would alias to 4kHz
+    auto stopband = resample_tone(48000, 16000, 12000, UAC_RESAMPLER_QUALITY_HIGH);
+    double peak = 0;
+    for (size_t n = 100; n < stopband.size(); ++n) {
+        peak = std::max(peak, static_cast<double>(std::abs(stopband[n])));
+    }
+    CHECK(peak < 5e-3);
+}
+
+TEST_CASE("test uac_resampler chunking") {
+    // the output does not depend on how the input is split
+    std::vector<float> input(4410);
+    for (size_t i = 0; i < input.size(); ++i) {
+        input[i] = static_cast<float>(std::sin(i * 0.01));
+    }
+    uac_resampler whole(44100, 16000, 1, UAC_RESAMPLER_QUALITY_LOW, input.size());
+    std::vector<float> expected(whole.max_output(input.size()));
+    expected.resize(whole.process(input.data(), input.size(), expected.data()));
+
+    uac_resampler chunked(44100, 16000, 1, UAC_RESAMPLER_QUALITY_LOW, 7);
+    std::vector<float> actual;
+    for (size_t start = 0; start < input.size(); start += 7) {
+        size_t n = std::min<size_t>(7, input.size() - start);
+        std::vector<float> out(chunked.max_output(n));
+        out.resize(chunked.process(input.data() + start, n, out.data()));
+        actual.insert(actual.end(), out.begin(), out.end());
+    }
+    CHECK(actual == expected);
+}
+
+TEST_CASE("test uac_resampler odd ratio") {
+    // more phases than the table holds
+    uac_resampler resampler(47999, 48000, 1, UAC_RESAMPLER_QUALITY_MEDIUM, 48);
+    std::vector<float> input(48, 0.25f), output(resampler.max_output(48));
+    size_t total = 0;
+    double worst = 0;
+    for (int i = 0; i < 1000; ++i) {
+        size_t frames = resampler.process(input.data(), input.size(), output.data());
+        for (size_t n = 0; n < frames; ++n) {
+            if (total + n > 16) worst = std::max(worst, std::abs(output[n] - 0.25));
+        }
+        total += frames;
+    }
+    CHECK(total >= 48001 - 16);
+    CHECK(total <= 48001);
+    CHECK(worst < 1e-5);
+}
+
+TEST_CASE("test uac_varispeed follows the ratio") {
+    const size_t period = 480;
+    uac_varispeed varispeed(1, UAC_RESAMPLER_QUALITY_MEDIUM, period * 2 + 64);
+    varispeed.set_ratio(1.001);
+    CHECK(varispeed.lag() == 0);
+
+    // a 1kHz tone at 48kHz, read exactly as much as needed for every period
+    size_t consumed = 0;
+    std::vector<float> input(period * 2 + 64), output(period);
+    double worst = 0;
+    for (int i = 0; i < 100; ++i) {
+        size_t needed = varispeed.input_needed(period);
+        CHECK(needed <= input.size());
+        for (size_t f = 0; f < needed; ++f) {
+            input[f] = static_cast<float>(std::sin(2 * M_PI * 1000 * (consumed + f) / 48000));
+        }
+        CHECK(varispeed.process(input.data(), needed, output.data(), period) == period);
+        consumed += needed;
+        for (size_t n = 0; n < period; ++n) {
+            // output frame k lies at input frame k * ratio
+            const double position = (i * period + n) * 1.001;
+            if (i > 0) worst = std::max(worst, std::abs(output[n] - std::sin(2 * M_PI * 1000 * position / 48000)));
+        }
+        // the next output frame, as seen from the end of the input
+        CHECK(std::abs((consumed - varispeed.lag()) - (i + 1) * period * 1.001) < 1e-3);
+    }
+    CHECK(worst < 2e-3);
+    CHECK(consumed >= static_cast<size_t>(100 * period * 1.001));
+    CHECK(consumed <= static_cast<size_t>(100 * period * 1.001) + 16);
+}
@@ -0,0 +1,68 @@
+#include <doctest.h>
+#include <thread>
+#include "uac_ringbuffer.h"
+
+using namespace uac;
+
+TEST_CASE("test uac_ringbuffer capacity") {
+    uac_ringbuffer ring(100);
+    CHECK(ring.capacity() == 128);
+    CHECK(ring.read_available() == 0);
+    CHECK(ring.write_available() == 128);
+}
+
+TEST_CASE("test uac_ringbuffer wrap around") {
+    uac_ringbuffer ring(8);
+    uint8_t in[6] = {1, 2, 3, 4, 5, 6};
+    uint8_t out[8] = {};
+
+    CHECK(ring.write(in, 6) == 6);
+    CHECK(ring.read(out, 4) == 4);
+    CHECK(out[3] == 4);
+
+    // 2 bytes left, the next write wraps around
+    CHECK(ring.write(in, 6) == 6);
+    CHECK(ring.read_available() == 8);
+    CHECK(ring.write(in, 1) == 0);
+
+    CHECK(ring.read(out, 8) == 8);
+    CHECK(out[0] == 5);
+    CHECK(out[1] == 6);
+    CHECK(out[2] == 1);
+    CHECK(out[7] == 6);
+    CHECK(ring.read(out, 1) == 0);
+}
+
+TEST_CASE("test uac_ringbuffer producer and consumer threads") {
+    uac_ringbuffer ring(64);
+    const size_t total = 100000;
+
+    std::thread producer([&ring] {
+        uint8_t value = 0;
+        size_t sent = 0;
+        while (sent < total) {
+            uint8_t chunk[7];
+            for (auto &b : chunk) b = value++;
+            size_t n = std::min(sizeof(chunk), total - sent);
+            size_t written = 0;
+            while (written < n) {
+                written += ring.write(chunk + written, n - written);
+            }
+            sent += n;
+        }
+    });
+
+    uint8_t expected = 0;
+    size_t received = 0;
+    bool ordered = true;
+    while (received < total) {
+        uint8_t chunk[5];
+        size_t n = ring.read(chunk, sizeof(chunk));
+        for (size_t i = 0; i < n; ++i) {
+            ordered &= chunk[i] == expected++;
+        }
+        received += n;
+    }
+    producer.join();
+    CHECK(ordered);
+}
@@ -0,0 +1,81 @@
+#include <doctest.h>
+#include "uac_stream_tuner.h"
+
+using namespace uac;
+
+TEST_CASE("test uac_stream_tuner initial queue") {
+    uac_stream_tuner tuner(8, 1000);
+    CHECK(tuner.packets() == 2);
+    CHECK(tuner.transfers() == 4);
+    CHECK(tuner.latency() == 8);
+
+    uac_stream_tuner minimal(1, 1000);
+    CHECK(minimal.packets() == 1);
+    CHECK(minimal.transfers() == uac_stream_tuner::MIN_TRANSFERS);
+}
+
+TEST_CASE("test uac_stream_tuner grows on late completions") {
+    uac_stream_tuner tuner(8, 1000);
+    int64_t now = 0;
+    for (int i = 0; i < 10; ++i) {
+        now += 2000;
+        tuner.on_completion(now);
+    }
+    CHECK(tuner.latency() == 8);
+
+    // the event thread stalled for 6ms, the queue had only 6ms of headroom
+    now += 6000;
+    tuner.on_completion(now);
+    CHECK(tuner.transfers() == 5);
+
+    tuner.on_timeout();
+    CHECK(tuner.transfers() == 6);
+}
+
+TEST_CASE("test uac_stream_tuner shrinks back to target") {
+    uac_stream_tuner tuner(8, 1000);
+    tuner.on_timeout();
+    tuner.on_timeout();
+    REQUIRE(tuner.latency() == 12);
+
+    int64_t now = 0;
+    for (int i = 0; i < 10000 && tuner.latency() > 8; ++i) {
+        now += 2000;
+        tuner.on_completion(now);
+    }
+    CHECK(tuner.latency() == 8);
+
+    // never below the target
+    for (int i = 0; i < 10000; ++i) {
+        now += 2000;
+        tuner.on_completion(now);
+    }
+    CHECK(tuner.latency() == 8);
+}
+
+TEST_CASE("test uac_stream_tuner with 125us packets") {
+    // a high speed endpoint polled every microframe
+    uac_stream_tuner tuner(8, 8000);
+    CHECK(tuner.packets() == 16);
+    CHECK(tuner.transfers() == 4);
+    CHECK(tuner.latency() == 8);
+
+    int64_t now = 0;
+    for (int i = 0; i < 10; ++i) {
+        now += 2000;
+        tuner.on_completion(now);
+    }
+    CHECK(tuner.transfers() == 4);
+
+    // 5ms is late for a queue with 6ms of headroom
+    now += 5000;
+    tuner.on_completion(now);
+    CHECK(tuner.transfers() == 5);
+    CHECK(tuner.latency() == 10);
+
+    for (int i = 0; i < 10000 && tuner.latency() > 8; ++i) {
+        now += 2000;
+        tuner.on_completion(now);
+    }
+    CHECK(tuner.latency() == 8);
+}
@@ -0,0 +1,28 @@
+#include <doctest.h>
+#include "uac_transfer_pool.h"
+
+using namespace uac;
+
+TEST_CASE("test uac_transfer_pool reuses released transfers") {
+    uac_transfer_pool pool;
+
+    libusb_transfer *transfer = pool.acquire(nullptr, 8, 8 * 192);
+    REQUIRE(transfer != nullptr);
+    REQUIRE(transfer->buffer != nullptr);
+    CHECK(reinterpret_cast<uintptr_t>(transfer->buffer) % 64 == 0);
+    uint8_t *buffer = transfer->buffer;
+
+    pool.release(transfer);
+
+    // a smaller request fits into the cached transfer
+    libusb_transfer *reused = pool.acquire(nullptr, 4, 4 * 192);
+    CHECK(reused == transfer);
+    CHECK(reused->buffer == buffer);
+
+    // a bigger one does not
+    libusb_transfer *other = pool.acquire(nullptr, 16, 16 * 192);
+    CHECK(other != transfer);
+
+    pool.release(reused);
+    pool.release(other);
+}
@@ -0,0 +1,77 @@
+#include <doctest.h>
+#include <cstring>
+#include <thread>
+#include "uac_transfer_queue.h"
+
+using namespace uac;
+
+TEST_CASE("test uac_transfer_queue capacity") {
+    uac_transfer_queue queue(5, 64, 4);
+    CHECK(queue.capacity() == 8);
+    CHECK(queue.size() == 0);
+    CHECK(queue.front() == nullptr);
+    REQUIRE(queue.back() != nullptr);
+    CHECK(queue.back()->packets.size() == 4);
+}
+
+TEST_CASE("test uac_transfer_queue full and empty") {
+    uac_transfer_queue queue(2, 16, 1);
+    for (uint8_t i = 0; i < 2; ++i) {
+        auto *slot = queue.back();
+        REQUIRE(slot != nullptr);
+        slot->buffer[0] = i;
+        slot->num_packets = 1;
+        queue.push();
+    }
+    CHECK(queue.size() == 2);
+    CHECK(queue.back() == nullptr);
+
+    CHECK(queue.front()->buffer[0] == 0);
+    queue.pop();
+    // the freed slot is reused
+    REQUIRE(queue.back() != nullptr);
+    queue.back()->buffer[0] = 2;
+    queue.push();
+
+    CHECK(queue.front()->buffer[0] == 1);
+    queue.pop();
+    CHECK(queue.front()->buffer[0] == 2);
+    queue.pop();
+    CHECK(queue.front() == nullptr);
+}
+
+TEST_CASE("test uac_transfer_queue producer and consumer threads") {
+    uac_transfer_queue queue(4, sizeof(uint32_t), 1);
+    const uint32_t total = 100000;
+
+    std::thread producer([&queue] {
+        for (uint32_t i = 0; i < total;) {
+            auto *slot = queue.back();
+            if (slot == nullptr) {
+                std::this_thread::yield();
+                continue;
+            }
+            memcpy(slot->buffer.get(), &i, sizeof(i));
+            slot->packets[0].actual_length = i;
+            queue.push();
+            ++i;
+        }
+    });
+
+    bool ordered = true;
+    for (uint32_t expected = 0; expected < total;) {
+        auto *slot = queue.front();
+        if (slot == nullptr) {
+            std::this_thread::yield();
+            continue;
+        }
+        uint32_t value;
+        memcpy(&value, slot->buffer.get(), sizeof(value));
+        ordered = ordered && value == expected && slot->packets[0].actual_length == expected;
+        queue.pop();
+        ++expected;
+    }
+    producer.join();
+    CHECK(ordered);
+    CHECK(queue.size() == 0);
+}